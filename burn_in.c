@@ -0,0 +1,258 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Flash stress and throughput burn-in.
+ *
+ * Repeatedly erases, writes, reads back and compares test patterns over a
+ * flash range, and prints throughput, erase time and bit error statistics.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "burn_in.h"
+#include "commands.h"
+#include "mdma.h"
+#include "progress.h"
+#include "util.h"
+
+/// Pattern names, in BiPattern order
+static const char * const biPatName[BI_PAT_MAX] = {
+	"walk", "addr", "rand", "all"
+};
+
+/// Bit error location
+typedef struct {
+	uint32_t iter;		///< Iteration where the error was found.
+	uint32_t addr;		///< Word address.
+	u16 wrote;			///< Value written.
+	u16 read;			///< Value read.
+} BiErr;
+
+/// Results of all iterations
+typedef struct {
+	double *eraseMs;	///< Erase time of each iteration.
+	double *wrKbps;		///< Write throughput (KiB/s) of each iteration.
+	double *rdKbps;		///< Read throughput (KiB/s) of each iteration.
+	uint32_t bitErrs;	///< Total number of bit errors.
+	uint32_t nErr;		///< Number of error locations recorded.
+	BiErr err[BI_ERR_MAX];	///< Recorded error locations.
+} BiStats;
+
+int BiPatternParse(const char *arg, BiCfg *cfg) {
+	const char *sep = strchr(arg, ':');
+	size_t len = sep ? (size_t)(sep - arg) : strlen(arg);
+	char *endPtr;
+	int i;
+
+	for (i = 0; i < BI_PAT_MAX; i++) {
+		if (strlen(biPatName[i]) == len && !strncmp(arg, biPatName[i], len)) {
+			break;
+		}
+	}
+	if (i == BI_PAT_MAX) return 1;
+	cfg->pat = (BiPattern)i;
+	if (sep) {
+		if (BI_PAT_RAND != i && BI_PAT_ALL != i) return 1;
+		cfg->seed = strtoul(sep + 1, &endPtr, 0);
+		if (*endPtr != '\0') return 1;
+	}
+
+	return 0;
+}
+
+/// Fills the buffer with the pattern for the specified iteration
+static BiPattern BiFill(const BiCfg *cfg, uint32_t iter, u16 *buf) {
+	BiPattern pat = cfg->pat;
+	uint32_t state = cfg->seed + iter;
+	uint32_t i, addr;
+
+	if (BI_PAT_ALL == pat) pat = (BiPattern)(iter % BI_PAT_ALL);
+	// xorshift32 does not work with a zero state
+	if (!state) state = 0x2545F491;
+
+	for (i = 0; i < cfg->len; i++) {
+		addr = cfg->addr + i;
+		switch (pat) {
+			case BI_PAT_WALK:
+				buf[i] = 1<<((addr + iter) & 0xF);
+				break;
+
+			case BI_PAT_ADDR:
+				buf[i] = (addr ^ (addr>>16)) & 0xFFFF;
+				break;
+
+			default:
+				state ^= state<<13;
+				state ^= state>>17;
+				state ^= state<<5;
+				buf[i] = state & 0xFFFF;
+				break;
+		}
+	}
+
+	return pat;
+}
+
+/// Counts the bits set in a word
+static int BiBitCount(u16 word) {
+	int count;
+
+	for (count = 0; word; count++) word &= word - 1;
+
+	return count;
+}
+
+/// Comparison function for qsort()
+static int BiCmpDouble(const void *a, const void *b) {
+	double da = *(const double*)a;
+	double db = *(const double*)b;
+
+	return (da > db) - (da < db);
+}
+
+/// Prints min, percentiles and max of an array, sorting it
+static void BiPrintPercentiles(const char *name, double *val, uint32_t n) {
+	qsort(val, n, sizeof(double), BiCmpDouble);
+	printf("%-12s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, val[0],
+			val[n * 50 / 100], val[n * 90 / 100], val[n * 99 / 100],
+			val[n - 1]);
+}
+
+/// Transfers the buffer in chunks. Returns elapsed microseconds, 0 on error
+static uint64_t BiTransfer(const BiCfg *cfg, u16 *buf, MdmaDir dir) {
+	uint64_t start = MonoUs();
+	uint32_t i;
+	u16 step;
+	u16 err;
+
+	for (i = 0; i < cfg->len; i += step) {
+		step = MIN(MdmaChunkLenGet(dir), cfg->len - i);
+		err = (MDMA_DIR_WRITE == dir) ?
+			MDMA_write(step, cfg->addr + i, buf + i) :
+			MDMA_read(step, cfg->addr + i, buf + i);
+		if (err) return 0;
+	}
+
+	return MAX(MonoUs() - start, 1);
+}
+
+/// Compares the pattern with the data read back, recording bit errors.
+/// Returns the number of bit errors in this iteration.
+static uint32_t BiCompare(const BiCfg *cfg, uint32_t iter, const u16 *wrBuf,
+		const u16 *rdBuf, BiStats *st) {
+	uint32_t i, errs = 0;
+	BiErr *e;
+
+	if (!memcmp(wrBuf, rdBuf, cfg->len<<1)) return 0;
+	for (i = 0; i < cfg->len; i++) {
+		if (wrBuf[i] == rdBuf[i]) continue;
+		errs += BiBitCount(wrBuf[i] ^ rdBuf[i]);
+		if (st->nErr < BI_ERR_MAX) {
+			e = &st->err[st->nErr++];
+			e->iter = iter;
+			e->addr = cfg->addr + i;
+			e->wrote = wrBuf[i];
+			e->read = rdBuf[i];
+		}
+	}
+
+	return errs;
+}
+
+/// Prints the summary of the burn-in
+static void BiSummary(const BiCfg *cfg, BiStats *st, uint32_t done) {
+	uint32_t i;
+
+	printf("\nBurn-in summary, %u iteration(s) of 0x%06X:%06X:\n", done,
+			cfg->addr, cfg->len);
+	if (done) {
+		printf("%-12s %10s %10s %10s %10s %10s\n", "", "min", "p50", "p90",
+				"p99", "max");
+		BiPrintPercentiles("Erase (ms)", st->eraseMs, done);
+		BiPrintPercentiles("Write (KiB/s)", st->wrKbps, done);
+		BiPrintPercentiles("Read (KiB/s)", st->rdKbps, done);
+	}
+	printf("Bit errors: %u\n", st->bitErrs);
+	for (i = 0; i < st->nErr; i++) {
+		printf(" - iteration %u, addr 0x%06X: wrote 0x%04X, read 0x%04X\n",
+				st->err[i].iter, st->err[i].addr, st->err[i].wrote,
+				st->err[i].read);
+	}
+	if (st->nErr < st->bitErrs && BI_ERR_MAX == st->nErr) {
+		printf(" - (only the first %d locations are shown)\n", BI_ERR_MAX);
+	}
+}
+
+int BiRun(const BiCfg *cfg, int columns) {
+	BiStats st;
+	u16 *wrBuf, *rdBuf;
+	uint64_t start, wrUs, rdUs;
+	uint32_t iter, errs;
+	BiPattern pat;
+	int ret = 0;
+	const double kib = (double)(cfg->len<<1) / 1024;
+	// Iteration string, e.g.: 12345/12345 walk
+	char iterStr[32];
+
+	memset(&st, 0, sizeof(BiStats));
+	wrBuf = MDMA_BufAlloc(cfg->len);
+	rdBuf = MDMA_BufAlloc(cfg->len);
+	st.eraseMs = (double*)malloc(cfg->iter * sizeof(double));
+	st.wrKbps = (double*)malloc(cfg->iter * sizeof(double));
+	st.rdKbps = (double*)malloc(cfg->iter * sizeof(double));
+	if (!wrBuf || !rdBuf || !st.eraseMs || !st.wrKbps || !st.rdKbps) {
+		perror("Allocating burn-in RAM");
+		ret = -1;
+		goto out;
+	}
+
+	printf("Burn-in of range 0x%06X:%06X, %u iteration(s)...\n", cfg->addr,
+			cfg->len, cfg->iter);
+	PrgBegin("burn-in", 0, columns);
+	for (iter = 0; iter < cfg->iter; iter++) {
+		pat = BiFill(cfg, iter, wrBuf);
+
+		start = MonoUs();
+		if (MdmaRangeErase(cfg->addr, cfg->len, 0)) {
+			PrgEnd();
+			PrintErr("\nErase failed at iteration %u!\n", iter);
+			ret = -1;
+			break;
+		}
+		st.eraseMs[iter] = (MonoUs() - start) / 1000.0;
+
+		if (!(wrUs = BiTransfer(cfg, wrBuf, MDMA_DIR_WRITE)) ||
+				!(rdUs = BiTransfer(cfg, rdBuf, MDMA_DIR_READ))) {
+			PrgEnd();
+			PrintErr("\nTransfer failed at iteration %u!\n", iter);
+			ret = -1;
+			break;
+		}
+		st.wrKbps[iter] = kib * 1000000 / wrUs;
+		st.rdKbps[iter] = kib * 1000000 / rdUs;
+
+		errs = BiCompare(cfg, iter, wrBuf, rdBuf, &st);
+		st.bitErrs += errs;
+		if (errs) ret = 1;
+
+		sprintf(iterStr, "%u/%u %s", iter + 1, cfg->iter, biPatName[pat]);
+		PrgPost(iter + 1, cfg->iter, iterStr);
+	}
+	// Errors end the progress before printing
+	if (iter == cfg->iter) PrgEnd();
+	BiSummary(cfg, &st, iter);
+
+out:
+	MDMA_BufFree(wrBuf);
+	MDMA_BufFree(rdBuf);
+	free(st.eraseMs);
+	free(st.wrKbps);
+	free(st.rdKbps);
+	return ret;
+}
+
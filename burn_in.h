@@ -0,0 +1,83 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Flash stress and throughput burn-in.
+ *
+ * \defgroup burn_in burn_in
+ * \{
+ * \brief Flash stress and throughput burn-in.
+ *
+ * Repeatedly erases, writes, reads back and compares test patterns over a
+ * flash range, recording erase time, write and read throughput and bit
+ * errors for each iteration. A summary with percentiles is printed when
+ * finished, to qualify programmers, hubs and cart batches.
+ *
+ * \warning Burn-in destroys the contents of the tested range.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _BURN_IN_H_
+#define _BURN_IN_H_
+
+#include <stdint.h>
+
+/// Maximum number of bit error locations recorded
+#define BI_ERR_MAX		64
+/// Default number of iterations
+#define BI_ITER_DEF		10
+
+/// Supported test patterns
+typedef enum {
+	BI_PAT_WALK = 0,	///< Walking ones.
+	BI_PAT_ADDR,		///< Address in data.
+	BI_PAT_RAND,		///< Pseudo-random data, from a seed.
+	BI_PAT_ALL,			///< Cycle through all the patterns above.
+	BI_PAT_MAX
+} BiPattern;
+
+/************************************************************************//**
+ * Burn-in configuration.
+ ****************************************************************************/
+typedef struct {
+	uint32_t addr;		///< Start word address of the tested range.
+	uint32_t len;		///< Length in words of the tested range.
+	uint32_t iter;		///< Number of iterations.
+	BiPattern pat;		///< Pattern to use.
+	uint32_t seed;		///< Seed for the random pattern.
+} BiCfg;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Parses a pattern argument: walk, addr, rand[:seed] or all[:seed].
+ *
+ * \param[in]  arg Argument string.
+ * \param[out] cfg Configuration, where pattern and seed are stored.
+ *
+ * \return 0 if OK, 1 if error.
+ ****************************************************************************/
+int BiPatternParse(const char *arg, BiCfg *cfg);
+
+/************************************************************************//**
+ * Runs the burn-in test and prints the results.
+ *
+ * \param[in] cfg     Burn-in configuration.
+ * \param[in] columns Terminal width, for the progress bar.
+ *
+ * \return 0 if no errors were found, 1 if bit errors were found, -1 if
+ * a programmer command failed.
+ ****************************************************************************/
+int BiRun(const BiCfg *cfg, int columns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_BURN_IN_H_*/
+
+/** \} */
+
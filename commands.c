@@ -3,6 +3,12 @@
 // LIBS
 //=============================================================================
 #include "commands.h"
+#include "usb_io.h"
+#include "stats.h"
+#include "trace.h"
+#include "recorder.h"
+#include "probes.h"
+#include "rle.h"
 #include "util.h"
 
 
@@ -16,14 +22,65 @@
 // Default time to make a bulk transfer
 #define REGULAR_TIMEOUT         3000
 #define CART_ERASE_TIMEOUT      70000
+// Interval between erase status polls
+#define ERASE_POLL_MS           100
+// Polls waiting for a cancelled erase transfer to finish
+#define ERASE_CANCEL_POLLS      10
 //#define RETRIES         3
 
+// Runs the calling function as a job on the USB I/O thread, when called from
+// another thread while the I/O thread is running
+#define UIO_FORWARD(type, addr, len, data, aux)	do {			\
+	UioJob job_ = UIO_JOB(type, addr, len, data, aux);		\
+	if (UioForward(&job_)) return job_.result;				\
+} while (0)
+
+// Same as UIO_FORWARD(), for functions not returning a value
+#define UIO_FORWARD_VOID(type)	do {							\
+	UioJob job_ = UIO_JOB(type, 0, 0, NULL, NULL);			\
+	if (UioForward(&job_)) return;							\
+} while (0)
+
 //=============================================================================
 // VARS
 //=============================================================================
-// The megawifi device handle.
-static libusb_device_handle *megawifi_handle = NULL;
-static libusb_device *megawifi_dev = NULL;
+// Programmer session. Each programmer is driven from the thread that opened
+// it (its USB I/O thread).
+typedef struct {
+	// The megawifi device handle.
+	libusb_device_handle *handle;
+	libusb_device *dev;
+	// Run-length encoded payload buffer
+	u16 *rleBuf;
+	// Programmer firmware supports MDMA_WRITE_RLE command
+	int rleSupported;
+	// Programmer firmware accepted an MDMA_WRITE_RLE command
+	int rleChecked;
+	// Transfer receiving the reply of the erase in progress
+	struct libusb_transfer *eraseXfer;
+	// Reply of the erase in progress
+	Command eraseReply;
+	// The erase reply transfer has completed
+	int eraseCompleted;
+	// Opcode and statistics start time of the erase in progress
+	uint8_t eraseOp;
+	uint64_t eraseStart;
+	// Opcode of the last command sent, for the reply statistics
+	uint8_t statsOp;
+	// Address and length of the last command sent, for the trace
+	uint32_t cmdAddr;
+	uint32_t cmdLen;
+} UsbDev;
+
+// Payload length of each read transfer
+static uint16_t usbXferLen = MAX_USB_TRANSFER_LEN;
+// Session opened by the calling thread
+static __thread UsbDev *usbThread = NULL;
+// First session opened, used by threads that did not open one
+static UsbDev *usbFirst = NULL;
+// State used while no session is open
+static UsbDev usbNone = {NULL, NULL, NULL, TRUE, FALSE, NULL, {{0}}, 0, 0, 0, 0,
+	TRC_NONE, TRC_NONE};
 
 
 //=============================================================================
@@ -36,10 +93,52 @@ int megawifi_bulk_get_reply_data( Command * command, u16 *buffer, u16 length, in
 // FUNCTION DECLARATIONS
 //=============================================================================
 
+// Records a transfer in the flight recorder and the trace. The flight
+// recorder is dumped when a transfer fails.
+static void XferLog(uint8_t op, StatsPhase phase, uint64_t start,
+		uint32_t addr, uint32_t len, uint32_t bytes, int result) {
+	RecAdd(op, phase, start, addr, len, bytes, result);
+	TrcXfer(op, phase, start, addr, len, bytes, result);
+	if (result) RecDump(REC_DUMP_NEW);
+}
+
+// Obtains the session of the calling thread
+static UsbDev *UsbCur(void) {
+	if (usbThread) return usbThread;
+
+	return usbFirst ? usbFirst : &usbNone;
+}
+
 /// USB initialization
 int UsbInit(void) {
+	return UsbOpen(0);
+}
+
+int UsbOpen(int idx) {
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	UsbDev *usb;
+	ssize_t n, i;
+	int found = 0;
+    int r;
+
+	UIO_FORWARD(UIO_OPEN, idx, 0, NULL, NULL);
+
+	if (usbThread) {
+		PrintErr("Error: a programmer is already open on this thread\n");
+		return -1;
+	}
+	if (!(usb = (UsbDev*)calloc(1, sizeof(UsbDev)))) {
+		perror("Allocating USB session RAM");
+		return -1;
+	}
+	usb->rleSupported = TRUE;
+	// Closed by UsbClose(), even if opening fails
+	usbThread = usb;
+	if (!usbFirst) usbFirst = usb;
+
     // Init libusb
-    int r = libusb_init(NULL);
+    r = libusb_init(NULL);
 	if (r < 0) {
         PrintErr( "Error: could not init libusb\n" );
         PrintErr( "   Code: %s\n", libusb_error_name(r) );
@@ -50,19 +149,29 @@ int UsbInit(void) {
 	//libusb_set_debug(NULL, LIBUSB_LOG_LEVEL_DEBUG);
 
 
-    // Detecting megawifi device
-	megawifi_handle = libusb_open_device_with_vid_pid( NULL, MeGaWiFi_VID, MeGaWiFi_PID );
+    // Detecting megawifi device, skipping the first idx ones
+	if ((n = libusb_get_device_list(NULL, &list)) < 0) n = 0;
+	for (i = 0; i < n; i++) {
+		if (libusb_get_device_descriptor(list[i], &desc) ||
+				desc.idVendor != MeGaWiFi_VID ||
+				desc.idProduct != MeGaWiFi_PID || found++ < idx) continue;
+		if (libusb_open(list[i], &usb->handle)) usb->handle = NULL;
+		break;
+	}
+	if (n) libusb_free_device_list(list, 1);
 
-	if( megawifi_handle == NULL ) {
-		PrintErr( "Error: could not open device %.4X : %.4X\n", MeGaWiFi_VID, MeGaWiFi_PID );
+	if( usb->handle == NULL ) {
+		PrintErr( "Error: could not open device %.4X : %.4X", MeGaWiFi_VID, MeGaWiFi_PID );
+		if (idx) PrintErr(" #%d", idx + 1);
+		PrintErr("\n");
 		return -1;
 	}
 
-    megawifi_dev = libusb_get_device( megawifi_handle );
+    usb->dev = libusb_get_device( usb->handle );
 
 
     // Set megawifi configuration
-	r = libusb_set_configuration( megawifi_handle, MeGaWiFi_CONFIG );
+	r = libusb_set_configuration( usb->handle, MeGaWiFi_CONFIG );
 	if( r < 0 ) {
         PrintErr( "Error: could not set configuration #%d\n", MeGaWiFi_CONFIG );
         PrintErr( "   Code: %s\n", libusb_error_name(r) );
@@ -70,7 +179,7 @@ int UsbInit(void) {
 	}
 
     // Claiming megawifi interface
-	r = libusb_claim_interface( megawifi_handle, MeGaWiFi_INTERF );
+	r = libusb_claim_interface( usb->handle, MeGaWiFi_INTERF );
     if( r != LIBUSB_SUCCESS )
     {
         PrintErr( "Error: could not claim interface #%d\n", MeGaWiFi_INTERF );
@@ -82,14 +191,130 @@ int UsbInit(void) {
 
 /// Ends USB session with device
 void UsbClose(void) {
-    libusb_release_interface( megawifi_handle, 0 );
+	UsbDev *usb;
+
+	UIO_FORWARD_VOID(UIO_CLOSE);
+
+	if (!(usb = usbThread)) return;
+	MDMA_BufFree(usb->rleBuf);
+	if (usb->handle) {
+		libusb_release_interface( usb->handle, 0 );
 
-    libusb_close( megawifi_handle );
+		libusb_close( usb->handle );
+	}
 
     libusb_exit( NULL );
+	if (usbFirst == usb) usbFirst = NULL;
+	usbThread = NULL;
+	free(usb);
+}
+
+void UsbXferLenSet(uint16_t len) {
+	len = MAX(MIN(len, USB_XFER_LEN_MAX), USB_XFER_LEN_MIN);
+	usbXferLen = len - len % ENDPOINT_LENGTH;
+}
+
+uint16_t UsbXferLenGet(void) {
+	return usbXferLen;
+}
+
+int UsbDevInfoGet(char *serial, int len, uint16_t *bcdDevice) {
+	UsbDev *usb = UsbCur();
+	struct libusb_device_descriptor desc;
+	int r;
+
+	UIO_FORWARD(UIO_DEV_INFO, 0, len, serial, bcdDevice);
+
+	serial[0] = '\0';
+	if (!usb->dev) return -1;
+	r = libusb_get_device_descriptor(usb->dev, &desc);
+	if (r < 0) {
+        PrintErr( "Error: could not get device descriptor\n" );
+        PrintErr( "   Code: %s\n", libusb_error_name(r) );
+		return -1;
+	}
+	*bcdDevice = desc.bcdDevice;
+	if (desc.iSerialNumber && libusb_get_string_descriptor_ascii(
+				usb->handle, desc.iSerialNumber, (unsigned char*)serial,
+				len) < 0) {
+		serial[0] = '\0';
+	}
+
+	return 0;
+}
+
+// Transfer buffer header, stored right before the buffer data
+typedef struct {
+	uint8_t *base;	// Start of the allocated memory
+	size_t len;		// Length of the allocated memory
+	// Device the memory was allocated for with libusb_dev_mem_alloc(), or
+	// NULL if allocated with malloc()
+	libusb_device_handle *devMem;
+} UsbBufHead;
+
+u16 *MDMA_BufAlloc(uint32_t wLen) {
+	UsbBufHead *head;
+	uint8_t *base = NULL;
+	uintptr_t data;
+	size_t len = (wLen<<1) + sizeof(UsbBufHead) + USB_BUF_ALIGN;
+	libusb_device_handle *devMem = NULL;
+
+#if LIBUSB_API_VERSION >= 0x01000105
+	// Device memory is mapped by the kernel driver, so payloads are
+	// transferred without copying them between user and kernel memory
+	if (UsbCur()->handle &&
+			(base = libusb_dev_mem_alloc(UsbCur()->handle, len))) {
+		devMem = UsbCur()->handle;
+	}
+#endif
+	if (!base && !(base = (uint8_t*)malloc(len))) return NULL;
+
+	data = ((uintptr_t)base + sizeof(UsbBufHead) + USB_BUF_ALIGN - 1) &
+		~((uintptr_t)USB_BUF_ALIGN - 1);
+	head = (UsbBufHead*)data - 1;
+	head->base = base;
+	head->len = len;
+	head->devMem = devMem;
+
+	return (u16*)data;
+}
+
+void MDMA_BufFree(u16 *buf) {
+	UsbBufHead *head;
+
+	if (!buf) return;
+	head = (UsbBufHead*)buf - 1;
+#if LIBUSB_API_VERSION >= 0x01000105
+	if (head->devMem) {
+		libusb_dev_mem_free(head->devMem, head->base, head->len);
+		return;
+	}
+#endif
+	free(head->base);
 }
 
+u16 *MDMA_BufToDev(u16 *buf, uint32_t wLen) {
+#if LIBUSB_API_VERSION >= 0x01000105
+	u16 *dev;
 
+	if (!buf || ((UsbBufHead*)buf - 1)->devMem || !UsbCur()->handle) {
+		return buf;
+	}
+	if (!(dev = MDMA_BufAlloc(wLen))) return buf;
+	if (!((UsbBufHead*)dev - 1)->devMem) {
+		// Device memory not available, keep the heap buffer
+		MDMA_BufFree(dev);
+		return buf;
+	}
+	memcpy(dev, buf, wLen<<1);
+	MDMA_BufFree(buf);
+
+	return dev;
+#else
+	(void)wLen;
+	return buf;
+#endif
+}
 
 //-----------------------------------------------------------------------------
 // MDMA_MANID_GET
@@ -100,6 +325,8 @@ u16 MDMA_manId_get(uint16_t *manId)
     Command command_in; // CMD byte + MANID word.
     int r;
 
+	UIO_FORWARD(UIO_MAN_ID, 0, 0, manId, NULL);
+
     r = megawifi_bulk_send_command( "MANID_GET", &command_out );
     if( r < 0 ) return -1;
 
@@ -129,6 +356,8 @@ u16 MDMA_devId_get(uint16_t devId[3])
 
     int r;
 
+	UIO_FORWARD(UIO_DEV_ID, 0, 0, devId, NULL);
+
     r = megawifi_bulk_send_command( "DEVID_GET", &command_out );
     if( r < 0 ) return -1;
 
@@ -160,6 +389,8 @@ u16 MDMA_read( u16 wLen, int addr, u16 * data )
 
     int r;
 
+	UIO_FORWARD(UIO_READ, addr, wLen, data, NULL);
+
 	// Write payload length
 	command_out.frame.len[0] = wLen & 0xFF;
 	command_out.frame.len[1] = wLen>>8;
@@ -185,42 +416,80 @@ u16 MDMA_read( u16 wLen, int addr, u16 * data )
     return 0;
 }
 
-//-----------------------------------------------------------------------------
-// MDMA_CART_ERASE
-//-----------------------------------------------------------------------------
-u16 MDMA_cart_erase()
-{
-    Command command_out = { { MDMA_CART_ERASE } };
-    Command command_in;
-    int r;
+// Completion callback of the erase reply transfer
+// Any thread handling libusb events might run it, so the session is in
+// the transfer user data.
+static void LIBUSB_CALL EraseReplyCb(struct libusb_transfer *xfer) {
+	((UsbDev*)xfer->user_data)->eraseCompleted = TRUE;
+}
 
-    r = megawifi_bulk_send_command( "CART_ERASE", &command_out );
-    if( r < 0 ) return -1;
+// Sends an erase command, and submits the transfer receiving its reply
+// without waiting for it.
+static int EraseStart(s8 *cmd_name, Command *command) {
+	UsbDev *usb = UsbCur();
+	int r;
 
-    //printf( "Erasing flash chip...\n" );
+	if (usb->eraseXfer) {
+		PrintErr("Error: an erase is already in progress\n");
+		return -1;
+	}
+	if (!(usb->eraseXfer = libusb_alloc_transfer(0))) {
+		PrintErr("Error: could not allocate erase transfer\n");
+		return -1;
+	}
+	if (megawifi_bulk_send_command(cmd_name, command) < 0) goto err;
+
+	// No timeout, MDMA_erase_poll() decides when to give up
+	usb->eraseCompleted = FALSE;
+	usb->eraseOp = command->bytes[0];
+	usb->eraseStart = MonoUs();
+	libusb_fill_bulk_transfer(usb->eraseXfer, usb->handle,
+			MeGaWiFi_ENDPOINT_IN, usb->eraseReply.bytes, COMMAND_FRAME_BYTES,
+			EraseReplyCb, usb, 0);
+	r = libusb_submit_transfer(usb->eraseXfer);
+	if (r < 0) {
+		PrintErr("Error: could not wait for %s reply\n", cmd_name);
+		PrintErr("   Code: %s\n", libusb_error_name(r));
+		goto err;
+	}
+	PROBE_ERASE_START(usb->eraseOp, usb->cmdAddr, usb->cmdLen);
 
-    r = megawifi_bulk_get_reply_data( &command_in, NULL, 0, CART_ERASE_TIMEOUT );
-    if( r < 0 ) return -1;
+	return 0;
 
-    // Checks read info
-    if( command_in.frame.cmd == MDMA_OK ) {
-    }
-    else {
-        printf( "\nCommand field byte = 0x%.2X (MDMA_ERR) \n", command_in.frame.cmd );
-        printf( "Error: flash chip was not erased \n" );
-    }
+err:
+	libusb_free_transfer(usb->eraseXfer);
+	usb->eraseXfer = NULL;
+	return -1;
+}
 
+// Polls the erase in progress until it completes or timeout ms elapse.
+static u16 EraseWait(unsigned int timeout) {
+	uint64_t deadline = MonoUs() + timeout * 1000ULL;
+	int r;
 
-    return 0;
+	while (MDMA_ERASE_BUSY == (r = MDMA_erase_poll(ERASE_POLL_MS))) {
+		if (MonoUs() > deadline) {
+			PrintErr("Error: erase timed out!\n");
+			MDMA_erase_cancel();
+			return -1;
+		}
+	}
+
+	return r;
 }
 
-//-----------------------------------------------------------------------------
-// MDMA_RANGE_ERASE
-//-----------------------------------------------------------------------------
-u16 MDMA_range_erase(uint32_t addr, uint32_t length) {
+int MDMA_cart_erase_start(void) {
+	Command command_out = { { MDMA_CART_ERASE } };
+
+	UIO_FORWARD(UIO_ERASE, 0, 0, NULL, NULL);
+
+	return EraseStart("CART_ERASE", &command_out);
+}
+
+int MDMA_range_erase_start(uint32_t addr, uint32_t length) {
 	Command command_out = {{MDMA_RANGE_ERASE}};
-	Command command_in;
-	int r;
+
+	UIO_FORWARD(UIO_ERASE, addr, length, NULL, NULL);
 
 	command_out.erase.addr[0] = addr & 0xFF;
 	command_out.erase.addr[1] = (addr>>8)  & 0xFF;
@@ -230,24 +499,98 @@ u16 MDMA_range_erase(uint32_t addr, uint32_t length) {
 	command_out.erase.dwlen[2] = (length>>16) & 0xFF;
 	command_out.erase.dwlen[3] = (length>>24) & 0xFF;
 
-	r = megawifi_bulk_send_command( "RANGE ERASE", &command_out );
-    if( r < 0 ) return -1;
+	return EraseStart("RANGE ERASE", &command_out);
+}
 
-    r = megawifi_bulk_get_reply_data( &command_in, NULL, 0, CART_ERASE_TIMEOUT );
-    if( r < 0 ) return -1;
+int MDMA_erase_poll(unsigned int timeout) {
+	UsbDev *usb = UsbCur();
+	struct timeval tv;
+	int r;
+
+	UIO_FORWARD(UIO_ERASE_POLL, 0, timeout, NULL, NULL);
+
+	if (!usb->eraseXfer) return -1;
+	if (!usb->eraseCompleted) {
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		r = libusb_handle_events_timeout_completed(NULL, &tv,
+				&usb->eraseCompleted);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			PrintErr("Error: could not poll erase status\n");
+			PrintErr("   Code: %s\n", libusb_error_name(r));
+			MDMA_erase_cancel();
+			return -1;
+		}
+		if (!usb->eraseCompleted) return MDMA_ERASE_BUSY;
+	}
 
+	r = 0;
+	StatsAdd(usb->eraseOp, STATS_REPLY, usb->eraseStart, 0);
+	PROBE_ERASE_END(usb->eraseOp, usb->cmdAddr, usb->cmdLen,
+			usb->eraseXfer->status);
+	XferLog(usb->eraseOp, STATS_REPLY, usb->eraseStart, usb->cmdAddr,
+			usb->cmdLen, usb->eraseXfer->actual_length,
+			usb->eraseXfer->status);
+	if (usb->eraseXfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		PrintErr("Error: erase reply failed (transfer status %d)\n",
+				usb->eraseXfer->status);
+		StatsErr(usb->eraseOp, STATS_REPLY);
+		r = -1;
+	} else if (usb->eraseReply.frame.cmd != MDMA_OK) {
+        printf( "Command field byte = 0x%.2X (MDMA_ERR) \n", usb->eraseReply.frame.cmd );
+        printf( "Error: flash was not erased \n" );
+		r = -1;
+	}
+	libusb_free_transfer(usb->eraseXfer);
+	usb->eraseXfer = NULL;
 
-    // Checks read info
-    if( command_in.frame.cmd != MDMA_OK ) {
-        printf( "Command field byte = 0x%.2X (MDMA_ERR) \n", command_in.frame.cmd );
-        printf( "Error: could not erase flash at 0x%X:%X \n", addr, length );
-    }
+	return r;
+}
 
+void MDMA_erase_cancel(void) {
+	UsbDev *usb = UsbCur();
+	struct timeval tv = {0, ERASE_POLL_MS * 1000};
+	int i;
 
+	UIO_FORWARD_VOID(UIO_ERASE_CANCEL);
 
-	return 0;
+	if (!usb->eraseXfer) return;
+	if (!usb->eraseCompleted && !libusb_cancel_transfer(usb->eraseXfer)) {
+		// The transfer must not be freed until the callback runs
+		for (i = 0; !usb->eraseCompleted && i < ERASE_CANCEL_POLLS; i++) {
+			libusb_handle_events_timeout_completed(NULL, &tv,
+					&usb->eraseCompleted);
+		}
+		if (!usb->eraseCompleted) {
+			// Leak it rather than freeing a transfer still in use
+			usb->eraseXfer = NULL;
+			return;
+		}
+	}
+	libusb_free_transfer(usb->eraseXfer);
+	usb->eraseXfer = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// MDMA_CART_ERASE
+//-----------------------------------------------------------------------------
+u16 MDMA_cart_erase()
+{
+	if (MDMA_cart_erase_start()) return -1;
+
+	return EraseWait(CART_ERASE_TIMEOUT);
 }
 
+//-----------------------------------------------------------------------------
+// MDMA_RANGE_ERASE
+//-----------------------------------------------------------------------------
+u16 MDMA_range_erase(uint32_t addr, uint32_t length) {
+	if (MDMA_range_erase_start(addr, length)) return -1;
+
+	return EraseWait(CART_ERASE_TIMEOUT);
+}
+
+
 //-----------------------------------------------------------------------------
 // MDMA_SECT_ERASE
 //-----------------------------------------------------------------------------
@@ -257,13 +600,17 @@ u16 MDMA_sect_erase( int addr )
     Command command_in;
     int r;
 
+	UIO_FORWARD(UIO_SECT_ERASE, addr, 0, NULL, NULL);
+
     int * addr_pointer = ( int * ) &command_out.bytes[1];
     *addr_pointer = addr;
 
     r = megawifi_bulk_send_command( "SECT_ERASE", &command_out );
     if( r < 0 ) return -1;
+	PROBE_ERASE_START(MDMA_SECT_ERASE, addr, UINT32_MAX);
 
     r = megawifi_bulk_get_reply_data( &command_in, NULL, 0, REGULAR_TIMEOUT );
+	PROBE_ERASE_END(MDMA_SECT_ERASE, addr, UINT32_MAX, r);
     if( r < 0 ) return -1;
 
 
@@ -277,17 +624,74 @@ u16 MDMA_sect_erase( int addr )
     return 0;
 }
 
+// Writes a run-length encoded payload. Returns 0 if data was written, 1 if
+// encoding does not help or it is not supported by the firmware, and -1 on
+// error. There is no way to query the firmware for the command, so until a
+// command is accepted, a failed or rejected one means it is not supported.
+static int MdmaWriteRle(u16 wLen, int addr, const u16 *data) {
+    UsbDev *usb = UsbCur();
+    Command command_out = { { MDMA_WRITE_RLE } };
+    Command command_in;
+	uint64_t start;
+	u16 encLen;
+    int r;
+	int size;
+
+	if (!usb->rleSupported) return 1;
+	if (!usb->rleBuf && !(usb->rleBuf = MDMA_BufAlloc(UINT16_MAX))) return 1;
+	if (!(encLen = RleEncode(data, wLen, usb->rleBuf))) return 1;
+
+	// Write payload lengths and address
+	RleFrameFill(command_out.bytes, wLen, encLen, addr);
+
+    r = megawifi_bulk_send_command( "WRITE_RLE", &command_out );
+    if (r >= 0) r = megawifi_bulk_get_reply_data( &command_in, NULL, 0,
+			REGULAR_TIMEOUT );
+	if (r >= 0 && command_in.frame.cmd != MDMA_OK) r = -1;
+	if (r < 0) {
+		if (usb->rleChecked) return -1;
+		// Older firmware rejects or ignores the command, use raw writes from
+		// now on
+		usb->rleSupported = FALSE;
+		return 1;
+	}
+	usb->rleChecked = TRUE;
+
+	start = MonoUs();
+	PROBE_PAYLOAD_START(MDMA_WRITE_RLE, addr, wLen);
+	r = libusb_bulk_transfer(usb->handle, MeGaWiFi_ENDPOINT_OUT,
+			(unsigned char*)usb->rleBuf, encLen<<1, &size, REGULAR_TIMEOUT);
+	PROBE_PAYLOAD_END(MDMA_WRITE_RLE, addr, wLen, r);
+	XferLog(MDMA_WRITE_RLE, STATS_PAYLOAD, start, addr, wLen, size, r);
+	if (r != LIBUSB_SUCCESS || size != (encLen<<1)) {
+		PrintErr("Error: couldn't write payload!\n");
+		PrintErr("   Code: %s\n", libusb_error_name(r) );
+		StatsErr(MDMA_WRITE_RLE, STATS_PAYLOAD);
+		return -1;
+	}
+	StatsAdd(MDMA_WRITE_RLE, STATS_PAYLOAD, start, encLen<<1);
+
+	return 0;
+}
+
 //-----------------------------------------------------------------------------
 // MDMA_WRITE
 //-----------------------------------------------------------------------------
 u16 MDMA_write( u16 wLen, int addr, u16 * data )
 {
+    UsbDev *usb = UsbCur();
     Command command_out = { { MDMA_WRITE } };
     Command command_in;
+	uint64_t start;
 
     int r;
 	int size;
 
+	UIO_FORWARD(UIO_WRITE, addr, wLen, data, NULL);
+
+	// Send padding and fill areas run-length encoded, when it helps
+	if ((r = MdmaWriteRle(wLen, addr, data)) <= 0) return r;
+
 	// Write payload length
 	command_out.frame.len[0] = wLen & 0xFF;
 	command_out.frame.len[1] = wLen>>8;
@@ -305,12 +709,18 @@ u16 MDMA_write( u16 wLen, int addr, u16 * data )
 
     if( command_in.frame.cmd == MDMA_OK ) {
 		// Send big data payload
-		r = libusb_bulk_transfer(megawifi_handle, MeGaWiFi_ENDPOINT_OUT,
+		start = MonoUs();
+		PROBE_PAYLOAD_START(MDMA_WRITE, addr, wLen);
+		r = libusb_bulk_transfer(usb->handle, MeGaWiFi_ENDPOINT_OUT,
 				((unsigned char*)data), wLen<<1, &size, REGULAR_TIMEOUT);
+		PROBE_PAYLOAD_END(MDMA_WRITE, addr, wLen, r);
+		StatsAdd(MDMA_WRITE, STATS_PAYLOAD, start, size);
+		XferLog(MDMA_WRITE, STATS_PAYLOAD, start, addr, wLen, size, r);
 
 		if (r != LIBUSB_SUCCESS && size != (wLen<<1)) {
 			PrintErr("Error: couldn't write payload!\n");
 			PrintErr("   Code: %s\n", libusb_error_name(r) );
+			StatsErr(MDMA_WRITE, STATS_PAYLOAD);
 		}
 		
     }
@@ -332,6 +742,8 @@ u16 MDMA_bootloader()
     Command command_out = { { MDMA_BOOTLOADER } };
     int r;
 
+	UIO_FORWARD(UIO_BOOTLOADER, 0, 0, NULL, NULL);
+
     r = megawifi_bulk_send_command( "BOOTLOADER", &command_out );
     if( r < 0 ) return -1;
 
@@ -347,6 +759,8 @@ u16 MDMA_button_get(uint8_t *button_status)
 	Command command_in;
     int r;
 
+	UIO_FORWARD(UIO_BUTTON, 0, 0, button_status, NULL);
+
     r = megawifi_bulk_send_command( "BUTTON_GET", &command_out );
     if( r < 0 ) return -1;
 
@@ -362,16 +776,54 @@ u16 MDMA_button_get(uint8_t *button_status)
 
 
 
+// Obtains the address and length of a command frame, TRC_NONE if not
+// applicable. Lengths are in words, but in bytes for WiFi commands.
+static void UsbCmdRange(const Command *c, uint32_t *addr, uint32_t *len) {
+	*addr = *len = TRC_NONE;
+	switch (c->bytes[0]) {
+		case MDMA_READ:
+		case MDMA_WRITE:
+		case MDMA_WRITE_RLE:
+			*addr = c->frame.addr[0] | c->frame.addr[1]<<8 |
+				c->frame.addr[2]<<16;
+			*len = c->frame.len[0] | c->frame.len[1]<<8;
+			break;
+
+		case MDMA_SECT_ERASE:
+			*addr = c->bytes[1] | c->bytes[2]<<8 | c->bytes[3]<<16 |
+				(uint32_t)c->bytes[4]<<24;
+			break;
+
+		case MDMA_RANGE_ERASE:
+			*addr = c->erase.addr[0] | c->erase.addr[1]<<8 |
+				c->erase.addr[2]<<16;
+			*len = c->erase.dwlen[0] | c->erase.dwlen[1]<<8 |
+				c->erase.dwlen[2]<<16 | (uint32_t)c->erase.dwlen[3]<<24;
+			break;
+
+		case MDMA_WIFI_CMD:
+		case MDMA_WIFI_CMD_LONG:
+			*len = c->WiFiFrame.len[0] | c->WiFiFrame.len[1]<<8;
+			break;
+	}
+}
+
 //-----------------------------------------------------------------------------
 // MEGAWIFI_BULK_SEND_COMMAND
 //-----------------------------------------------------------------------------
 int megawifi_bulk_send_command( s8 * cmd_name, Command * command )
 {
+    UsbDev *usb = UsbCur();
+	uint64_t start = MonoUs();
     int ret;
     int size;
 
-    ret = libusb_bulk_transfer( megawifi_handle, MeGaWiFi_ENDPOINT_OUT,
+	UsbCmdRange(command, &usb->cmdAddr, &usb->cmdLen);
+	PROBE_CMD_SEND(command->bytes[0], usb->cmdAddr, usb->cmdLen);
+    ret = libusb_bulk_transfer( usb->handle, MeGaWiFi_ENDPOINT_OUT,
         command->bytes, COMMAND_FRAME_BYTES, &size, REGULAR_TIMEOUT );
+	XferLog(command->bytes[0], STATS_SEND, start, usb->cmdAddr, usb->cmdLen,
+			size, ret);
 
     if( ret != LIBUSB_SUCCESS && size != COMMAND_FRAME_BYTES )
     {
@@ -379,9 +831,12 @@ int megawifi_bulk_send_command( s8 * cmd_name, Command * command )
             cmd_name );
 
 		printf( "   Code: %s\n", libusb_error_name(ret) );
+		StatsErr(command->bytes[0], STATS_SEND);
 
 		return -1;
 	}
+	usb->statsOp = command->bytes[0];
+	StatsAdd(usb->statsOp, STATS_SEND, start, size);
 
     return 0;
 }
@@ -391,34 +846,51 @@ int megawifi_bulk_send_command( s8 * cmd_name, Command * command )
 //-----------------------------------------------------------------------------
 int megawifi_bulk_get_reply_data( Command * command, u16 *buffer, u16 length, int timeout )
 {
+    UsbDev *usb = UsbCur();
+	uint64_t start = MonoUs();
+	uint64_t chunk;
     int ret;
     int size;
 	u16 recvd = 0;
 	u16 step;
 
 	// Receive the reply to the command
-    ret = libusb_bulk_transfer( megawifi_handle,
+    ret = libusb_bulk_transfer( usb->handle,
         MeGaWiFi_ENDPOINT_IN, command->bytes, COMMAND_FRAME_BYTES, &size, timeout );
+	PROBE_CMD_REPLY(usb->statsOp, usb->cmdAddr, usb->cmdLen, ret);
+	XferLog(usb->statsOp, STATS_REPLY, start, usb->cmdAddr, usb->cmdLen,
+			size, ret);
 
     if( ret != LIBUSB_SUCCESS && size != COMMAND_FRAME_BYTES ) {
 		printf( "Error: bulk transfer reply failed \n" );
 		printf( "   Code: %s\n", libusb_error_name(ret) );
+		StatsErr(usb->statsOp, STATS_REPLY);
 		return -1;
 	}
+	StatsAdd(usb->statsOp, STATS_REPLY, start, size);
 
 	if (buffer && length) {
+		start = MonoUs();
 		// Now receive the big data payload
 		while (recvd < length) {
-			step = MIN(MAX_USB_TRANSFER_LEN, (length - recvd)<<1);
-			ret = libusb_bulk_transfer(megawifi_handle, MeGaWiFi_ENDPOINT_IN,
+			step = MIN(usbXferLen, (length - recvd)<<1);
+			chunk = MonoUs();
+			PROBE_PAYLOAD_START(usb->statsOp, usb->cmdAddr + recvd, step>>1);
+			ret = libusb_bulk_transfer(usb->handle, MeGaWiFi_ENDPOINT_IN,
 					(unsigned char*)(buffer+recvd), step, &size, timeout);
+			PROBE_PAYLOAD_END(usb->statsOp, usb->cmdAddr + recvd, step>>1,
+					ret);
+			XferLog(usb->statsOp, STATS_PAYLOAD, chunk, usb->cmdAddr + recvd,
+					step>>1, size, ret);
 		
 			if (ret != LIBUSB_SUCCESS && size != step) {
 				PrintErr("Error: couldn't get read payload!\n");
 				PrintErr("   Code: %s\n", libusb_error_name(ret) );
+				StatsErr(usb->statsOp, STATS_PAYLOAD);
 			}
 			recvd += step>>1;
 		}
+		StatsAdd(usb->statsOp, STATS_PAYLOAD, start, length<<1);
 	}
 
     return 0;
@@ -430,6 +902,8 @@ int MDMA_WiFiCmd(uint8_t *payload, uint8_t len, uint8_t *reply) {
 	uint8_t i;
 	int recvLen;
 
+	UIO_FORWARD(UIO_WIFI_CMD, 0, len, payload, reply);
+
 	if (len > MAX_WIFI_PAYLOAD_BYTES) return 0;
 
     Command command_out = { { MDMA_WIFI_CMD } };
@@ -457,12 +931,15 @@ int MDMA_WiFiCmd(uint8_t *payload, uint8_t len, uint8_t *reply) {
 }
 
 int MDMA_WiFiCmdLong(uint8_t *payload, uint16_t len, uint8_t *reply) {
+	UsbDev *usb = UsbCur();
+	uint64_t start;
 	int r;
 	uint8_t i;
 	int recvLen, size;
-
     Command command_out = { { MDMA_WIFI_CMD_LONG } };
 	Command command_in;
+
+	UIO_FORWARD(UIO_WIFI_CMD_LONG, 0, len, payload, reply);
 	
 	// Write payload length
 	command_out.WiFiFrame.len[0] = len & 0xFF;
@@ -473,12 +950,18 @@ int MDMA_WiFiCmdLong(uint8_t *payload, uint16_t len, uint8_t *reply) {
     if( r < 0 ) return -1;
 
 	// Send big data chunck
-	r = libusb_bulk_transfer(megawifi_handle, MeGaWiFi_ENDPOINT_OUT,
+	start = MonoUs();
+	PROBE_PAYLOAD_START(MDMA_WIFI_CMD_LONG, UINT32_MAX, len);
+	r = libusb_bulk_transfer(usb->handle, MeGaWiFi_ENDPOINT_OUT,
 			payload, len, &size, REGULAR_TIMEOUT);
+	PROBE_PAYLOAD_END(MDMA_WIFI_CMD_LONG, UINT32_MAX, len, r);
+	StatsAdd(MDMA_WIFI_CMD_LONG, STATS_PAYLOAD, start, size);
+	XferLog(MDMA_WIFI_CMD_LONG, STATS_PAYLOAD, start, TRC_NONE, len, size, r);
 
 	if (r != LIBUSB_SUCCESS && size != len) {
 		PrintErr("Error: couldn't write payload!\n");
 		PrintErr("   Code: %s\n", libusb_error_name(r) );
+		StatsErr(MDMA_WIFI_CMD_LONG, STATS_PAYLOAD);
 	}
 	
 	// Get response
@@ -493,9 +976,10 @@ int MDMA_WiFiCmdLong(uint8_t *payload, uint16_t len, uint8_t *reply) {
 
 int MDMA_WiFiCtrl(MdmaWifiCtrlCode code) {
 	int r;
-
     Command command_out = { { MDMA_WIFI_CTRL } };
 	Command command_in;
+
+	UIO_FORWARD(UIO_WIFI_CTRL, code, 0, NULL, NULL);
 	
 	
 	// Write control code
@@ -32,6 +32,7 @@
 #define MDMA_WIFI_CMD_LONG 11 // Long command forwarded to the WiFi chip.
 #define MDMA_WIFI_CTRL     12 // WiFi chip control action (using GPIO pins).
 #define MDMA_RANGE_ERASE   13 // Erase a memory range of the flash chip
+#define MDMA_WRITE_RLE     14 // Run-length encoded flash program request
 #define MDMA_ERR          255 // Used to report ERROR status during command replies
 
 typedef enum {
@@ -68,6 +69,14 @@ typedef enum {
 // Can be up to 512 bytes, but it looks like 384 is the
 // optimum value to maximize speed
 #define MAX_USB_TRANSFER_LEN	384
+// Read transfer length limits for UsbXferLenSet(). The best value depends
+// on the host controller, hubs and firmware.
+#define USB_XFER_LEN_MIN		ENDPOINT_LENGTH
+#define USB_XFER_LEN_MAX		4096
+// Alignment of the buffers allocated by MDMA_BufAlloc(), in bytes
+#define USB_BUF_ALIGN			64
+
+// MDMA_WRITE_RLE payload and frame format are described in rle.h
 
 
 typedef union
@@ -107,9 +116,40 @@ extern "C" {
 //=============================================================================
 int UsbInit(void);
 
+/// Opens the idx-th connected programmer (starting from 0). Each thread can
+/// have a programmer open. Threads that did not open one use the first
+/// programmer opened
+int UsbOpen(int idx);
+
 /// Ends USB session with device
 void UsbClose(void);
 
+/// Sets the payload length of each read transfer, in bytes. It is rounded
+/// down to a multiple of ENDPOINT_LENGTH
+void UsbXferLenSet(uint16_t len);
+
+/// Returns the payload length of each read transfer, in bytes
+uint16_t UsbXferLenGet(void);
+
+/// Obtains the serial number string and firmware version (bcdDevice) of
+/// the programmer. serial is empty if the device has no serial number
+int UsbDevInfoGet(char *serial, int len, uint16_t *bcdDevice);
+
+/// Allocates a buffer for wLen words of MDMA_read()/MDMA_write() payload.
+/// Device memory is used when the platform supports it, so payloads are
+/// not copied to kernel memory. Otherwise the buffer is allocated from the
+/// heap, aligned to USB_BUF_ALIGN bytes. Call it after UsbInit() to get
+/// device memory, and free the buffer with MDMA_BufFree() before UsbClose()
+u16 *MDMA_BufAlloc(uint32_t wLen);
+
+/// Frees a buffer allocated with MDMA_BufAlloc(). buf can be NULL
+void MDMA_BufFree(u16 *buf);
+
+/// Moves a buffer of wLen words allocated with MDMA_BufAlloc() before
+/// UsbInit() to device memory, if available. Returns the buffer to use: the
+/// new one, or buf if it was not moved. buf must not be used after a move
+u16 *MDMA_BufToDev(u16 *buf, uint32_t wLen);
+
 u16 MDMA_manId_get(uint16_t *manId);
 
 u16 MDMA_devId_get(uint16_t devId[3]);
@@ -122,6 +162,26 @@ u16 MDMA_sect_erase( int addr );
 
 u16 MDMA_range_erase(uint32_t addr, uint32_t length);
 
+/// MDMA_erase_poll() return value while the erase is in progress
+#define MDMA_ERASE_BUSY		1
+
+/// Starts erasing the entire flash chip, without waiting for it to finish.
+/// Completion must be checked with MDMA_erase_poll()
+int MDMA_cart_erase_start(void);
+
+/// Starts erasing a memory range, without waiting for it to finish.
+/// Completion must be checked with MDMA_erase_poll()
+int MDMA_range_erase_start(uint32_t addr, uint32_t length);
+
+/// Waits up to timeout ms for the erase in progress to finish. Returns
+/// MDMA_ERASE_BUSY if it has not finished yet, 0 if it has finished, or -1
+/// on error. Other commands cannot be issued until it returns 0 or -1
+int MDMA_erase_poll(unsigned int timeout);
+
+/// Stops waiting for the erase in progress. The programmer must be
+/// reopened before issuing new commands, since the erase reply is pending
+void MDMA_erase_cancel(void);
+
 u16 MDMA_write( u16 wLen, int addr, u16 * data );
 
 u16 MDMA_bootloader();
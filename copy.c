@@ -0,0 +1,233 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Cart to cart copy.
+ *
+ * The range is split at sector boundaries. Reads of the next sectors are
+ * queued on the source I/O thread, up to COPY_RING_SECT sectors ahead, and
+ * each ring slot is read again once the destination has verified it. The
+ * destination functions are run through the I/O thread selected with
+ * UioSet(), so both programmers transfer at the same time.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "copy.h"
+#include "mdma.h"
+#include "commands.h"
+#include "usb_io.h"
+#include "progress.h"
+#include "util.h"
+
+/// Programmer taking part in the copy
+typedef struct {
+	Uio *uio;						///< I/O thread driving the programmer.
+	char serial[COPY_SERIAL_MAX];	///< Programmer serial number.
+} CopyProg;
+
+/// Ring slot
+typedef struct {
+	UioJob job;		///< Source read job.
+	u16 *buf;		///< Sector data, indexed from the sector start.
+} CopySlot;
+
+/// Runs a job on a programmer and waits for it
+static int CopyJob(Uio *uio, UioJobType type, uint32_t addr, uint32_t len,
+		void *data, void *aux) {
+	UioJob job = UIO_JOB(type, addr, len, data, aux);
+
+	UioSubmit(uio, &job);
+	return UioWait(&job);
+}
+
+/// Allocates a sector buffer on the I/O thread of the programmer using it
+static u16 *CopyBufAlloc(Uio *uio) {
+	u16 *buf = NULL;
+
+	CopyJob(uio, UIO_BUF_ALLOC, 0, MDMA_SECT_LEN, &buf, NULL);
+	return buf;
+}
+
+// Opens the first two programmers, each one on its own I/O thread
+static int CopyOpen(CopyProg prog[2]) {
+	uint16_t bcdDevice;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (!(prog[i].uio = UioNew())) return -1;
+		if (CopyJob(prog[i].uio, UIO_OPEN, i, 0, NULL, NULL) < 0) {
+			PrintErr("Could not open MDMA programmer #%d!\n", i + 1);
+			return -1;
+		}
+		if (CopyJob(prog[i].uio, UIO_DEV_INFO, 0, COPY_SERIAL_MAX,
+					prog[i].serial, &bcdDevice) || !prog[i].serial[0]) {
+			sprintf(prog[i].serial, "#%d", i + 1);
+		}
+	}
+	// Erase times are those of the destination chip, detected on first use
+	MdmaChipReset();
+
+	return 0;
+}
+
+static void CopyClose(CopyProg prog[2]) {
+	int i;
+
+	for (i = 1; i >= 0; i--) {
+		if (!prog[i].uio) continue;
+		CopyJob(prog[i].uio, UIO_CLOSE, 0, 0, NULL, NULL);
+		UioFree(prog[i].uio);
+	}
+	MdmaChipReset();
+}
+
+/// Queues the source read of the range part inside a sector
+static void CopyReadSubmit(Uio *src, CopySlot *s, uint32_t addr,
+		uint32_t end, uint32_t sect) {
+	uint32_t lo = MAX(sect * MDMA_SECT_LEN, addr);
+	uint32_t hi = MIN((sect + 1) * MDMA_SECT_LEN, end);
+
+	s->job.type = UIO_READ;
+	s->job.addr = lo;
+	s->job.len = hi - lo;
+	s->job.data = s->buf + (lo - sect * MDMA_SECT_LEN);
+	s->job.aux = NULL;
+	s->job.done = NULL;
+	s->job.ctx = NULL;
+	UioSubmit(src, &s->job);
+}
+
+// Erases, programs and verifies a destination sector. The source data is
+// copied to wr, owned by the destination, and read back into rd, also
+// owned by the destination. If the range covers the sector partially, the
+// destination contents outside the range are read first and programmed
+// again. All buffers hold a whole sector. On error, the copy progress is
+// ended before printing it.
+static int CopySect(uint32_t sect, uint32_t lo, uint32_t hi,
+		const u16 *data, u16 *wr, u16 *rd) {
+	uint32_t base = sect * MDMA_SECT_LEN;
+
+	if (hi - lo < MDMA_SECT_LEN && MDMA_read(MDMA_SECT_LEN, base, wr)) {
+		PrgEnd();
+		PrintErr("\nCouldn't read destination sector 0x%06X!\n", base);
+		return -1;
+	}
+	memcpy(wr + (lo - base), data + (lo - base), (hi - lo)<<1);
+	if (MdmaRangeErase(base, MDMA_SECT_LEN, 0)) {
+		PrgEnd();
+		PrintErr("\nCouldn't erase destination sector 0x%06X!\n", base);
+		return -1;
+	}
+	if (MDMA_write(MDMA_SECT_LEN, base, wr)) {
+		PrgEnd();
+		PrintErr("\nCouldn't write destination sector 0x%06X!\n", base);
+		return -1;
+	}
+	if (MDMA_read(MDMA_SECT_LEN, base, rd)) {
+		PrgEnd();
+		PrintErr("\nCouldn't read destination sector 0x%06X!\n", base);
+		return -1;
+	}
+	if (memcmp(rd, wr, MDMA_SECT_LEN<<1)) {
+		PrgEnd();
+		putchar('\n');
+		MdmaVerifyFail(base, wr, rd, MDMA_SECT_LEN);
+		return -1;
+	}
+
+	return 0;
+}
+
+int CopyRun(uint32_t addr, uint32_t len, const char *srcSerial, int columns) {
+	CopyProg prog[2] = {};
+	CopySlot ring[COPY_RING_SECT] = {};
+	uint32_t end = addr + len;
+	uint32_t first = addr / MDMA_SECT_LEN;
+	uint32_t nSect = (end - 1) / MDMA_SECT_LEN - first + 1;
+	uint32_t done = 0, queued = 0;
+	uint64_t start;
+	u16 *wr = NULL, *rd = NULL;
+	int src = 0;
+	int err = -1;
+	CopySlot *s;
+	// Address string, e.g.: 0x123456
+	char addrStr[9];
+
+	if (!len) return 0;
+	if (CopyOpen(prog)) goto out;
+	if (srcSerial) {
+		for (src = 0; src < 2 && strcmp(srcSerial, prog[src].serial); src++);
+		if (2 == src) {
+			PrintErr("Source programmer %s not found!\n", srcSerial);
+			goto out;
+		}
+	}
+	// Destination functions are called from this thread
+	UioSet(prog[src ^ 1].uio);
+
+	// Ring slots are filled by the source, the destination sector buffers
+	// are only used by the destination
+	for (queued = 0; queued < MIN(nSect, COPY_RING_SECT); queued++) {
+		if (!(ring[queued].buf = CopyBufAlloc(prog[src].uio))) break;
+	}
+	if (queued < MIN(nSect, COPY_RING_SECT) ||
+			!(wr = CopyBufAlloc(prog[src ^ 1].uio)) ||
+			!(rd = CopyBufAlloc(prog[src ^ 1].uio))) {
+		// errno was set on the I/O thread
+		PrintErr("Error: could not allocate copy buffers RAM\n");
+		queued = 0;
+		goto out;
+	}
+
+	printf("Copying 0x%06X:%X from programmer %s to programmer %s...\n",
+			addr, len, prog[src].serial, prog[src ^ 1].serial);
+	start = MonoUs();
+	PrgBegin("copy", MDMA_SECT_LEN * 2, columns);
+	for (queued = 0; queued < MIN(nSect, COPY_RING_SECT); queued++) {
+		CopyReadSubmit(prog[src].uio, &ring[queued], addr, end,
+				first + queued);
+	}
+	for (done = 0; done < nSect; done++) {
+		s = &ring[done % COPY_RING_SECT];
+		if (UioWait(&s->job)) {
+			PrgEnd();
+			PrintErr("\nCouldn't read source sector 0x%06X!\n",
+					(first + done) * MDMA_SECT_LEN);
+			done++;
+			goto out;
+		}
+		if (CopySect(first + done, s->job.addr, s->job.addr + s->job.len,
+					s->buf, wr, rd)) {
+			done++;
+			goto out;
+		}
+		sprintf(addrStr, "0x%06X", s->job.addr + s->job.len);
+		if (queued < nSect) {
+			CopyReadSubmit(prog[src].uio, s, addr, end, first + queued++);
+		}
+		PrgPost(done + 1, nSect, addrStr);
+	}
+	PrgEnd();
+	putchar('\n');
+	printf("Copied and verified %u sector(s) in %.2f s.\n", nSect,
+			(MonoUs() - start) / 1e6);
+	err = 0;
+
+out:
+	// Do not leave a read on a buffer about to be freed
+	for (; done < queued; done++) UioWait(&ring[done % COPY_RING_SECT].job);
+	// Buffers might be device memory of a programmer about to be closed
+	for (s = ring; s < ring + COPY_RING_SECT; s++) MDMA_BufFree(s->buf);
+	MDMA_BufFree(wr);
+	MDMA_BufFree(rd);
+	UioSet(NULL);
+	CopyClose(prog);
+
+	return err;
+}
+
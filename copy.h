@@ -0,0 +1,57 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Cart to cart copy.
+ *
+ * \defgroup copy copy
+ * \{
+ * \brief Cart to cart copy.
+ *
+ * Copies a flash range from the cart on a source programmer to the cart on
+ * a destination programmer, without temporary files. Each programmer is
+ * driven by its own USB I/O thread: the source reads the range sector by
+ * sector into a bounded ring of buffers, while the destination erases,
+ * programs and verifies the sectors already read.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _COPY_H_
+#define _COPY_H_
+
+#include <stdint.h>
+
+/// Number of sector buffers the source can read ahead of the destination
+#define COPY_RING_SECT		8
+
+/// Maximum length of a programmer serial number
+#define COPY_SERIAL_MAX		64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Copies a flash range between the carts on the first two programmers
+ * found. Destination sectors partially covered by the range keep their
+ * contents outside the range.
+ *
+ * \param[in] addr      Word address of the range.
+ * \param[in] len       Length of the range in words.
+ * \param[in] srcSerial Serial number of the source programmer. If NULL,
+ *                      the source is the first programmer found.
+ * \param[in] columns   Progress bar width.
+ *
+ * \return 0 if the range was copied and verified, -1 otherwise.
+ ****************************************************************************/
+int CopyRun(uint32_t addr, uint32_t len, const char *srcSerial, int columns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_COPY_H_*/
+
+/** \} */
+
@@ -0,0 +1,757 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Programmer daemon.
+ *
+ * Clients send each device job as a request header followed by the job
+ * input data. The daemon runs the job on its USB I/O thread and replies
+ * with the job result, followed by the job output data. Clients also send
+ * their flash and verify outcomes as DMN_REQ_COUNT requests, so they are
+ * exported by the daemon metrics.
+ *
+ * The UNIX socket is created with no permissions for other users, and both
+ * ends check the other one runs as the same user, so other users can
+ * neither serve nor send jobs. Clients also refuse to connect to a socket
+ * path that is not a socket owned by them. The TCP port cannot check who is
+ * connecting, so TCP clients must first send a random token, written by
+ * the daemon to a file only its user can read.
+ *
+ * Erases abandoned by a client (cancelled, or left running when the client
+ * disconnects) are waited for while the client still owns the device, so
+ * their reply is not read by a command of another client.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+// Needed for struct ucred
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daemon.h"
+#include "usb_io.h"
+#include "commands.h"
+#include "mdma.h"
+#include "metrics.h"
+#include "util.h"
+
+#ifdef __OS_WIN
+
+int DmnServe(int tcpPort) {
+	PrintErr("Error: daemon mode is not supported on this platform\n");
+	return -1;
+}
+
+int DmnConnect(void) {
+	return 1;
+}
+
+void DmnDisconnect(void) {
+}
+
+const char *DmnSockGet(void) {
+	return "";
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+/// Request header magic number
+#define DMN_MAGIC		0x444D444D
+/// Length of the job data buffer, in words
+#define DMN_BUF_WORDS	0x10000
+/// Interval between stop request checks, in milliseconds
+#define DMN_POLL_MS		500
+/// Longest wait for the reply of an erase abandoned by a client: a chip
+/// erase of the slowest supported chip, with the MdmaEraseWait() margin
+#define DMN_ERASE_DRAIN_MS	85000
+/// Length of the token TCP clients send when connecting, in characters
+#define DMN_TOKEN_LEN	32
+/// Time TCP clients have to send the token, in milliseconds
+#define DMN_TOKEN_TIMEOUT_MS	2000
+/// Request type incrementing a metrics counter (addr) by len, after the
+/// UioJobType values
+#define DMN_REQ_COUNT	0x100
+
+/// Request header, followed by inLen bytes of job input data
+typedef struct {
+	uint32_t magic;		///< DMN_MAGIC.
+	uint32_t type;		///< Job type (UioJobType).
+	uint32_t addr;		///< Job address.
+	uint32_t len;		///< Job length.
+	uint32_t inLen;		///< Length of the input data, in bytes.
+} DmnReq;
+
+/// Reply header, followed by outLen bytes of job data and auxLen bytes of
+/// job auxiliary data
+typedef struct {
+	int32_t result;		///< Job result.
+	uint32_t outLen;	///< Length of the output data, in bytes.
+	uint32_t auxLen;	///< Length of the auxiliary output data, in bytes.
+} DmnRep;
+
+/// Client being served
+typedef struct DmnClient {
+	int fd;						///< Client socket.
+	int tcp;					///< Client connected to the TCP port.
+	pthread_t thread;			///< Thread serving the client.
+	struct DmnClient *next;		///< Next client in the list.
+} DmnClient;
+
+/// Socket used to reach the daemon
+static char dmnSock[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+/// File holding the TCP client token
+static char dmnTokenPath[256];
+/// Token TCP clients must send (daemon side)
+static char dmnToken[DMN_TOKEN_LEN];
+
+/// Connection to the daemon (client side)
+static int dmnFd = -1;
+/// Serializes the jobs sent to the daemon (client side)
+static pthread_mutex_t dmnFdLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Clients being served, and the client owning the device during an erase
+static DmnClient *dmnClients = NULL;
+static DmnClient *dmnEraseOwner = NULL;
+/// Protects the client list and the erase owner
+static pthread_mutex_t dmnLock = PTHREAD_MUTEX_INITIALIZER;
+/// Client list and erase owner changes
+static pthread_cond_t dmnCond = PTHREAD_COND_INITIALIZER;
+/// Stop requested by a signal, or because the device was lost
+static volatile sig_atomic_t dmnStop = FALSE;
+/// An abandoned erase never finished, so the device replies cannot be
+/// trusted anymore. Protected by dmnLock.
+static int dmnDevLost = FALSE;
+
+const char *DmnSockGet(void) {
+	const char *env;
+
+	if (dmnSock[0]) return dmnSock;
+	if ((env = getenv(DMN_SOCK_ENV)) && env[0]) {
+		snprintf(dmnSock, sizeof(dmnSock), "%s", env);
+	} else if ((env = getenv("XDG_RUNTIME_DIR")) && env[0]) {
+		snprintf(dmnSock, sizeof(dmnSock), "%s/%s", env, DMN_SOCK_FILE);
+	} else {
+		snprintf(dmnSock, sizeof(dmnSock), "/tmp/mdma-%u.sock",
+				(unsigned)getuid());
+	}
+
+	return dmnSock;
+}
+
+/// Checks the process at the other end of a UNIX socket runs as our user
+static int DmnPeerCheck(int fd) {
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) return -1;
+	return cred.uid == getuid() ? 0 : -1;
+#else
+	uid_t uid;
+	gid_t gid;
+
+	if (getpeereid(fd, &uid, &gid)) return -1;
+	return uid == getuid() ? 0 : -1;
+#endif
+}
+
+/// Checks path is a UNIX socket owned by our user. Returns 1 if it does not
+/// exist, -1 if it exists but is not such a socket.
+static int DmnPathCheck(const char *path) {
+	struct stat st;
+
+	if (lstat(path, &st)) return ENOENT == errno ? 1 : -1;
+
+	return S_ISSOCK(st.st_mode) && st.st_uid == getuid() ? 0 : -1;
+}
+
+/// Obtains the path of the file holding the TCP client token
+static const char *DmnTokenPathGet(void) {
+	const char *env;
+
+	if (dmnTokenPath[0]) return dmnTokenPath;
+	if ((env = getenv("XDG_RUNTIME_DIR")) && env[0]) {
+		snprintf(dmnTokenPath, sizeof(dmnTokenPath), "%s/%s", env,
+				DMN_TOKEN_FILE);
+	} else {
+		snprintf(dmnTokenPath, sizeof(dmnTokenPath), "/tmp/mdma-%u.token",
+				(unsigned)getuid());
+	}
+
+	return dmnTokenPath;
+}
+
+/// Creates a random token for the TCP clients, and writes it to a new file
+/// only our user can read
+static int DmnTokenCreate(void) {
+	const char *path = DmnTokenPathGet();
+	uint8_t rnd[DMN_TOKEN_LEN / 2];
+	FILE *f;
+	int fd, i;
+
+	if (!(f = fopen("/dev/urandom", "rb"))) {
+		perror("/dev/urandom");
+		return -1;
+	}
+	i = fread(rnd, sizeof(rnd), 1, f);
+	fclose(f);
+	if (i != 1) {
+		PrintErr("Error: could not generate the daemon token\n");
+		return -1;
+	}
+	for (i = 0; i < (int)sizeof(rnd); i++) {
+		dmnToken[2 * i] = "0123456789abcdef"[rnd[i]>>4];
+		dmnToken[2 * i + 1] = "0123456789abcdef"[rnd[i] & 0xF];
+	}
+	// A file left by another user cannot be removed, so creating it fails
+	unlink(path);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+					0600)) < 0) {
+		perror(path);
+		dmnToken[0] = '\0';
+		return -1;
+	}
+	if (write(fd, dmnToken, DMN_TOKEN_LEN) != DMN_TOKEN_LEN) {
+		perror(path);
+		close(fd);
+		unlink(path);
+		dmnToken[0] = '\0';
+		return -1;
+	}
+	close(fd);
+
+	return 0;
+}
+
+/// Reads the token written by the daemon, from a file that only our user
+/// can access. Returns 0 if OK, -1 otherwise.
+static int DmnTokenRead(char *token) {
+	struct stat st;
+	int fd, err;
+
+	if ((fd = open(DmnTokenPathGet(), O_RDONLY | O_NOFOLLOW)) < 0) return -1;
+	err = fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+		st.st_uid != getuid() || (st.st_mode & 077) ||
+		read(fd, token, DMN_TOKEN_LEN) != DMN_TOKEN_LEN;
+	close(fd);
+
+	return err ? -1 : 0;
+}
+
+/// Obtains the TCP port of a tcp:port socket string, or 0 if not TCP
+static int DmnTcpPort(const char *sock) {
+	if (strncmp(sock, "tcp:", 4)) return 0;
+
+	return atoi(sock + 4);
+}
+
+/// Creates a socket for a UNIX socket path, or a loopback TCP port if the
+/// path is NULL. Binds and listens on it if requested, connects otherwise
+static int DmnSocket(const char *path, int port, int listening) {
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+	struct sockaddr *sa;
+	socklen_t saLen;
+	int fd, one = 1;
+
+	if (path) {
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		snprintf(un.sun_path, sizeof(un.sun_path), "%s", path);
+		sa = (struct sockaddr*)&un;
+		saLen = sizeof(un);
+	} else {
+		memset(&in, 0, sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons(port);
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sa = (struct sockaddr*)&in;
+		saLen = sizeof(in);
+	}
+	if ((fd = socket(sa->sa_family, SOCK_STREAM, 0)) < 0) return -1;
+	if (!listening) {
+		if (!connect(fd, sa, saLen)) return fd;
+	} else {
+		if (!path) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, sa, saLen) && !listen(fd, SOMAXCONN)) return fd;
+	}
+	close(fd);
+
+	return -1;
+}
+
+/// Sends len bytes
+static int DmnSend(int fd, const void *data, uint32_t len) {
+	const uint8_t *p = (const uint8_t*)data;
+	ssize_t sent;
+
+	while (len) {
+		if ((sent = send(fd, p, len, MSG_NOSIGNAL)) < 0) {
+			if (EINTR == errno) continue;
+			return -1;
+		}
+		p += sent;
+		len -= sent;
+	}
+
+	return 0;
+}
+
+/// Receives len bytes
+static int DmnRecv(int fd, void *data, uint32_t len) {
+	uint8_t *p = (uint8_t*)data;
+	ssize_t recvd;
+
+	while (len) {
+		if ((recvd = recv(fd, p, len, 0)) <= 0) {
+			if (recvd < 0 && EINTR == errno) continue;
+			return -1;
+		}
+		p += recvd;
+		len -= recvd;
+	}
+
+	return 0;
+}
+
+/// Receives the token from a TCP client, and checks it matches ours
+static int DmnTokenCheck(int fd) {
+	struct timeval tv = {DMN_TOKEN_TIMEOUT_MS / 1000,
+		(DMN_TOKEN_TIMEOUT_MS % 1000) * 1000};
+	char token[DMN_TOKEN_LEN];
+	int i, diff = 0;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (DmnRecv(fd, token, DMN_TOKEN_LEN)) return -1;
+	tv.tv_sec = tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	// Compare all the characters, so the time taken does not leak them
+	for (i = 0; i < DMN_TOKEN_LEN; i++) diff |= token[i] ^ dmnToken[i];
+
+	return diff ? -1 : 0;
+}
+
+/// Obtains the maximum lengths in bytes of the input data, output data and
+/// auxiliary output data of a job
+static int DmnJobLen(uint32_t type, uint32_t len, uint32_t *in,
+		uint32_t *out, uint32_t *aux) {
+	*in = *out = *aux = 0;
+	switch (type) {
+		case UIO_DEV_INFO:
+			*out = len;
+			*aux = sizeof(uint16_t);
+			break;
+
+		case UIO_MAN_ID:
+			*out = sizeof(uint16_t);
+			break;
+
+		case UIO_DEV_ID:
+			*out = 3 * sizeof(uint16_t);
+			break;
+
+		case UIO_READ:
+			*out = len<<1;
+			break;
+
+		case UIO_WRITE:
+			*in = len<<1;
+			break;
+
+		case UIO_BUTTON:
+			*out = sizeof(uint8_t);
+			break;
+
+		case UIO_WIFI_CMD:
+		case UIO_WIFI_CMD_LONG:
+			*in = len;
+			*aux = MAX_WIFI_PAYLOAD_BYTES;
+			break;
+
+		default:
+			if (type > UIO_WIFI_CTRL && DMN_REQ_COUNT != type) return -1;
+	}
+
+	return (*in > DMN_BUF_WORDS<<1 || *out > DMN_BUF_WORDS<<1) ? -1 : 0;
+}
+
+/// Runs a job on the daemon (client side remote job handler)
+static void DmnRemote(UioJob *job) {
+	DmnReq req = {DMN_MAGIC, (uint32_t)job->type, job->addr, job->len, 0};
+	DmnRep rep;
+	uint32_t out, aux;
+
+	job->result = -1;
+	if (DmnJobLen(job->type, job->len, &req.inLen, &out, &aux)) return;
+
+	pthread_mutex_lock(&dmnFdLock);
+	if (dmnFd < 0) goto out;
+	if (DmnSend(dmnFd, &req, sizeof(req)) ||
+			DmnSend(dmnFd, job->data, req.inLen) ||
+			DmnRecv(dmnFd, &rep, sizeof(rep)) ||
+			rep.outLen > out || rep.auxLen > aux ||
+			DmnRecv(dmnFd, job->data, rep.outLen) ||
+			DmnRecv(dmnFd, job->aux, rep.auxLen)) {
+		PrintErr("Error: lost connection to the programmer daemon\n");
+		close(dmnFd);
+		dmnFd = -1;
+		goto out;
+	}
+	job->result = rep.result;
+
+out:
+	pthread_mutex_unlock(&dmnFdLock);
+}
+
+/// Counts on the daemon metrics (client side remote counter)
+static void DmnCount(MtrCounter counter, uint32_t n) {
+	UioJob job = UIO_JOB((UioJobType)DMN_REQ_COUNT, counter, n, NULL, NULL);
+
+	DmnRemote(&job);
+}
+
+int DmnConnect(void) {
+	const char *sock = DmnSockGet();
+	int port = DmnTcpPort(sock);
+	char token[DMN_TOKEN_LEN];
+	int check;
+
+	if (!port && (check = DmnPathCheck(sock))) {
+		// Do not send jobs to a socket another user might have created
+		if (check < 0) {
+			PrintErr("Warning: ignoring %s, not a socket owned by you\n",
+					sock);
+		}
+		return 1;
+	}
+	if (port && DmnTokenRead(token)) {
+		PrintErr("Warning: ignoring %s, no daemon token readable only by "
+				"you in %s\n", sock, DmnTokenPathGet());
+		return 1;
+	}
+	if ((dmnFd = DmnSocket(port ? NULL : sock, port, FALSE)) < 0) return 1;
+	if (!port && DmnPeerCheck(dmnFd)) {
+		PrintErr("Warning: ignoring %s, served by another user\n", sock);
+		close(dmnFd);
+		dmnFd = -1;
+		return 1;
+	}
+	if (port && DmnSend(dmnFd, token, DMN_TOKEN_LEN)) {
+		close(dmnFd);
+		dmnFd = -1;
+		return 1;
+	}
+	UioRemoteSet(DmnRemote);
+	MtrRemoteSet(DmnCount);
+
+	return 0;
+}
+
+void DmnDisconnect(void) {
+	if (dmnFd < 0) return;
+
+	UioRemoteSet(NULL);
+	MtrRemoteSet(NULL);
+	close(dmnFd);
+	dmnFd = -1;
+}
+
+/// Waits until no other client owns the device, and submits a job. An
+/// erase claims the device before it is submitted, so no job of another
+/// client can be queued behind it while its reply is pending. Returns 0 if
+/// the job was submitted, -1 if the device was lost.
+static int DmnDevSubmit(DmnClient *cl, UioJob *job) {
+	pthread_mutex_lock(&dmnLock);
+	while (!dmnDevLost && dmnEraseOwner && dmnEraseOwner != cl) {
+		pthread_cond_wait(&dmnCond, &dmnLock);
+	}
+	if (dmnDevLost) {
+		pthread_mutex_unlock(&dmnLock);
+		return -1;
+	}
+	if (UIO_ERASE == job->type) dmnEraseOwner = cl;
+	UioSubmit(UioGet(), job);
+	pthread_mutex_unlock(&dmnLock);
+
+	return 0;
+}
+
+/// Sets the client owning the device while an erase is in progress
+static void DmnEraseOwnerSet(DmnClient *cl, int erasing) {
+	pthread_mutex_lock(&dmnLock);
+	if (erasing) dmnEraseOwner = cl;
+	else if (dmnEraseOwner == cl) dmnEraseOwner = NULL;
+	pthread_cond_broadcast(&dmnCond);
+	pthread_mutex_unlock(&dmnLock);
+}
+
+/// Waits for the reply of an erase abandoned by the client owning the
+/// device, so the next command does not read it as its own reply. If the
+/// erase does not finish, the device is lost and the daemon stops.
+static void DmnEraseDrain(void) {
+	uint64_t deadline = MonoUs() + DMN_ERASE_DRAIN_MS * 1000ULL;
+	int r;
+
+	while (MDMA_ERASE_BUSY == (r = MDMA_erase_poll(MDMA_ERASE_POLL_MS)) &&
+			MonoUs() < deadline);
+	if (MDMA_ERASE_BUSY == r) {
+		MDMA_erase_cancel();
+		PrintErr("Error: abandoned erase did not finish, stopping daemon\n");
+		pthread_mutex_lock(&dmnLock);
+		dmnDevLost = TRUE;
+		pthread_cond_broadcast(&dmnCond);
+		pthread_mutex_unlock(&dmnLock);
+		dmnStop = TRUE;
+	}
+}
+
+/// Serves the jobs of a client until it disconnects
+static void *DmnClientThread(void *arg) {
+	DmnClient *cl = (DmnClient*)arg;
+	DmnClient **pCl;
+	uint8_t aux[MAX_WIFI_PAYLOAD_BYTES];
+	uint32_t in, out, auxLen;
+	int erasing = FALSE;
+	DmnReq req;
+	DmnRep rep;
+	u16 *buf = NULL;
+
+	if (cl->tcp && DmnTokenCheck(cl->fd)) {
+		PrintErr("Warning: rejected a TCP client without the daemon "
+				"token\n");
+		goto out;
+	}
+	if (!(buf = MDMA_BufAlloc(DMN_BUF_WORDS))) {
+		perror("Allocating daemon client buffer RAM");
+		goto out;
+	}
+	while (!DmnRecv(cl->fd, &req, sizeof(req))) {
+		if (DMN_MAGIC != req.magic ||
+				DmnJobLen(req.type, req.len, &in, &out, &auxLen) ||
+				req.inLen != in || DmnRecv(cl->fd, buf, in)) break;
+
+		UioJob job = UIO_JOB((UioJobType)req.type, req.addr, req.len, buf,
+				aux);
+		if (DMN_REQ_COUNT == req.type) {
+			if (req.addr < MTR_COUNTERS) MtrCount((MtrCounter)req.addr, req.len);
+			job.result = 0;
+		} else if (UIO_OPEN == job.type || UIO_CLOSE == job.type) {
+			// The daemon owns the device, clients do not open it
+			job.result = 0;
+		} else if (UIO_ERASE_CANCEL == job.type && erasing) {
+			// The device keeps serving other clients, so the erase reply
+			// cannot be left pending
+			DmnEraseDrain();
+			erasing = FALSE;
+			DmnEraseOwnerSet(cl, FALSE);
+			job.result = 0;
+		} else if (DmnDevSubmit(cl, &job)) {
+			job.result = -1;
+		} else {
+			// An erase in progress blocks the device for other clients
+			UioWait(&job);
+			if (UIO_ERASE == job.type) erasing = !job.result;
+			else if (UIO_ERASE_CANCEL == job.type ||
+					(UIO_ERASE_POLL == job.type &&
+					 MDMA_ERASE_BUSY != job.result)) erasing = FALSE;
+			DmnEraseOwnerSet(cl, erasing);
+		}
+		if (UIO_WIFI_CMD == job.type || UIO_WIFI_CMD_LONG == job.type) {
+			auxLen = job.result > 0 ? MIN(job.result, (int)auxLen) : 0;
+		}
+		rep.result = job.result;
+		rep.outLen = out;
+		rep.auxLen = auxLen;
+		if (DmnSend(cl->fd, &rep, sizeof(rep)) ||
+				DmnSend(cl->fd, buf, out) ||
+				DmnSend(cl->fd, aux, auxLen)) break;
+	}
+	// Do not leave the device blocked by an erase nobody waits for
+	if (erasing) {
+		DmnEraseDrain();
+		DmnEraseOwnerSet(cl, FALSE);
+	}
+	MDMA_BufFree(buf);
+
+out:
+	close(cl->fd);
+	pthread_mutex_lock(&dmnLock);
+	for (pCl = &dmnClients; *pCl != cl; pCl = &(*pCl)->next);
+	*pCl = cl->next;
+	pthread_cond_broadcast(&dmnCond);
+	pthread_mutex_unlock(&dmnLock);
+	free(cl);
+
+	return NULL;
+}
+
+/// Accepts a client and starts a thread serving it. Clients of the UNIX
+/// socket must run as our user.
+static void DmnAccept(int listenFd, int isUnix) {
+	DmnClient *cl;
+	int fd;
+
+	if ((fd = accept(listenFd, NULL, NULL)) < 0) return;
+	if (isUnix && DmnPeerCheck(fd)) {
+		PrintErr("Warning: rejected a client run by another user\n");
+		close(fd);
+		return;
+	}
+	if (!(cl = (DmnClient*)calloc(1, sizeof(DmnClient)))) {
+		close(fd);
+		return;
+	}
+	cl->fd = fd;
+	cl->tcp = !isUnix;
+	pthread_mutex_lock(&dmnLock);
+	if (pthread_create(&cl->thread, NULL, DmnClientThread, cl)) {
+		pthread_mutex_unlock(&dmnLock);
+		PrintErr("Error: could not start daemon client thread\n");
+		close(fd);
+		free(cl);
+		return;
+	}
+	pthread_detach(cl->thread);
+	cl->next = dmnClients;
+	dmnClients = cl;
+	pthread_mutex_unlock(&dmnLock);
+}
+
+static void DmnSigStop(int sig) {
+	dmnStop = TRUE;
+}
+
+/// Creates the UNIX socket with no permissions for other users
+static int DmnUnixBind(const char *path) {
+	mode_t mask = umask(0077);
+	int fd = DmnSocket(path, 0, TRUE);
+	int err = errno;
+
+	umask(mask);
+	errno = err;
+
+	return fd;
+}
+
+/// Opens the UNIX socket, replacing a stale one left by a killed daemon
+static int DmnUnixListen(const char *path) {
+	int fd;
+
+	if ((fd = DmnUnixBind(path)) >= 0) return fd;
+	if (EADDRINUSE != errno) return -1;
+	if (DmnPathCheck(path)) {
+		PrintErr("Error: %s is not a socket owned by you\n", path);
+		errno = EPERM;
+		return -1;
+	}
+	if ((fd = DmnSocket(path, 0, FALSE)) >= 0) {
+		close(fd);
+		PrintErr("Error: a daemon is already serving %s\n", path);
+		return -1;
+	}
+	unlink(path);
+
+	return DmnUnixBind(path);
+}
+
+int DmnServe(int tcpPort) {
+	const char *sock = DmnSockGet();
+	struct pollfd pfd[2];
+	struct sigaction sa;
+	int nFd = 0, unixFd = -1;
+	int sockPort = DmnTcpPort(sock);
+	int err = -1;
+	Uio *uio;
+	int i;
+
+	if (!(uio = UioNew())) return -1;
+	if (UsbInit() < 0) {
+		PrintErr("Could not open MDMA programmer!\n");
+		UioFree(uio);
+		return -1;
+	}
+
+	// TCP clients authenticate with a token only our user can read
+	if ((sockPort || tcpPort) && DmnTokenCreate()) goto out;
+	if (sockPort) {
+		pfd[nFd].fd = DmnSocket(NULL, sockPort, TRUE);
+	} else {
+		// Only the user running the daemon can connect
+		pfd[nFd].fd = unixFd = DmnUnixListen(sock);
+	}
+	if (pfd[nFd++].fd < 0) {
+		perror(sock);
+		goto out;
+	}
+	if (tcpPort && tcpPort != sockPort) {
+		if ((pfd[nFd].fd = DmnSocket(NULL, tcpPort, TRUE)) < 0) {
+			PrintErr("Error: could not listen on TCP port %d: %s\n", tcpPort,
+					strerror(errno));
+			goto out;
+		}
+		nFd++;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = DmnSigStop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Serving MDMA programmer on %s", sock);
+	if (tcpPort && tcpPort != sockPort) printf(" and tcp:%d", tcpPort);
+	printf(", press Ctrl+C to stop.\n");
+	fflush(stdout);
+	for (i = 0; i < nFd; i++) pfd[i].events = POLLIN;
+	while (!dmnStop) {
+		if (poll(pfd, nFd, DMN_POLL_MS) <= 0) continue;
+		for (i = 0; i < nFd; i++) {
+			if (pfd[i].revents & POLLIN) {
+				DmnAccept(pfd[i].fd, pfd[i].fd == unixFd);
+			}
+		}
+	}
+	err = 0;
+
+	// Disconnect the clients, and wait for their threads to finish
+	pthread_mutex_lock(&dmnLock);
+	for (DmnClient *cl = dmnClients; cl; cl = cl->next) {
+		shutdown(cl->fd, SHUT_RDWR);
+	}
+	while (dmnClients) pthread_cond_wait(&dmnCond, &dmnLock);
+	pthread_mutex_unlock(&dmnLock);
+	printf("Daemon stopped.\n");
+
+out:
+	for (i = 0; i < nFd; i++) if (pfd[i].fd >= 0) close(pfd[i].fd);
+	if (unixFd >= 0) unlink(sock);
+	if (dmnToken[0]) unlink(DmnTokenPathGet());
+	UsbClose();
+	UioFree(uio);
+
+	return err;
+}
+
+#endif /*__OS_WIN*/
+
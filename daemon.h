@@ -0,0 +1,75 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Programmer daemon.
+ *
+ * \defgroup daemon daemon
+ * \{
+ * \brief Programmer daemon.
+ *
+ * Keeps the programmer open and claimed, serving the device jobs of other
+ * mdma invocations over a local UNIX socket (and optionally a loopback TCP
+ * port). Clients skip libusb initialization, enumeration and interface
+ * claiming, so short scripted commands run in a few milliseconds.
+ *
+ * Each client is served by its own thread. Client jobs are queued on the
+ * USB I/O thread, so clients are interleaved fairly, job by job. Long
+ * erases are split in polls, so they do not block other clients.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+/// Environment variable overriding the daemon socket. Either a UNIX socket
+/// path, or tcp:port for a loopback TCP port
+#define DMN_SOCK_ENV	"MDMA_DAEMON"
+/// Socket file name, in XDG_RUNTIME_DIR
+#define DMN_SOCK_FILE	"mdma.sock"
+/// File name of the token TCP clients must send, in XDG_RUNTIME_DIR
+#define DMN_TOKEN_FILE	"mdma.token"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Opens the programmer and serves client jobs until SIGINT or SIGTERM is
+ * received.
+ *
+ * \param[in] tcpPort Loopback TCP port to also listen on, 0 for none.
+ *
+ * \return 0 on success, -1 on error.
+ ****************************************************************************/
+int DmnServe(int tcpPort);
+
+/************************************************************************//**
+ * Connects to a running daemon. On success, device jobs are sent to the
+ * daemon from now on.
+ *
+ * \return 0 if connected, 1 if no daemon is running.
+ ****************************************************************************/
+int DmnConnect(void);
+
+/************************************************************************//**
+ * Disconnects from the daemon, if connected.
+ ****************************************************************************/
+void DmnDisconnect(void);
+
+/************************************************************************//**
+ * Obtains the socket used to reach the daemon.
+ *
+ * \return Socket path, or tcp:port string.
+ ****************************************************************************/
+const char *DmnSockGet(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_DAEMON_H_*/
+
+/** \} */
+
@@ -16,11 +16,20 @@
 #include "commands.h"
 #include "util.h"
 #include <sys/stat.h>
-#include "progbar.h"
+#include "progress.h"
+#include "trace.h"
+#include "probes.h"
 
 // Buffer with a flash block
 static EpBuf buf;
 
+// Command names for the trace, starting from EP_OP_FLASH_DOWNLOAD_START
+static const char * const epOpName[] = {
+	"esp flash start", "esp flash data", "esp flash finish",
+	"esp ram start", "esp ram finish", "esp ram data", "esp sync frame",
+	"esp write reg", "esp read reg", "esp spi params"
+};
+
 void EpInit(void) {
 }
 
@@ -36,6 +45,7 @@ static uint32_t EpCsum(const char *data, uint16_t len) {
 }
 
 static int EpSendCmd(EpCmdOp cmd, char data[], uint16_t len, uint32_t csum) {
+	uint64_t trc = TrcStart();
 	int ret;
 	uint16_t i;
 
@@ -48,6 +58,7 @@ static int EpSendCmd(EpCmdOp cmd, char data[], uint16_t len, uint32_t csum) {
 	buf.req.hdr.csum = csum;
 	// Copy data
 	for (i = 0; i < len; i++) buf.req.data[i] = data[i];
+	PROBE_ESP_SEND(cmd, csum, len);
 	// Depending on the command, use the appropiate method to send data
 	if ((EP_OP_RAM_DOWNLOAD_DATA == cmd) ||
 			(EP_OP_FLASH_DOWNLOAD_DATA) == cmd) {
@@ -55,6 +66,8 @@ static int EpSendCmd(EpCmdOp cmd, char data[], uint16_t len, uint32_t csum) {
 	} else {
 		ret = MDMA_WiFiCmd(buf.data, len + sizeof(EpReqHdr), buf.data);
 	}
+	TrcEvent("esp", epOpName[cmd - EP_OP_FLASH_DOWNLOAD_START], trc,
+			TRC_NONE, len, 0 > ret ? -1 : (int)buf.resp.hdr.resp);
 	if (0 > ret) return -1;
 	
 	return buf.resp.hdr.resp;
@@ -172,6 +185,9 @@ void EpBlobFree(EpBlobData *b)
 
 int EpSync(void)
 {
+	uint64_t trc = TrcStart();
+	int ret;
+
 	// Enter bootloader. Delays timing from esptool.py
 	EpReset();
 	DelayMs(100);
@@ -180,7 +196,10 @@ int EpSync(void)
 	EpRun();
 
 	// Sync WiFi chip
-	return EpProgSync();
+	ret = EpProgSync();
+	TrcEvent("esp", "esp sync", trc, TRC_NONE, TRC_NONE, ret);
+
+	return ret;
 }
 
 int EpErase(EpBlobData *b)
@@ -212,6 +231,7 @@ int EpFinish(uint32_t reboot)
 
 // TODO: This function is a mess and should be split
 int EpBlobFlash(const char *file_name, uint32_t addr, const Flags *f) {
+	uint64_t trc = TrcStart();
 	EpBlobData *b = NULL;
 	EpFlashStatus st;
 
@@ -242,15 +262,18 @@ int EpBlobFlash(const char *file_name, uint32_t addr, const Flags *f) {
 	// Flash blob, one sector at a time.
 	// TODO: WARNING, might need to unlock DIO
    	printf("Flashing WiFi firmware %s at 0x%06X...\n", file_name, addr);
+	PrgBegin("wifi flash", EP_FLASH_SECT_LEN, b->cols);
 	do {
 		sprintf(addrStr, "0x%08X", b->sect * EP_FLASH_SECT_LEN);
-		ProgBarDraw(b->sect, b->sect_total, b->cols, addrStr);
+		PrgPost(b->sect, b->sect_total, addrStr);
 		st = EpFlashNext(b);
 	} while (EP_FLASH_REMAINING == st);
 	sprintf(addrStr, "0x%08X", b->sect * EP_FLASH_SECT_LEN);
-	ProgBarDraw(b->sect, b->sect_total, b->cols, addrStr);
+	PrgPost(b->sect, b->sect_total, addrStr);
+	PrgEnd();
 	if (EP_FLASH_DONE != st) {
 		PrintErr("Flash failed!");
+		err = -1;
 		goto err;
 	}
 
@@ -258,6 +281,7 @@ int EpBlobFlash(const char *file_name, uint32_t addr, const Flags *f) {
 	EpFinish(TRUE);
 
 err:
+	TrcEvent("esp", "wifi flash", trc, addr, b ? b->len : TRC_NONE, err);
 	// Free memory and return
 	EpBlobFree(b);
 	return err;
@@ -14,6 +14,40 @@
 #include "flash_man.h"
 #include "util.h"
 #include "commands.h"
+#include "mdma.h"
+#include "progress.h"
+
+/// Progress sink, ctx points to the FlashMan object. Called from the
+/// progress render thread, so the signals are queued to the GUI thread.
+static void FmPrgSink(void *ctx, const PrgEvent *ev) {
+	FlashMan *fm = (FlashMan*)ctx;
+	QString status;
+
+	// The caller reports completion
+	if (ev->end) return;
+	status = QString("%1 %2 KiB/s").arg(ev->name)
+		.arg(ev->rate * ev->unit / 1024, 0, 'f', 0);
+	if (ev->etaS >= 0) {
+		status += QString(", %1:%2 left").arg(ev->etaS / 60)
+			.arg(ev->etaS % 60, 2, 10, QChar('0'));
+	}
+	emit fm->ValueChanged(ev->pos);
+	emit fm->StatusChanged(status);
+}
+
+/// Publishes the progress of a transfer to the FlashMan object signals
+static void FmPrgBegin(FlashMan *fm, const char *name) {
+	PrgSinkSet(FmPrgSink, fm);
+	// Any width makes the operation publish, it is not used by the sink
+	PrgBegin(name, 2, TRUE);
+}
+
+/// Ends the transfer progress, delivering the signals still queued
+static void FmPrgEnd(void) {
+	PrgEnd();
+	PrgSinkSet(NULL, NULL);
+	QApplication::processEvents();
+}
 
 /********************************************************************//**
  * Program a file to the flash chip.
@@ -49,7 +83,7 @@ uint16_t *FlashMan::Program(const char filename[], bool autoErase,
 	    fseek(rom, 0, SEEK_SET);
 	}
 
-    writeBuf = (uint16_t*)malloc(*len<<1);
+    writeBuf = MDMA_BufAlloc(*len);
 	if (!writeBuf) {
 		fclose(rom);
 		return NULL;
@@ -64,8 +98,9 @@ uint16_t *FlashMan::Program(const char filename[], bool autoErase,
 		emit StatusChanged("Auto erasing");
 		QApplication::processEvents();
 		DelayMs(1);
-		if (MDMA_range_erase(*start, *len)) {
-			free(writeBuf);
+		if (MdmaEraseStart(*start, *len) ||
+				EraseWait(*start, *len)) {
+			MDMA_BufFree(writeBuf);
 			return NULL;
 		}
 	}
@@ -75,19 +110,22 @@ uint16_t *FlashMan::Program(const char filename[], bool autoErase,
 	emit StatusChanged("Program...");
 	QApplication::processEvents();
 
+	FmPrgBegin(this, "Program");
 	for (i = 0, addr = *start; i < (*len);) {
 		toWrite = MIN(65536>>1, (*len) - i);
 		if (MDMA_write(toWrite, addr, writeBuf + i)) {
-			free(writeBuf);
+			FmPrgEnd();
+			MDMA_BufFree(writeBuf);
 			fclose(rom);
 			return NULL;
 		}
-		// Update vars and draw progress bar
+		// Update vars and publish progress
 		i += toWrite;
 		addr += toWrite;
-		emit ValueChanged(i);
+		PrgPost(i, *len, NULL);
 		QApplication::processEvents();
 	}
+	FmPrgEnd();
 	emit ValueChanged(i);
 	emit StatusChanged("Done!");
 	QApplication::processEvents();
@@ -117,23 +155,26 @@ uint16_t *FlashMan::Read(uint32_t start, uint32_t len) {
 	emit StatusChanged("Reading");
 	QApplication::processEvents();
 
-	readBuf = (uint16_t*)malloc(len<<1);
+	readBuf = MDMA_BufAlloc(len);
 	if (!readBuf) {
 		return NULL;
 	}
 
+	FmPrgBegin(this, "Reading");
 	for (i = 0, addr = start; i < len;) {
 		toRead = MIN(65536>>1, len - i);
 		if (MDMA_read(toRead, addr, readBuf + i)) {
-			free(readBuf);
+			FmPrgEnd();
+			MDMA_BufFree(readBuf);
 			return NULL;
 		}
-		// Update vars and draw progress bar
+		// Update vars and publish progress
 		i += toRead;
 		addr += toRead;
-		emit ValueChanged(i);
+		PrgPost(i, len, NULL);
 		QApplication::processEvents();
 	}
+	FmPrgEnd();
 	emit ValueChanged(i);
 	emit StatusChanged("Done");
 	QApplication::processEvents();
@@ -150,9 +191,9 @@ uint16_t *FlashMan::Read(uint32_t start, uint32_t len) {
  * \return 0 on success, non-zero if erase operation fails.
  ************************************************************************/
 int FlashMan::RangeErase(uint32_t start, uint32_t len) {
-	if (MDMA_range_erase(start, len)) return -1;
+	if (MdmaEraseStart(start, len)) return -1;
 
-	return 0;
+	return EraseWait(start, len);
 }
 
 /********************************************************************//**
@@ -161,7 +202,30 @@ int FlashMan::RangeErase(uint32_t start, uint32_t len) {
  * \return 0 on success, non-zero if erase operation fails.
  ************************************************************************/
 int FlashMan::FullErase(void) {
-	if (MDMA_cart_erase()) return -1;
+	if (MdmaEraseStart(0, 0)) return -1;
+
+	return EraseWait(0, 0);
+}
+
+/// Erase progress callback, ctx points to the FlashMan object
+static void FmEraseProg(void *ctx, uint32_t elapsedMs, uint32_t expectMs) {
+	FlashMan *fm = (FlashMan*)ctx;
+
+	// Do not reach 100% until the erase completes
+	emit fm->ValueChanged(MIN(elapsedMs, expectMs - expectMs / 100));
+	QApplication::processEvents();
+}
+
+int FlashMan::EraseWait(uint32_t start, uint32_t len) {
+	uint32_t expectMs, timeoutMs;
+
+	MdmaEraseTime(start, len, &expectMs, &timeoutMs);
+	emit RangeChanged(0, MAX(expectMs, 1));
+	emit ValueChanged(0);
+	QApplication::processEvents();
+	if (MdmaEraseWait(start, len, FmEraseProg, this)) return -1;
+	emit ValueChanged(MAX(expectMs, 1));
+	QApplication::processEvents();
 
 	return 0;
 }
@@ -172,7 +236,7 @@ int FlashMan::FullErase(void) {
  * \param[in] buf The address of the buffer to free.
  ************************************************************************/
 void FlashMan::BufFree(uint16_t *buf) {
-	free(buf);
+	MDMA_BufFree(buf);
 }
 
 /********************************************************************//**
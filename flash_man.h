@@ -114,8 +114,8 @@ public:
 
 signals:
 	/********************************************************************//**
-	 * RangeChanged signal. It is emitted by the Flash() and Read() methods
-	 * when the length of the range ro flash/read is determinde.
+	 * RangeChanged signal. It is emitted by the Flash(), Read() and erase
+	 * methods when the length of the range ro flash/read is determinde.
 	 *
 	 * \param[in] min Lower value of the range.
 	 * \param[in] max Higher value of the range.
@@ -138,6 +138,19 @@ signals:
 	 * \param[in] value Position of the flash/read cursor.
 	 ************************************************************************/
 	void ValueChanged(int value);
+
+private:
+	/********************************************************************//**
+	 * Waits for an erase to complete, emitting the elapsed time (in
+	 * milliseconds) against the expected erase time as the progress.
+	 *
+	 * \param[in] start Word memory address of the erased range.
+	 * \param[in] len   Length (in words) of the erased range, 0 for a
+	 *            full chip erase.
+	 *
+	 * eturn 0 on success, non-zero if erase operation fails.
+	 ************************************************************************/
+	int EraseWait(uint32_t start, uint32_t len);
 };
 
 #endif /*_FLASH_MAN_H_*/
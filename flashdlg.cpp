@@ -192,8 +192,14 @@ void FlashEraseTab::Erase(void) {
 	bool ok;
 	FlashMan fm;
 
+	// Show the elapsed time against the expected erase time
+	connect(&fm, &FlashMan::RangeChanged, dlg->progBar,
+			&QProgressBar::setRange);
+	connect(&fm, &FlashMan::ValueChanged, dlg->progBar,
+			&QProgressBar::setValue);
 	dlg->tabs->setEnabled(false);
 	dlg->btnQuit->setVisible(false);
+	dlg->progBar->setVisible(true);
 
 	if (fullCb->isChecked()) {
 		dlg->statusLab->setText("Erasing...");
@@ -213,6 +219,7 @@ void FlashEraseTab::Erase(void) {
 	}
 	if (status) QMessageBox::warning(this, "Error", "Erase failed!");
 
+	dlg->progBar->setVisible(false);
 	dlg->tabs->setEnabled(true);
 	dlg->btnQuit->setVisible(true);
 	dlg->statusLab->setText("Done!");
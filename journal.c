@@ -0,0 +1,160 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Flash job journal.
+ *
+ * Persists the progress of a flash job, so it can be resumed if the
+ * programmer is disconnected or the process is killed.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "journal.h"
+#include "mdma.h"
+#include "util.h"
+#ifdef __OS_WIN
+#include <io.h>
+#endif
+
+/// Journal file header
+typedef struct {
+	char magic[8];		///< JN_MAGIC, without the null termination.
+	uint64_t hash;		///< Hash of the image being flashed.
+	uint32_t addr;		///< Start word address of the job.
+	uint32_t len;		///< Length in words of the job.
+} JnHdr;
+
+/// Flushes the journal file to disk
+static int JnSync(Journal *jn) {
+	if (fflush(jn->f)) return -1;
+#ifdef __OS_WIN
+	return _commit(_fileno(jn->f));
+#else
+	return fsync(fileno(jn->f));
+#endif
+}
+
+/// Allocates a journal for a job
+static Journal *JnAlloc(const char *file, uint64_t hash, uint32_t addr,
+		uint32_t len) {
+	Journal *jn;
+
+	if (!(jn = (Journal*)calloc(1, sizeof(Journal)))) return NULL;
+	jn->hash = hash;
+	jn->addr = addr;
+	jn->len = len;
+	jn->nSect = len ? (addr + len - 1) / MDMA_SECT_LEN -
+		addr / MDMA_SECT_LEN + 1 : 0;
+	jn->state = (uint8_t*)calloc(MAX(jn->nSect, 1), 1);
+	jn->file = (char*)malloc(strlen(file) + 1);
+	if (!jn->state || !jn->file) {
+		JnClose(jn, FALSE);
+		return NULL;
+	}
+	strcpy(jn->file, file);
+
+	return jn;
+}
+
+Journal *JnCreate(const char *file, uint64_t hash, uint32_t addr,
+		uint32_t len) {
+	Journal *jn;
+	JnHdr hdr;
+
+	if (!(jn = JnAlloc(file, hash, addr, len))) {
+		perror("Allocating journal RAM");
+		return NULL;
+	}
+	if (!(jn->f = fopen(file, "w+b"))) {
+		perror(file);
+		JnClose(jn, FALSE);
+		return NULL;
+	}
+	memset(&hdr, 0, sizeof(JnHdr));
+	memcpy(hdr.magic, JN_MAGIC, sizeof(hdr.magic));
+	hdr.hash = hash;
+	hdr.addr = addr;
+	hdr.len = len;
+	if ((fwrite(&hdr, sizeof(JnHdr), 1, jn->f) != 1) ||
+			(fwrite(jn->state, MAX(jn->nSect, 1), 1, jn->f) != 1) ||
+			JnSync(jn)) {
+		perror(file);
+		JnClose(jn, TRUE);
+		return NULL;
+	}
+
+	return jn;
+}
+
+Journal *JnOpen(const char *file, uint64_t hash, uint32_t addr,
+		uint32_t len) {
+	Journal *jn;
+	JnHdr hdr;
+	uint32_t i;
+
+	if (!(jn = JnAlloc(file, hash, addr, len))) {
+		perror("Allocating journal RAM");
+		return NULL;
+	}
+	if (!(jn->f = fopen(file, "r+b"))) {
+		perror(file);
+		JnClose(jn, FALSE);
+		return NULL;
+	}
+	if ((fread(&hdr, sizeof(JnHdr), 1, jn->f) != 1) ||
+			memcmp(hdr.magic, JN_MAGIC, sizeof(hdr.magic)) ||
+			(fread(jn->state, MAX(jn->nSect, 1), 1, jn->f) != 1)) {
+		PrintErr("Error: invalid journal file %s\n", file);
+		JnClose(jn, FALSE);
+		return NULL;
+	}
+	if (hdr.hash != hash || hdr.addr != addr || hdr.len != len) {
+		PrintErr("Error: journal %s belongs to a different job\n", file);
+		JnClose(jn, FALSE);
+		return NULL;
+	}
+	for (i = 0; i < jn->nSect; i++) {
+		if (jn->state[i] > JN_SECT_VERIFIED) {
+			PrintErr("Error: invalid journal file %s\n", file);
+			JnClose(jn, FALSE);
+			return NULL;
+		}
+	}
+
+	return jn;
+}
+
+void JnSectRange(const Journal *jn, uint32_t sect, uint32_t *start,
+		uint32_t *len) {
+	uint32_t end;
+
+	*start = (jn->addr / MDMA_SECT_LEN + sect) * MDMA_SECT_LEN;
+	end = MIN(*start + MDMA_SECT_LEN, jn->addr + jn->len);
+	*start = MAX(*start, jn->addr);
+	*len = end - *start;
+}
+
+int JnSet(Journal *jn, uint32_t sect, JnSectState st) {
+	jn->state[sect] = st;
+	if (fseek(jn->f, sizeof(JnHdr) + sect, SEEK_SET) ||
+			(fwrite(&jn->state[sect], 1, 1, jn->f) != 1) || JnSync(jn)) {
+		perror(jn->file);
+		return -1;
+	}
+
+	return 0;
+}
+
+void JnClose(Journal *jn, int del) {
+	if (!jn) return;
+	if (jn->f) fclose(jn->f);
+	if (del && jn->file) remove(jn->file);
+	free(jn->file);
+	free(jn->state);
+	free(jn);
+}
+
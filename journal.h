@@ -0,0 +1,117 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Flash job journal.
+ *
+ * \defgroup journal journal
+ * \{
+ * \brief Flash job journal.
+ *
+ * Persists the progress of a flash job, so it can be resumed if the
+ * programmer is disconnected or the process is killed. The journal records
+ * the image hash, the target range and the state of each flash sector.
+ * Each state change is flushed to disk before the next operation starts.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/// Magic string at the start of journal files
+#define JN_MAGIC		"MDMAJRN1"
+
+/// State of each sector in the journal
+typedef enum {
+	JN_SECT_PENDING = 0,	///< Nothing done yet.
+	JN_SECT_ERASED,			///< Sector erased, programming might be partial.
+	JN_SECT_PROGRAMMED,		///< Sector programmed.
+	JN_SECT_VERIFIED		///< Sector programmed and verified.
+} JnSectState;
+
+/************************************************************************//**
+ * Flash job journal.
+ ****************************************************************************/
+typedef struct {
+	FILE *f;				///< Journal file.
+	char *file;				///< Journal file name.
+	uint64_t hash;			///< Hash of the image being flashed.
+	uint32_t addr;			///< Start word address of the job.
+	uint32_t len;			///< Length in words of the job.
+	uint32_t nSect;			///< Number of sectors covered by the job.
+	uint8_t *state;			///< State of each sector (JnSectState).
+} Journal;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Creates a new journal, with all the sectors pending.
+ *
+ * \param[in] file Journal file name.
+ * \param[in] hash Hash of the image to flash.
+ * \param[in] addr Start word address of the job.
+ * \param[in] len  Length in words of the job.
+ *
+ * \return The journal, or NULL on error.
+ ****************************************************************************/
+Journal *JnCreate(const char *file, uint64_t hash, uint32_t addr,
+		uint32_t len);
+
+/************************************************************************//**
+ * Opens an existing journal to resume a job. The journal must match the
+ * image hash and range of the job.
+ *
+ * \param[in] file Journal file name.
+ * \param[in] hash Hash of the image to flash.
+ * \param[in] addr Start word address of the job.
+ * \param[in] len  Length in words of the job.
+ *
+ * \return The journal, or NULL on error or if it does not match the job.
+ ****************************************************************************/
+Journal *JnOpen(const char *file, uint64_t hash, uint32_t addr,
+		uint32_t len);
+
+/************************************************************************//**
+ * Obtains the word range of a sector of the job.
+ *
+ * \param[in]  jn    Journal.
+ * \param[in]  sect  Sector index in the job.
+ * \param[out] start Start word address of the sector part in the job.
+ * \param[out] len   Length in words of the sector part in the job.
+ ****************************************************************************/
+void JnSectRange(const Journal *jn, uint32_t sect, uint32_t *start,
+		uint32_t *len);
+
+/************************************************************************//**
+ * Sets the state of a sector, and flushes it to disk.
+ *
+ * \param[in] jn   Journal.
+ * \param[in] sect Sector index in the job.
+ * \param[in] st   New sector state.
+ *
+ * \return 0 on success, non-zero on error.
+ ****************************************************************************/
+int JnSet(Journal *jn, uint32_t sect, JnSectState st);
+
+/************************************************************************//**
+ * Closes a journal.
+ *
+ * \param[in] jn  Journal.
+ * \param[in] del If TRUE, the journal file is deleted (job completed).
+ ****************************************************************************/
+void JnClose(Journal *jn, int del);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_JOURNAL_H_*/
+
+/** \} */
+
@@ -13,9 +13,26 @@
 #include <getopt.h>
 #include <errno.h>
 #include "commands.h"
-#include "progbar.h"
+#include "progress.h"
 #include "esp-prog.h"
 #include "mdma.h"
+#include "rom_img.h"
+#include "quick_verify.h"
+#include "manifest.h"
+#include "burn_in.h"
+#include "shell.h"
+#include "mdz.h"
+#include "tune.h"
+#include "usb_io.h"
+#include "daemon.h"
+#include "watch.h"
+#include "production.h"
+#include "copy.h"
+#include "stats.h"
+#include "report.h"
+#include "metrics.h"
+#include "trace.h"
+#include "recorder.h"
 
 #if (defined(__OS_WIN) && defined(QT_STATIC))
 // Windows static builds need to import Windows Integration plugin
@@ -38,13 +55,37 @@ static const struct option opt[] = {
         {"qt-gui",      no_argument,        NULL,   'Q'},
         {"flash",       required_argument,  NULL,   'f'},
         {"read",        required_argument,  NULL,   'r'},
+		{"read-passes", required_argument,  NULL,   'P'},
         {"erase",       no_argument,        NULL,   'e'},
         {"sect-erase",  required_argument,  NULL,   's'},
 		{"range-erase", required_argument,  NULL,   'A'},
 		{"auto-erase",  no_argument,		NULL,   'a'},
+		{"journal",     required_argument,  NULL,   'j'},
+		{"resume",      no_argument,        NULL,   'u'},
+		{"watch",       no_argument,        NULL,   'W'},
+		{"production",  optional_argument,  NULL,   'L'},
+		{"copy",        required_argument,  NULL,   'c'},
+		{"copy-src",    required_argument,  NULL,   'k'},
         {"verify",      no_argument,        NULL,   'V'},
+		{"quick-verify", required_argument, NULL,   'q'},
         {"flash-id",    no_argument,        NULL,   'i'},
+		{"manifest",    no_argument,        NULL,   'M'},
+		{"compare-manifest", required_argument, NULL, 'C'},
+		{"shell",       no_argument,        NULL,   'S'},
 		{"pushbutton",  no_argument,        NULL,   'p'},
+		{"tune",        required_argument,  NULL,   'T'},
+		{"adaptive",    no_argument,        NULL,   'o'},
+		{"burn-in",     required_argument,  NULL,   'B'},
+		{"burn-iter",   required_argument,  NULL,   'n'},
+		{"burn-pattern", required_argument, NULL,   't'},
+		{"daemon",      optional_argument,  NULL,   'D'},
+		{"no-daemon",   no_argument,        NULL,   'N'},
+		{"stats",       no_argument,        NULL,   'z'},
+		{"report",      required_argument,  NULL,   'J'},
+		{"metrics",     required_argument,  NULL,   'x'},
+		{"trace",       required_argument,  NULL,   'y'},
+		{"dump-recorder", no_argument,      NULL,   'E'},
+		{"progress",    required_argument,  NULL,   'G'},
         {"gpio-ctrl",   required_argument,  NULL,   'g'},
 		{"wifi-flash",	required_argument,	NULL,	'w'},
 		{"wifi-mode",	required_argument,	NULL,	'm'},
@@ -60,13 +101,40 @@ static const char * const description[] = {
 	"Start QT GUI",
 	"Flash rom file",
 	"Read ROM/Flash to file",
+	"Read each chunk n times, re-reading until copies agree",
 	"Erase Flash",
 	"Erase flash sector",
 	"Erase flash memory range",
 	"Auto-erase (use it with flash command)",
+	"Flash sector by sector, recording progress in a journal file",
+	"Resume an interrupted journaled flash",
+	"Watch the flashed file, reflashing the changed sectors when rewritten",
+	"Production loop: flash a cart on each programmer button press, "
+		"logging results to CSV file arg",
+	"Copy a flash range from the cart on a programmer to the cart on another",
+	"Serial number of the programmer holding the cart to copy",
 	"Verify flash after writing file",
+	"Verify a sample of the written file, arg is confidence[:defect] in %",
 	"Obtain flash chip identifiers",
+	"Write a sector hash manifest along with flashed and read files",
+	"Compare cart contents against a sector hash manifest",
+	"Interactive shell to inspect and edit cart memory",
 	"Pushbutton status read (bit 1:event, bit0:pressed)",
+	"Tune transfer parameters on a flash range (DESTROYS range contents!)",
+	"Adapt transfer parameters to the live throughput",
+	"Burn-in test of a flash range (DESTROYS range contents!)",
+	"Number of burn-in iterations",
+	"Burn-in pattern: walk, addr, rand[:seed] or all[:seed]",
+	"Keep the programmer open, serving other invocations on a local socket "
+		"and optionally on loopback TCP port arg, where clients must send "
+		"the token the daemon writes to a file only its user can read",
+	"Access the programmer directly, even if a daemon is running",
+	"Print device command latency percentiles per opcode and phase",
+	"Write a job report, arg is json[:file] (file descriptor 3 if no file)",
+	"Export Prometheus metrics on loopback TCP port arg, or to textfile arg",
+	"Write a Chrome trace of the USB transfers and operations to file arg",
+	"Print the last USB transfers when finished (also on errors and SIGUSR1)",
+	"Progress output: bar (default), json[:file] (stderr if no file) or none",
 	"Manual GPIO control (dangerous!)",
 	"Upload firmware blob to WiFi module",
 	"Set WiFi module flash chip mode (qio, qout, dio, dout)",
@@ -111,7 +179,8 @@ static void PrintHelp(char *prgName) {
 	printf("Usage: %s [OPTIONS [OPTION_ARG]]\nSupported options:\n\n", prgName);
 	for (i = 0; opt[i].name; i++) {
 		printf(" -%c, --%s%s: %s.\n", opt[i].val, opt[i].name,
-				opt[i].has_arg == required_argument?" <arg>":"",
+				opt[i].has_arg == required_argument?" <arg>":
+				opt[i].has_arg == optional_argument?"[=arg]":"",
 				description[i]);
 	}
 	// Print additional info
@@ -127,6 +196,37 @@ static void PrintHelp(char *prgName) {
 		   
 }
 
+/// Chunk hook contexts, NULL terminated arrays
+typedef struct {
+	Manifest **mfs;		///< Manifests being computed.
+	MdzWriter **mdz;	///< Compressed files being written.
+	bool adapt;			///< Adapt transfer parameters.
+} HookCtx;
+
+/// Chunk hook updating manifests and compressed files.
+static void ChunkHookAll(void *ctx, MdmaDir dir, uint32_t addr,
+		const u16 *data, uint32_t wLen) {
+	HookCtx *h = (HookCtx*)ctx;
+
+	MfHook(h->mfs, dir, addr, data, wLen);
+	MdzHook(h->mdz, dir, addr, data, wLen);
+	if (h->adapt) TnAdaptHook(NULL, dir, addr, data, wLen);
+}
+
+/// Writes a manifest to the file name with MF_EXT appended.
+static int ManifestSave(const Manifest *mf, const char *file) {
+	char *mfFile;
+	int err;
+
+	if (!(mfFile = (char*)malloc(strlen(file) + sizeof(MF_EXT)))) return -1;
+	strcpy(mfFile, file);
+	strcat(mfFile, MF_EXT);
+	if (!(err = MfWrite(mf, mfFile))) printf("Wrote manifest %s.\n", mfFile);
+	free(mfFile);
+
+	return err;
+}
+
 //-----------------------------------------------------------------------------
 // MAIN
 //-----------------------------------------------------------------------------
@@ -141,20 +241,89 @@ int main( int argc, char **argv )
 	int gpioCtl = FALSE;
 	/// Rom file to write to flash
 	MemImage fWr = {NULL, 0, 0};
-	/// Rom file to read from flash (default read length: 4 MiB)
-	MemImage fRd = {NULL, 0, 4*1024*1024};
+	/// Rom files to read from flash, plus the range to verify
+	MemImage fRd[MDMA_READ_SPANS_MAX];
+	/// Number of rom files to read from flash
+	int nRd = 0;
+	/// Number of times each chunk is read (1 reads once, without voting)
+	int readPasses = 1;
+	/// Words read without reaching a quorum
+	uint32_t unresolved = 0;
+	/// Flash journal file (NULL for no journal) and resume flag
+	const char *jnFile = NULL;
+	bool resume = false;
+	/// Journal of the flash job
+	Journal *jn = NULL;
+	/// Reflash the file each time it changes, with the address and length
+	/// given by the user
+	bool watch = false;
+	MemImage fWatch;
+	/// Flash a cart on each pushbutton press, and the job configuration
+	bool production = false;
+	ProdCfg prodCfg = {PROD_ERASE_NONE, FALSE, 0, QV_DEFECT_DEF, NULL};
+	/// Cart to cart copy range (copy disabled if length is 0), and serial
+	/// number of the source programmer
+	uint32_t copyAddr = 0, copyLen = 0;
+	const char *copySrc = NULL;
+	/// Read the flashed range along with the read regions to verify it
+	int verifyRd;
+	/// Quick verify confidence (0 for no quick verify) and defect size
+	double qvConf = 0;
+	double qvDefect = QV_DEFECT_DEF;
+	/// Write manifests for flashed and read files
+	bool manifest = false;
+	/// Manifests being computed: flashed file first, then read files, NULL
+	/// terminated. mfRd[i] is the manifest of fRd[i].
+	Manifest *mfs[MDMA_READ_REGIONS_MAX + 2] = {};
+	Manifest *mfWr = NULL;
+	Manifest *mfRd[MDMA_READ_REGIONS_MAX] = {};
+	/// Compressed files being written, NULL terminated. mdzRd[i] is the
+	/// compressed file of fRd[i], or NULL if fRd[i] is not compressed.
+	MdzWriter *mdz[MDMA_READ_REGIONS_MAX + 1] = {};
+	MdzWriter *mdzRd[MDMA_READ_REGIONS_MAX] = {};
+	/// Chunk hook context
+	HookCtx hookCtx = {mfs, mdz, false};
+	/// Tuner range (tuning disabled if length is 0)
+	uint32_t tuneAddr = 0, tuneLen = 0;
+	/// Transfer parameters
+	TnCfg tnCfg;
+	/// Manifest file to compare cart against
+	const char *mfCmp = NULL;
+	/// Run the interactive shell
+	bool shell = false;
+	/// Burn-in configuration (burn-in disabled if length is 0)
+	BiCfg burnIn = {0, 0, BI_ITER_DEF, BI_PAT_ALL, 0};
 	/// Binary blob to flash to the WiFi module
 	MemImage fWf = {NULL, 0, 0};
+	/// ROM image loaded from fWr file
+	RomImg img;
+	/// Image load in progress flag
+	bool imgLoading = false;
 	/// Error code for function calls
 	int errCode;
 	/// Buffer for writing data to cart
     u16 *write_buffer = NULL;
-	/// Buffer for reading cart data
-	u16 *read_buffer = NULL;
+	/// Buffers for reading cart data, one for each fRd entry
+	u16 *read_buffer[MDMA_READ_SPANS_MAX] = {};
 	/// Address for memory erase operations
 	uint32_t eraseAddr = 0;
 	/// Length for memory erase operations
 	uint32_t eraseLen = 0;
+	/// USB I/O thread
+	Uio *uio;
+	/// Serve the programmer as a daemon, also on this TCP port if not 0
+	bool daemonMode = false;
+	int daemonPort = 0;
+	/// Do not forward device access to a running daemon
+	bool noDaemon = false;
+	/// Print device command latency statistics
+	bool stats = false;
+	/// Operation being recorded in the job report
+	int rpt;
+	/// Chrome trace file
+	const char *traceFile = NULL;
+	/// Dump the flight recorder at exit
+	bool dumpRecorder = false;
 	// Manufacturer and device ids
 	uint16_t ids[3];
 	// Use QT GUI flag
@@ -184,7 +353,7 @@ int main( int argc, char **argv )
         /// Character returned by getopt_long()
         int c;
 
-        while ((c = getopt_long(argc, argv, "Qf:r:es:A:aVipg:w:m:bdRvh", opt, &opIdx)) != -1)
+        while ((c = getopt_long(argc, argv, "Qf:r:P:es:A:aj:uWL::c:k:Vq:iMC:SpT:oB:n:t:D::NzJ:x:y:EG:g:w:m:bdRvh", opt, &opIdx)) != -1)
         {
 			// Parse command-line options
             switch (c)
@@ -203,14 +372,27 @@ int main( int argc, char **argv )
 					break;
 
                 case 'r': // Read flash
-					fRd.file = optarg;
-					if ((errCode = ParseMemArgument(&fRd))) {
+					if (nRd == MDMA_READ_REGIONS_MAX) {
+						PrintErr("Error: at most %d read regions supported\n",
+								MDMA_READ_REGIONS_MAX);
+						return 1;
+					}
+					fRd[nRd].file = optarg;
+					if ((errCode = ParseMemArgument(&fRd[nRd++]))) {
 						PrintErr("Error: On ROM/Flash read argument: ");
 						PrintMemError(errCode);
 						return 1;
 					}
 	                break;
 
+				case 'P': // Read passes
+					readPasses = strtol(optarg, NULL, 0);
+					if (readPasses < 1 || readPasses > 16) {
+						PrintErr("Error: read passes must be 1 to 16\n");
+						return 1;
+					}
+					break;
+
                 case 'e': // Erase entire flash
 					f.erase = TRUE;
 	                break;
@@ -231,18 +413,159 @@ int main( int argc, char **argv )
 					f.auto_erase = TRUE;
 					break;
 
+				case 'j': // Journal
+					jnFile = optarg;
+					break;
+
+				case 'u': // Resume
+					resume = true;
+					break;
+
+				case 'W': // Watch
+					watch = true;
+					break;
+
+				case 'L': // Production loop
+					production = true;
+					prodCfg.log = optarg;
+					break;
+
+				case 'c': // Cart to cart copy
+					if (ParseMemRange(optarg, &copyAddr, &copyLen) ||
+							(0 == copyLen)) {
+						PrintErr("Error: Invalid copy range argument: %s\n",
+								optarg);
+						return 1;
+					}
+					break;
+
+				case 'k': // Copy source programmer
+					copySrc = optarg;
+					break;
+
                 case 'V': // Verify flash write
 				f.verify = TRUE;
                 break;
 
+				case 'q': // Quick verify
+					if (QvParse(optarg, &qvConf, &qvDefect)) {
+						PrintErr("Error: Invalid quick verify argument: %s\n",
+								optarg);
+						return 1;
+					}
+					break;
+
                 case 'i': // Flash id
 				f.flashId = TRUE;
                 break;
 
+				case 'M': // Write manifests
+					manifest = true;
+					break;
+
+				case 'C': // Compare against manifest
+					mfCmp = optarg;
+					break;
+
+				case 'S': // Interactive shell
+					shell = true;
+					break;
+
                 case 'p': // Read pushbutton
 				f.pushbutton = TRUE;
                 break;
 
+				case 'T': // Tune
+					if (ParseMemRange(optarg, &tuneAddr, &tuneLen) ||
+							(0 == tuneLen)) {
+						PrintErr("Error: Invalid tune range argument: %s\n",
+								optarg);
+						return 1;
+					}
+					break;
+
+				case 'o': // Adaptive transfer parameters
+					hookCtx.adapt = true;
+					break;
+
+				case 'B': // Burn-in
+					if (ParseMemRange(optarg, &burnIn.addr, &burnIn.len) ||
+							(0 == burnIn.len)) {
+						PrintErr("Error: Invalid burn-in range argument: %s\n",
+								optarg);
+						return 1;
+					}
+					break;
+
+				case 'n': // Burn-in iterations
+					burnIn.iter = strtoul(optarg, NULL, 0);
+					if (!burnIn.iter) {
+						PrintErr("Error: Invalid burn-in iterations: %s\n",
+								optarg);
+						return 1;
+					}
+					break;
+
+				case 't': // Burn-in pattern
+					if (BiPatternParse(optarg, &burnIn)) {
+						PrintErr("Error: Invalid burn-in pattern: %s\n",
+								optarg);
+						return 1;
+					}
+					break;
+
+				case 'D': // Daemon mode
+					daemonMode = true;
+					if (optarg) {
+						daemonPort = strtol(optarg, NULL, 0);
+						if (daemonPort <= 0 || daemonPort > 65535) {
+							PrintErr("Error: Invalid daemon TCP port: %s\n",
+									optarg);
+							return 1;
+						}
+					}
+					break;
+
+				case 'N': // Do not use the daemon
+					noDaemon = true;
+					break;
+
+				case 'z': // Latency statistics
+					stats = true;
+					break;
+
+				case 'J': // Job report
+					if (RptParse(optarg)) {
+						PrintErr("Error: Invalid report argument: %s\n",
+								optarg);
+						return 1;
+					}
+					break;
+
+				case 'E': // Dump flight recorder at exit
+					dumpRecorder = true;
+					break;
+
+				case 'G': // Progress output
+					if (PrgParse(optarg)) {
+						PrintErr("Error: Invalid progress argument: %s\n",
+								optarg);
+						return 1;
+					}
+					break;
+
+				case 'y': // Chrome trace
+					traceFile = optarg;
+					break;
+
+				case 'x': // Metrics exporter
+					if (MtrParse(optarg)) {
+						PrintErr("Error: Invalid metrics argument: %s\n",
+								optarg);
+						return 1;
+					}
+					break;
+
                 case 'g': // GPIO control
 				gpioCtl = TRUE;
                 break;
@@ -299,23 +622,33 @@ int main( int argc, char **argv )
 		return 0;
 }
 
+	// Must be started before any other thread
+	if (RecInit()) return 1;
+	if (PrgInit()) return 1;
+
 	// Try launching QT GUI if requested
 	if (useQt) {
 #ifdef QT
 		QApplication app (argc, argv);
 
+		// GUI slots access the device through the I/O thread
+		uio = UioNew();
 		// Try initialising USB device
 		if (UsbInit() < 0) {
 			QMessageBox::critical(NULL, "MDMA ERROR",
 					"Could not find MDMA programmer!\n"
 					"Please make sure MDMA programmer is\n"
 					"plugged and drivers/permissions are OK.");
+			UioFree(uio);
 			return -1;
 		}
 	
 		FlashDialog dlg;
 		dlg.show();
-		return app.exec();
+		errCode = app.exec();
+		UsbClose();
+		UioFree(uio);
+		return errCode;
 #else
 		PrintErr("Requested QT GUI, but MDMA has not been compiled with QT!\n");
 		return -1;
@@ -335,6 +668,57 @@ int main( int argc, char **argv )
 		PrintErr("Cannot auto-erase without writing to flash!\n");
 		return -1;
 	}
+	if (jnFile && !fWr.file) {
+		PrintErr("Cannot use a journal without writing to flash!\n");
+		return -1;
+	}
+	if (watch && !fWr.file) {
+		PrintErr("Cannot watch without writing to flash!\n");
+		return -1;
+	}
+	if (watch && jnFile) {
+		PrintErr("Watch mode and journal requested, aborting!\n");
+		return -1;
+	}
+	if (production && !fWr.file) {
+		PrintErr("Cannot run the production loop without a file to flash!\n");
+		return -1;
+	}
+	if (production && (jnFile || watch || nRd || manifest || mfCmp ||
+				shell || f.pushbutton || tuneLen || burnIn.len || fWf.file ||
+				f.boot || eraseLen || (sect_erase != UINT32_MAX))) {
+		PrintErr("Production loop only supports erase, flash and verify "
+				"options!\n");
+		return -1;
+	}
+	if (copySrc && !copyLen) {
+		PrintErr("Copy source given without a range to copy!\n");
+		return -1;
+	}
+	if (copyLen && (fWr.file || nRd || f.erase || eraseLen ||
+				(sect_erase != UINT32_MAX) || f.flashId || mfCmp || shell ||
+				f.pushbutton || tuneLen || burnIn.len || fWf.file || f.boot ||
+				daemonMode)) {
+		PrintErr("Cart to cart copy cannot be combined with other "
+				"actions!\n");
+		return -1;
+	}
+	if (resume && !jnFile) {
+		PrintErr("Cannot resume without a journal!\n");
+		return -1;
+	}
+	if (resume && (f.erase || eraseLen || (sect_erase != UINT32_MAX))) {
+		PrintErr("Erase requested when resuming, aborting!\n");
+		return -1;
+	}
+	if (qvConf && !fWr.file) {
+		PrintErr("Cannot quick verify without writing to flash!\n");
+		return -1;
+	}
+	if (qvConf && f.verify) {
+		PrintErr("Quick verify and full verify requested, aborting!\n");
+		return -1;
+	}
 	if (f.auto_erase && (sect_erase != UINT32_MAX)) {
 		PrintErr("Auto-erase and sector erase requested, aborting!\n");
 		return -1;
@@ -359,6 +743,12 @@ int main( int argc, char **argv )
 		PrintErr("Full erase and range erase requested, aborting!\n");
 		return -1;
 	}
+	if (daemonMode && (fWr.file || nRd || f.erase || eraseLen ||
+				(sect_erase != UINT32_MAX) || f.flashId || mfCmp || shell ||
+				f.pushbutton || tuneLen || burnIn.len || fWf.file || f.boot)) {
+		PrintErr("Daemon mode cannot be combined with other actions!\n");
+		return -1;
+	}
 
 
 	if (f.verbose) {
@@ -367,23 +757,62 @@ int main( int argc, char **argv )
 		printf("==================================================%s\n\n",
 				f.dry?"====":"");
 		if (f.flashId) printf(" - Show Flash chip identification.\n");
+		if (tuneLen) {
+			printf(" - Tune transfer parameters on range 0x%X:%X.\n",
+					tuneAddr, tuneLen);
+		}
 		if (f.erase) printf(" - Erase Flash.\n");
+		else if (jnFile) printf(" - Erase flash sector by sector.\n");
 		else if(f.auto_erase) printf(" - Auto-erase flash.\n");
 		else if (eraseLen) {
 			printf(" - Erase range 0x%X:%X.\n", eraseAddr, eraseLen);
 		} else if (sect_erase != UINT32_MAX)
 			printf(" - Erase sector at 0x%X.\n", sect_erase);
 		if (fWr.file) {
-		   printf(" - Flash %s", f.verify?"and verify ":"");
-		   PrintMemImage(&fWr); putchar('\n');
+		   printf(" - Flash %s", f.verify?"and verify ":
+				   (qvConf?"and quick verify ":""));
+		   PrintMemImage(&fWr);
+		   if (jnFile) printf(", %s journal %s", resume?"resuming":"using",
+				   jnFile);
+		   putchar('\n');
 		}
-		if (fRd.file) {
+		for (i = 0; i < nRd; i++) {
 			printf(" - Read ROM/Flash to ");
-			PrintMemImage(&fRd); putchar('\n');
+			PrintMemImage(&fRd[i]);
+			if (readPasses > 1) printf(", %d passes", readPasses);
+			putchar('\n');
+		}
+		if (production) {
+			printf(" - Repeat the erase and flash jobs on each pushbutton "
+					"press");
+			if (prodCfg.log) printf(", logging to %s", prodCfg.log);
+			putchar('\n');
+		}
+		if (copyLen) {
+			printf(" - Copy range 0x%X:%X from programmer %s to the other "
+					"programmer.\n", copyAddr, copyLen,
+					copySrc ? copySrc : "#1");
+		}
+		if (watch) {
+			printf(" - Watch %s, reflashing the changed sectors.\n",
+					fWr.file);
+		}
+		if (manifest) {
+			printf(" - Write manifests for flashed and read files.\n");
+		}
+		if (mfCmp) {
+			printf(" - Compare cart against manifest %s.\n", mfCmp);
+		}
+		if (shell) {
+			printf(" - Run interactive shell.\n");
 		}
 		if (f.pushbutton) {
 			printf(" - Read pushbutton.\n");
 		}
+		if (burnIn.len) {
+			printf(" - Burn-in range 0x%X:%X, %u iteration(s).\n",
+					burnIn.addr, burnIn.len, burnIn.iter);
+		}
 		if (gpioCtl) {
 			printf(" - GPIO control (TODO).\n");
 		}
@@ -398,27 +827,95 @@ int main( int argc, char **argv )
 		if (f.boot) {
 			printf(" - Enter bootloader\n");
 		}
+		if (daemonMode) {
+			printf(" - Serve programmer on %s", DmnSockGet());
+			if (daemonPort) printf(" and tcp:%d", daemonPort);
+			putchar('\n');
+		}
+		if (stats) {
+			printf(" - Print device command latency statistics.\n");
+		}
+		if (mtrOn) printf(" - Export Prometheus metrics.\n");
+		if (traceFile) printf(" - Write trace to %s.\n", traceFile);
 		printf("\n");
 	}
 
 	if (f.dry) return 0;
 
+	// Image loading updates the length if not specified
+	fWatch = fWr;
+
+	if (stats) StatsEnable(TRUE);
+	if (MtrStart()) return 1;
+	if (traceFile && TrcOpen(traceFile)) return 1;
+	if (RptOpen()) return 1;
+
+	if (daemonMode) {
+		errCode = DmnServe(daemonPort) ? 1 : 0;
+		if (stats) StatsPrint();
+		RptClose(errCode);
+		MtrStop();
+		TrcClose();
+		if (dumpRecorder) RecDump(REC_DUMP_ALL);
+		return errCode;
+	}
+
 	// Detect number of columns (for progress bar drawing).
 #ifdef __OS_WIN
     CONSOLE_SCREEN_BUFFER_INFO csbi;
 
-    GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
-    f.cols = csbi.srWindow.Right - csbi.srWindow.Left;
+    f.cols = GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE),
+			&csbi) ? csbi.srWindow.Right - csbi.srWindow.Left : 0;
 #else
     struct winsize max;
-    ioctl(0, TIOCGWINSZ , &max);
-	f.cols = max.ws_col;
+	// No progress bar if stdout is not a terminal
+	f.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &max) ? 0 : max.ws_col;
 
 	// Also set transparent cursor
 	printf("\e[?25l");
 #endif
+	if (PrgOpen(&f.cols)) {
+		errCode = 1;
+		goto restore_exit;
+	}
 
+	// Both programmers are accessed directly, each one on its I/O thread
+	if (copyLen) {
+		rpt = RptOpBegin("copy", copyAddr, copyLen);
+		errCode = CopyRun(copyAddr, copyLen, copySrc, f.cols) ? 1 : 0;
+		RptOpEnd(rpt, errCode);
+		goto restore_exit;
+	}
+
+	// Forward device access to the daemon if running, skipping the
+	// programmer initialization
+	if (!noDaemon && !DmnConnect()) {
+		PrintVerb("Using programmer daemon on %s.\n", DmnSockGet());
+	}
+	// All device access runs on the I/O thread, so transfers overlap with
+	// hashing, compression and progress drawing
+	if (!(uio = UioNew())) {
+		DmnDisconnect();
+		errCode = 1;
+		goto restore_exit;
+	}
+	// Load the image on a worker thread while the programmer is initialized
+	// and the cart is erased. The image is moved to device memory when the
+	// load completes.
+	if (fWr.file) {
+		if (RomImgLoadStart(&img, &fWr)) {
+			UioFree(uio);
+			DmnDisconnect();
+			errCode = 1;
+			goto restore_exit;
+		}
+		imgLoading = true;
+	}
+	// The programmer is initialized before allocating the transfer buffers,
+	// so they can use device memory
 	if (UsbInit() < 0) PrintErr("Could not open MDMA programmer!\n");
+	MdmaChipReset();
+	RptIdentify();
 
 	/****************** ↓↓↓↓↓↓ DO THE MAGIC HERE ↓↓↓↓↓↓ *******************/
 
@@ -432,79 +929,220 @@ int main( int argc, char **argv )
 		MDMA_devId_get(ids);
 		printf("Device IDs: 0x%04X:%04X:%04X\n", ids[0], ids[1], ids[2]);
 	}
-	// Erase
+	// Apply the transfer parameters stored for this programmer
+	if (!TnLoad(&tnCfg)) {
+		TnApply(&tnCfg);
+		PrintVerb("Transfer parameters: xfer %u, read chunk %u, write chunk "
+				"%u.\n", tnCfg.xferLen, tnCfg.rdChunk, tnCfg.wrChunk);
+	}
+	if (tuneLen) {
+		if (TnSweep(tuneAddr, tuneLen, &tnCfg) || TnSave(&tnCfg)) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
+		printf("Transfer parameters saved.\n");
+	}
+
+	// Create manifests, hashed while data is transferred
+	if (manifest) {
+		aux = 0;
+		if (fWr.file) {
+			if (!(mfWr = MfNew(fWr.addr, fWr.len, MDMA_DIR_WRITE))) {
+				errCode = 1;
+				goto dealloc_exit;
+			}
+			mfs[aux++] = mfWr;
+		}
+		for (i = 0; i < nRd; i++) {
+			if (!(mfRd[i] = MfNew(fRd[i].addr, fRd[i].len, MDMA_DIR_READ))) {
+				errCode = 1;
+				goto dealloc_exit;
+			}
+			mfs[aux++] = mfRd[i];
+		}
+	}
+	// Compress files with MDZ extension while the cart is read
+	for (i = 0, aux = 0; i < nRd; i++) {
+		if (!MdzIsName(fRd[i].file)) continue;
+		if (!(mdzRd[i] = MdzWriterNew(fRd[i].file, fRd[i].addr,
+						fRd[i].len))) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
+		mdz[aux++] = mdzRd[i];
+	}
+	MdmaChunkHookSet(ChunkHookAll, &hookCtx);
+
+	// Production loop runs the erase, flash and verify jobs on each press
+	if (production) {
+		imgLoading = false;
+		if (RomImgLoadWait(&img)) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
+		prodCfg.erase = f.erase ? PROD_ERASE_FULL :
+			(f.auto_erase ? PROD_ERASE_AUTO : PROD_ERASE_NONE);
+		prodCfg.verify = f.verify;
+		prodCfg.qvConf = qvConf;
+		prodCfg.qvDefect = qvDefect;
+		errCode = ProdRun(&prodCfg, &fWr, &img, f.cols) ? 1 : 0;
+		goto dealloc_exit;
+	}
+
+	// Erase. The image keeps loading while the erase progresses
 	if (f.erase) {
-		printf("Erasing cart... ");
-		fflush(stdout);
-		// It looks like text doesn't appear until MDMA_cart_erase()
-		// completes, so flush output to force it.
-		if (MDMA_cart_erase()) {
+		printf("Erasing cart...\n");
+		rpt = RptOpBegin("erase", 0, 0);
+		aux = MdmaCartErase(f.cols);
+		RptOpEnd(rpt, aux);
+		if (aux) {
 			printf("ERROR!\n");
-			return 1;
+			errCode = 1;
+			goto dealloc_exit;
 		}
 		else printf("OK!\n");
 	} else if (sect_erase != UINT32_MAX) {
 		printf("Erasing sector 0x%06X...\n", sect_erase);
-		MDMA_sect_erase(sect_erase);
+		rpt = RptOpBegin("sect_erase", sect_erase, 0);
+		RptOpEnd(rpt, MDMA_sect_erase(sect_erase));
 	} else if (eraseLen) {
 		printf("Erasing range 0x%X:%X...\n", eraseAddr, eraseLen);
-		MDMA_range_erase(eraseAddr, eraseLen);
+		rpt = RptOpBegin("range_erase", eraseAddr, eraseLen);
+		aux = MdmaRangeErase(eraseAddr, eraseLen, f.cols);
+		RptOpEnd(rpt, aux);
+		if (aux) {
+			printf("ERROR!\n");
+			errCode = 1;
+			goto dealloc_exit;
+		}
 	}
 
 	// Flash
 	if (fWr.file) {
-		write_buffer = AllocAndFlash(&fWr, f.auto_erase, f.cols);
-		if (!write_buffer) {
+		// Journaled flash erases each sector before programming it
+		if (f.auto_erase && !jnFile) {
+			rpt = RptOpBegin("auto_erase", fWr.addr, fWr.len);
+			aux = AutoErase(&fWr, f.cols);
+			RptOpEnd(rpt, aux);
+			if (aux) {
+				errCode = 1;
+				goto dealloc_exit;
+			}
+		}
+		imgLoading = false;
+		if (RomImgLoadWait(&img)) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
+		PrintVerb("Image hash: 0x%016llX.\n", (unsigned long long)img.hash);
+		write_buffer = img.buf;
+		rpt = RptOpBegin("flash", fWr.addr, fWr.len);
+		if (jnFile) {
+			jn = resume ? JnOpen(jnFile, img.hash, fWr.addr, fWr.len) :
+				JnCreate(jnFile, img.hash, fWr.addr, fWr.len);
+			if (!jn || FlashJournaled(&fWr, write_buffer, img.wrLen, jn,
+						resume, f.verify, f.cols)) {
+				RptOpEnd(rpt, 1);
+				if (jn) printf("Journal %s kept, use --resume to continue.\n",
+						jnFile);
+				errCode = 1;
+				goto dealloc_exit;
+			}
+			// Job completed, journal not needed anymore
+			JnClose(jn, TRUE);
+			jn = NULL;
+		} else if (FlashBuf(&fWr, write_buffer, img.wrLen, f.cols)) {
+			RptOpEnd(rpt, 1);
 			errCode = 1;
 			goto dealloc_exit;
 		}
+		RptOpEnd(rpt, 0);
+		if (jnFile && f.verify) RptVerify("sector", RPT_VERIFY_OK);
+		if (mfWr && ManifestSave(mfWr, fWr.file)) errCode = 1;
+		if (qvConf) {
+			rpt = RptOpBegin("quick_verify", fWr.addr, fWr.len);
+			aux = QvRun(&fWr, write_buffer, img.hash, qvConf, qvDefect);
+			RptOpEnd(rpt, aux);
+			RptVerify("quick", aux ? RPT_VERIFY_FAILED : RPT_VERIFY_OK);
+			if (aux) errCode = 1;
+		}
 	}
 
-	if (fRd.file || f.verify) {
-		// If verify is set, ignore addr and length set in command line.
-		if (f.verify) {
-			fRd.addr = fWr.addr;
-			fRd.len  = fWr.len;
+	// Journaled flash verifies each sector as it is written
+	verifyRd = f.verify && !jnFile;
+	if (nRd || verifyRd) {
+		// If verify is set, read the written range along with the regions
+		// to dump, so overlapping ranges are read only once.
+		if (verifyRd) {
+			fRd[nRd].file = NULL;
+			fRd[nRd].addr = fWr.addr;
+			fRd[nRd].len  = fWr.len;
 		}
-		read_buffer = AllocAndRead(&fRd, f.cols);
-		if (!read_buffer) {
+		aux = ReadRegions(fRd, nRd + verifyRd, read_buffer, readPasses,
+					f.cols, &unresolved);
+		// Compressed files got all the data, stop feeding them
+		mdz[0] = NULL;
+		if (aux) {
+			PrintErr("Couldn't read from cart!\n");
 			errCode = 1;
 			goto dealloc_exit;
 		}
+		// Data is still written, but report words that never matched
+		if (unresolved) errCode = 1;
 		// Verify
-		if (f.verify) {
-			for (i = 0; i < (int)fWr.len; i++) {
-				if (write_buffer[i] != read_buffer[i]) {
-					break;
-				}
-			}
-			if (i == (int)fWr.len)
+		if (verifyRd) {
+			u16 *verify_buffer = read_buffer[nRd];
+			aux = memcmp(write_buffer, verify_buffer, fWr.len<<1);
+			RptVerify("full", aux ? RPT_VERIFY_FAILED : RPT_VERIFY_OK);
+			if (!aux)
 				printf("Verify OK!\n");
 			else {
-				printf("Verify failed at addr 0x%07X!\n", i + fWr.addr);
-				printf("Wrote: 0x%04X; Read: 0x%04X\n", write_buffer[i],
-						read_buffer[i]);
+				MdmaVerifyFail(fWr.addr, write_buffer, verify_buffer,
+						fWr.len);
 				// Set error, but we do not exit yet, because user might want
 				// to write readed data to a file!
 				errCode = 1;
 			}
 		}
-		// Write file
-		if (fRd.file) {
+		// Write files
+		for (aux = 0; aux < nRd; aux++) {
+			if (mdzRd[aux]) {
+				// Data already compressed while reading
+				i = MdzWriterClose(mdzRd[aux]);
+				mdzRd[aux] = NULL;
+				if (i) {
+					errCode = 1;
+					goto dealloc_exit;
+				}
+				printf("Wrote file %s.\n", fRd[aux].file);
+				if (mfRd[aux] && ManifestSave(mfRd[aux], fRd[aux].file)) {
+					errCode = 1;
+				}
+				continue;
+			}
 			// Do byte swaps
-		   	for (i = 0; i < (int)fRd.len; i++) ByteSwapWord(read_buffer[i]);
-        	FILE *dump = fopen(fRd.file, "wb");
+		   	for (i = 0; i < (int)fRd[aux].len; i++) {
+				ByteSwapWord(read_buffer[aux][i]);
+			}
+        	FILE *dump = fopen(fRd[aux].file, "wb");
 			if (!dump) {
-				perror(fRd.file);
+				perror(fRd[aux].file);
 				errCode = 1;
 				goto dealloc_exit;
 			}
-	        fwrite(read_buffer, fRd.len<<1, 1, dump);
+	        fwrite(read_buffer[aux], fRd[aux].len<<1, 1, dump);
 	        fclose(dump);
-			printf("Wrote file %s.\n", fRd.file);
+			printf("Wrote file %s.\n", fRd[aux].file);
+			if (mfRd[aux] && ManifestSave(mfRd[aux], fRd[aux].file)) {
+				errCode = 1;
+			}
 		}
 	}
 
+	if (mfCmp && MfCompare(mfCmp, f.cols)) errCode = 1;
+
+	if (shell && ShRun(stdin)) errCode = 1;
+
 	if (f.pushbutton) {
 		u16 retVal;
 		u8 butStat;
@@ -518,6 +1156,9 @@ int main( int argc, char **argv )
 		goto dealloc_exit;
 	}
 
+	// Burn-in
+	if (burnIn.len && BiRun(&burnIn, f.cols)) errCode = 1;
+
 	if (gpioCtl)
 		printf("Manual GPIO control not supported. Ignoring argument!!!\n");
 
@@ -531,25 +1172,58 @@ int main( int argc, char **argv )
 			errCode = 1;
 		}
 		else {
-			if (0 > EpBlobFlash(fWf.file, fWf.addr, &f)) {
+			rpt = RptOpBegin("wifi_flash", fWf.addr, 0);
+			aux = EpBlobFlash(fWf.file, fWf.addr, &f);
+			RptOpEnd(rpt, 0 > aux);
+			if (0 > aux) {
 				PrintErr("Error while uploading WiFi firmware!\n");
 				errCode = 1;
 			}
 		}
 	}
 
+	// Keep the session open, reflashing each new build
+	if (watch && WatchRun(&fWatch, &img, f.verify, f.cols)) errCode = 1;
+
 dealloc_exit:
-	if (write_buffer) free(write_buffer);
-	if (read_buffer)  free(read_buffer);
+	if (imgLoading) RomImgLoadWait(&img);
+	if (fWr.file) RomImgFree(&img);
+	JnClose(jn, FALSE);
+	for (i = 0; i <= nRd; i++) MDMA_BufFree(read_buffer[i]);
+	MdmaChunkHookSet(NULL, NULL);
+	for (i = 0; mfs[i]; i++) MfFree(mfs[i]);
+	// Remove incomplete compressed files
+	for (i = 0; i < nRd; i++) MdzWriterAbort(mdzRd[i]);
+
+	// Keep the parameters found by the adaptive tuner for later runs
+	if (hookCtx.adapt && TnAdaptChanged()) {
+		TnGet(&tnCfg);
+		if (!TnSave(&tnCfg)) {
+			printf("Adapted transfer parameters saved: xfer %u, read chunk "
+					"%u, write chunk %u.\n", tnCfg.xferLen, tnCfg.rdChunk,
+					tnCfg.wrChunk);
+		}
+	}
 
 	// Bootloader command is not replied!
 	if (f.boot) MDMA_bootloader();
 
+	UsbClose();
+	MdmaChipReset();
+	UioFree(uio);
+	DmnDisconnect();
+
+restore_exit:
+	if (stats) StatsPrint();
+	RptClose(errCode);
+	MtrStop();
+	TrcClose();
+	PrgClose();
+	if (dumpRecorder) RecDump(REC_DUMP_ALL);
 #ifndef __OS_WIN
 	// Restore cursor
 	printf("\e[?25h");
 #endif
-	UsbClose();
     return errCode;
 }
 
@@ -0,0 +1,226 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Per-sector hash manifests.
+ *
+ * Records the chip IDs, the range and a hash of each flash sector of the
+ * data transferred, and checks carts against previously written manifests.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "manifest.h"
+#include "commands.h"
+#include "progress.h"
+#include "rom_img.h"
+
+/// Manifest format version
+#define MF_VERSION		1
+
+/// Allocates a manifest and its sector hashes
+static Manifest *MfAlloc(uint32_t addr, uint32_t len) {
+	Manifest *mf;
+	uint32_t i;
+
+	if (!(mf = (Manifest*)calloc(1, sizeof(Manifest)))) return NULL;
+	mf->addr = addr;
+	mf->len = len;
+	mf->nSect = len ? (addr + len - 1) / MF_SECT_LEN -
+		addr / MF_SECT_LEN + 1 : 0;
+	if (!(mf->hash = (uint64_t*)malloc(MAX(mf->nSect, 1) *
+					sizeof(uint64_t)))) {
+		free(mf);
+		return NULL;
+	}
+	for (i = 0; i < mf->nSect; i++) mf->hash[i] = ROM_IMG_HASH_INIT;
+
+	return mf;
+}
+
+/// Obtains the start address and length of a sector of the range
+static void MfSectRange(const Manifest *mf, uint32_t sect, uint32_t *start,
+		uint32_t *len) {
+	uint32_t end;
+
+	*start = (mf->addr / MF_SECT_LEN + sect) * MF_SECT_LEN;
+	end = MIN(*start + MF_SECT_LEN, mf->addr + mf->len);
+	*start = MAX(*start, mf->addr);
+	*len = end - *start;
+}
+
+Manifest *MfNew(uint32_t addr, uint32_t len, MdmaDir dir) {
+	Manifest *mf;
+
+	if (!(mf = MfAlloc(addr, len))) {
+		perror("Allocating manifest RAM");
+		return NULL;
+	}
+	mf->dir = dir;
+	if (MDMA_manId_get(&mf->manId) || MDMA_devId_get(mf->devId)) {
+		PrintErr("Error: could not read flash chip IDs for manifest\n");
+		MfFree(mf);
+		return NULL;
+	}
+
+	return mf;
+}
+
+void MfFree(Manifest *mf) {
+	if (mf) {
+		free(mf->hash);
+		free(mf);
+	}
+}
+
+void MfUpdate(Manifest *mf, uint32_t addr, const u16 *data, uint32_t wLen) {
+	uint32_t start = MAX(addr, mf->addr);
+	uint32_t end = MIN(addr + wLen, mf->addr + mf->len);
+	uint32_t sect, step;
+
+	// Hash the chunk in pieces, each one inside a single sector
+	for (; start < end; start += step) {
+		sect = start / MF_SECT_LEN - mf->addr / MF_SECT_LEN;
+		step = MIN(end, (start / MF_SECT_LEN + 1) * MF_SECT_LEN) - start;
+		mf->hash[sect] = RomImgHash(data + (start - addr), step,
+				mf->hash[sect]);
+	}
+}
+
+void MfHook(void *ctx, MdmaDir dir, uint32_t addr, const u16 *data,
+		uint32_t wLen) {
+	Manifest **mf;
+
+	for (mf = (Manifest**)ctx; *mf; mf++) {
+		if ((*mf)->dir == dir) MfUpdate(*mf, addr, data, wLen);
+	}
+}
+
+int MfWrite(const Manifest *mf, const char *file) {
+	FILE *out;
+	uint32_t i, start, len;
+
+	if (!(out = fopen(file, "w"))) {
+		perror(file);
+		return -1;
+	}
+	fprintf(out, "mdma-manifest %d\n", MF_VERSION);
+	fprintf(out, "manid 0x%04X\n", mf->manId);
+	fprintf(out, "devid 0x%04X:0x%04X:0x%04X\n", mf->devId[0], mf->devId[1],
+			mf->devId[2]);
+	fprintf(out, "range 0x%06X 0x%06X\n", mf->addr, mf->len);
+	for (i = 0; i < mf->nSect; i++) {
+		MfSectRange(mf, i, &start, &len);
+		fprintf(out, "sector 0x%06X 0x%06X %016llX\n", start, len,
+				(unsigned long long)mf->hash[i]);
+	}
+	if (fclose(out)) {
+		perror(file);
+		return -1;
+	}
+
+	return 0;
+}
+
+Manifest *MfRead(const char *file) {
+	FILE *in;
+	Manifest *mf = NULL;
+	unsigned int version, manId, devId[3], addr, len, start, sLen;
+	unsigned long long hash;
+	uint32_t i, expStart, expLen;
+
+	if (!(in = fopen(file, "r"))) {
+		perror(file);
+		return NULL;
+	}
+	if ((fscanf(in, "mdma-manifest %u ", &version) != 1) ||
+			(MF_VERSION != version) ||
+			(fscanf(in, "manid %x ", &manId) != 1) ||
+			(fscanf(in, "devid %x:%x:%x ", &devId[0], &devId[1],
+					&devId[2]) != 3) ||
+			(fscanf(in, "range %x %x ", &addr, &len) != 2) ||
+			!(mf = MfAlloc(addr, len))) {
+		goto err;
+	}
+	mf->manId = manId;
+	for (i = 0; i < 3; i++) mf->devId[i] = devId[i];
+	for (i = 0; i < mf->nSect; i++) {
+		if (fscanf(in, "sector %x %x %llx ", &start, &sLen, &hash) != 3) {
+			goto err;
+		}
+		MfSectRange(mf, i, &expStart, &expLen);
+		if (start != expStart || sLen != expLen) goto err;
+		mf->hash[i] = hash;
+	}
+	fclose(in);
+
+	return mf;
+
+err:
+	PrintErr("Error: invalid manifest file %s\n", file);
+	MfFree(mf);
+	fclose(in);
+	return NULL;
+}
+
+int MfCompare(const char *file, int columns) {
+	Manifest *mf, *cart;
+	u16 *readBuf;
+	uint32_t i, start, len;
+	int differ = 0;
+	// Address string, e.g.: 0x123456
+	char addrStr[9];
+
+	if (!(mf = MfRead(file))) return -1;
+	if (!(cart = MfNew(mf->addr, mf->len, MDMA_DIR_READ))) {
+		MfFree(mf);
+		return -1;
+	}
+	if ((cart->manId != mf->manId) || memcmp(cart->devId, mf->devId,
+				sizeof(mf->devId))) {
+		printf("Warning: flash chip IDs differ from manifest ones.\n");
+	}
+	if (!(readBuf = MDMA_BufAlloc(MF_SECT_LEN))) {
+		perror("Allocating read buffer RAM");
+		differ = -1;
+		goto out;
+	}
+
+	// The programmer cannot hash sectors, so stream them and hash here
+	printf("Comparing cart against manifest %s...\n", file);
+	PrgBegin("manifest", MF_SECT_LEN * 2, columns);
+	for (i = 0; i < mf->nSect; i++) {
+		MfSectRange(mf, i, &start, &len);
+		if (MDMA_read(len, start, readBuf)) {
+			PrgEnd();
+			PrintErr("Couldn't read from cart!\n");
+			differ = -1;
+			break;
+		}
+		MfUpdate(cart, start, readBuf, len);
+		sprintf(addrStr, "0x%06X", start + len);
+		PrgPost(i + 1, mf->nSect, addrStr);
+	}
+	PrgEnd();
+	putchar('\n');
+
+	for (i = 0; differ >= 0 && i < mf->nSect; i++) {
+		if (cart->hash[i] != mf->hash[i]) {
+			MfSectRange(mf, i, &start, &len);
+			printf("Sector 0x%06X:%06X differs.\n", start, len);
+			differ = 1;
+		}
+	}
+	if (!differ) printf("Cart matches manifest!\n");
+	MDMA_BufFree(readBuf);
+
+out:
+	MfFree(cart);
+	MfFree(mf);
+	return differ;
+}
+
@@ -0,0 +1,133 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Per-sector hash manifests.
+ *
+ * \defgroup manifest manifest
+ * \{
+ * \brief Per-sector hash manifests.
+ *
+ * A manifest records the flash chip IDs, the memory range and a hash of
+ * each flash sector of the data written to or read from the cart. Hashes
+ * are computed while data is transferred, using the chunk hook of the mdma
+ * module, so no additional pass over the data is needed.
+ *
+ * Manifests are text files with the following format:
+ * \verbatim
+   mdma-manifest 1
+   manid 0x0001
+   devid 0x227E:0x221D:0x2200
+   range 0x000000 0x080000
+   sector 0x000000 0x008000 0123456789ABCDEF
+   [...]
+   \endverbatim
+ * Addresses and lengths are in words.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <stdint.h>
+#include "util.h"
+#include "mdma.h"
+
+/// Length of a flash sector in words
+#define MF_SECT_LEN		MDMA_SECT_LEN
+/// Extension appended to file names to obtain the manifest file name
+#define MF_EXT			".manifest"
+
+/************************************************************************//**
+ * Manifest of a memory range.
+ ****************************************************************************/
+typedef struct {
+	uint16_t manId;		///< Flash chip manufacturer ID.
+	uint16_t devId[3];	///< Flash chip device IDs.
+	uint32_t addr;		///< Start word address of the range.
+	uint32_t len;		///< Length in words of the range.
+	uint32_t nSect;		///< Number of sectors covered by the range.
+	uint64_t *hash;		///< Hash of each sector.
+	MdmaDir dir;		///< Transfer direction tracked.
+} Manifest;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Creates a manifest for a memory range. Flash chip IDs are read from the
+ * cart.
+ *
+ * \param[in] addr Start word address of the range.
+ * \param[in] len  Length of the range in words.
+ * \param[in] dir  Direction of the transfers to hash.
+ *
+ * \return The new manifest, or NULL on error.
+ ****************************************************************************/
+Manifest *MfNew(uint32_t addr, uint32_t len, MdmaDir dir);
+
+/************************************************************************//**
+ * Frees a manifest.
+ *
+ * \param[in] mf Manifest to free.
+ ****************************************************************************/
+void MfFree(Manifest *mf);
+
+/************************************************************************//**
+ * Hashes a chunk of data. Only the part of the chunk inside the manifest
+ * range is hashed. Chunks must be supplied in address order.
+ *
+ * \param[in] mf   Manifest to update.
+ * \param[in] addr Word address of the chunk.
+ * \param[in] data Chunk data (byte swapped).
+ * \param[in] wLen Length of the chunk in words.
+ ****************************************************************************/
+void MfUpdate(Manifest *mf, uint32_t addr, const u16 *data, uint32_t wLen);
+
+/************************************************************************//**
+ * Chunk hook updating a NULL terminated array of manifests. Install it
+ * calling MdmaChunkHookSet(MfHook, mfArray).
+ ****************************************************************************/
+void MfHook(void *ctx, MdmaDir dir, uint32_t addr, const u16 *data,
+		uint32_t wLen);
+
+/************************************************************************//**
+ * Writes a manifest to a file.
+ *
+ * \param[in] mf   Manifest to write.
+ * \param[in] file Manifest file name.
+ *
+ * \return 0 on success, non-zero on error.
+ ****************************************************************************/
+int MfWrite(const Manifest *mf, const char *file);
+
+/************************************************************************//**
+ * Reads a manifest from a file.
+ *
+ * \param[in] file Manifest file name.
+ *
+ * \return The manifest read, or NULL on error.
+ ****************************************************************************/
+Manifest *MfRead(const char *file);
+
+/************************************************************************//**
+ * Checks the cart contents against a manifest, reading and hashing each
+ * sector of the manifest range, and reports differing sectors.
+ *
+ * \param[in] file    Manifest file name.
+ * \param[in] columns Terminal width, for the progress bar.
+ *
+ * \return 0 if the cart matches, 1 if it differs, -1 on error.
+ ****************************************************************************/
+int MfCompare(const char *file, int columns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_MANIFEST_H_*/
+
+/** \} */
+
@@ -1,9 +1,192 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "mdma.h"
 #include "commands.h"
-#include "progbar.h"
+#include "progress.h"
+#include "rom_img.h"
+#include "usb_io.h"
+#include "report.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+
+/// Maximum number of extra reads of a chunk with disagreeing copies
+#define READ_VOTE_RETRIES		16
+/// Maximum number of unstable addresses printed
+#define READ_VOTE_REPORT_MAX	32
+
+/// Hook called for each transferred chunk, and its context
+static MdmaChunkHook chunkHook = NULL;
+static void *chunkHookCtx = NULL;
+
+/// Calls the chunk hook, if installed
+#define ChunkHook(dir, addr, data, wLen)	do{if(chunkHook) {			\
+	uint64_t trc_ = TrcStart();										\
+	chunkHook(chunkHookCtx, dir, addr, data, wLen);					\
+	TrcEvent("mdma", "chunk hook", trc_, addr, wLen, 0);}}while(0)
+
+/// Length in words of the chunks read and written with each command
+static uint32_t chunkLen[2] = {MDMA_CHUNK_LEN_DEF, MDMA_CHUNK_LEN_DEF};
+
+/// Reads of disagreeing chunk ranges retried
+static uint32_t readRetries = 0;
+
+/// Erase times of a flash chip, in milliseconds
+typedef struct {
+	uint16_t manId;			///< Manufacturer ID.
+	uint16_t devId[3];		///< Device IDs (0 matches any ID).
+	uint32_t sectMs;		///< Typical sector erase time.
+	uint32_t sectMaxMs;		///< Maximum sector erase time.
+	uint32_t chipMs;		///< Typical chip erase time.
+} MdmaChipTimes;
+
+/// Erase times of the supported chips, from their datasheets
+static const MdmaChipTimes chipTimes[] = {
+	// Spansion S29GL032N/A
+	{0x0001, {0x227E, 0x221D, 0}, 500, 3500, 32000},
+	// Macronix MX29LV320 (top and bottom boot)
+	{0x00C2, {0x22A7, 0, 0}, 700, 15000, 35000},
+	{0x00C2, {0x22A8, 0, 0}, 700, 15000, 35000},
+	// Unknown chip: the longest times of the supported chips
+	{0, {0, 0, 0}, 1000, 15000, 35000}
+};
+
+/// Erase times of the detected chip (NULL until detected)
+static const MdmaChipTimes *chip = NULL;
+
+void MdmaChunkLenSet(MdmaDir dir, uint32_t wLen) {
+	chunkLen[dir] = MAX(MIN(wLen, MDMA_CHUNK_LEN_MAX), MDMA_CHUNK_LEN_MIN);
+}
+
+uint32_t MdmaChunkLenGet(MdmaDir dir) {
+	return chunkLen[dir];
+}
+
+void MdmaChunkHookSet(MdmaChunkHook hook, void *ctx) {
+	chunkHook = hook;
+	chunkHookCtx = ctx;
+}
+
+void MdmaChipReset(void) {
+	chip = NULL;
+}
+
+/// Obtains the erase times of the flash chip, detecting it the first time.
+/// If the chip IDs cannot be read, the unknown chip times are returned and
+/// detection is retried on the next call.
+static const MdmaChipTimes *ChipTimesGet(void) {
+	uint16_t manId = 0;
+	uint16_t devId[3] = {0, 0, 0};
+	int i, j;
+	const int last = sizeof(chipTimes) / sizeof(MdmaChipTimes) - 1;
+
+	if (chip) return chip;
+	if ((int16_t)MDMA_manId_get(&manId) < 0 ||
+			(int16_t)MDMA_devId_get(devId) < 0) {
+		return &chipTimes[last];
+	}
+	for (i = 0; i < last; i++) {
+		if (chipTimes[i].manId != manId) continue;
+		for (j = 0; j < 3 && (!chipTimes[i].devId[j] ||
+					chipTimes[i].devId[j] == devId[j]); j++);
+		if (3 == j) break;
+	}
+	chip = &chipTimes[i];
+
+	return chip;
+}
+
+void MdmaEraseTime(uint32_t addr, uint32_t len, uint32_t *expectMs,
+		uint32_t *timeoutMs) {
+	const MdmaChipTimes *c = ChipTimesGet();
+	uint32_t nSect;
+
+	if (len) {
+		nSect = (addr + len - 1) / MDMA_SECT_LEN - addr / MDMA_SECT_LEN + 1;
+		*expectMs = nSect * c->sectMs;
+	} else {
+		*expectMs = c->chipMs;
+	}
+	// Allow for slow sectors and aging chips
+	*timeoutMs = 2 * *expectMs + c->sectMaxMs;
+}
+
+int MdmaEraseStart(uint32_t addr, uint32_t len) {
+	// Chip must be detected before the erase blocks other commands
+	ChipTimesGet();
+
+	return len ? MDMA_range_erase_start(addr, len) : MDMA_cart_erase_start();
+}
+
+int MdmaEraseWait(uint32_t addr, uint32_t len, MdmaEraseProg prog,
+		void *ctx) {
+	uint64_t start = MonoUs();
+	uint64_t trc = TrcStart();
+	uint32_t expectMs, timeoutMs, elapsed;
+	int ret;
+
+	MdmaEraseTime(addr, len, &expectMs, &timeoutMs);
+	while (MDMA_ERASE_BUSY == (ret = MDMA_erase_poll(MDMA_ERASE_POLL_MS))) {
+		elapsed = (MonoUs() - start) / 1000;
+		if (elapsed > timeoutMs) {
+			PrintErr("\nErase timed out after %.1f s (expected %.1f s)!\n",
+					elapsed / 1000.0, expectMs / 1000.0);
+			MDMA_erase_cancel();
+			ret = -1;
+			break;
+		}
+		if (prog) prog(ctx, elapsed, expectMs);
+	}
+	TrcEvent("mdma", "erase wait", trc, len ? addr : TRC_NONE,
+			len ? len : TRC_NONE, ret);
+
+	return ret;
+}
+
+/// Publishes the erase progress
+static void EraseProgPost(void *ctx, uint32_t elapsedMs, uint32_t expectMs) {
+	// Elapsed and expected time, e.g.: 12.3/32.0s
+	char timeStr[24];
+
+	expectMs = MAX(expectMs, 1);
+	sprintf(timeStr, "%.1f/%.1fs", elapsedMs / 1000.0, expectMs / 1000.0);
+	// Do not reach 100% until the erase completes
+	PrgPost(MIN(elapsedMs, expectMs - expectMs / 100), expectMs, timeStr);
+}
+
+/// Waits for an erase, drawing a progress bar if columns is not 0
+static int EraseWaitBar(uint32_t addr, uint32_t len, int columns) {
+	uint64_t start = MonoUs();
+	int ret;
+	// Erase time, e.g.: 31.2s
+	char timeStr[16];
+
+	PrgBegin("erase", 0, columns);
+	ret = MdmaEraseWait(addr, len, EraseProgPost, NULL);
+	if (!ret) {
+		sprintf(timeStr, "%.1fs", (MonoUs() - start) / 1000000.0);
+		PrgPost(1, 1, timeStr);
+	}
+	PrgEnd();
+	if (columns) putchar('\n');
+
+	return ret;
+}
+
+int MdmaCartErase(int columns) {
+	if (MdmaEraseStart(0, 0)) return -1;
+
+	return EraseWaitBar(0, 0, columns);
+}
+
+int MdmaRangeErase(uint32_t addr, uint32_t len, int columns) {
+	if (!len) return 0;
+	if (MdmaEraseStart(addr, len)) return -1;
+
+	return EraseWaitBar(addr, len, columns);
+}
 
 /// Receives a MemImage pointer with full info in file name (e.g.
 /// m->file = "rom.bin:6000:1"). Removes from m->file information other
@@ -106,111 +289,517 @@ int ParseMemRange(char inStr[], uint32_t *addr, uint32_t *len) {
 	return 0;
 }
 
+// Erases the cart range where the image will be flashed.
+int AutoErase(const MemImage *fWr, int columns) {
+	printf("Auto-erasing range 0x%06X:%06X...\n", fWr->addr, fWr->len);
+	if (MdmaRangeErase(fWr->addr, fWr->len, columns)) {
+		PrintErr("Auto-erase failed!\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/// Queues a chunk transfer on the I/O thread (runs it if not running)
+static void ChunkSubmit(UioJob *job, UioJobType type, uint32_t addr,
+		uint32_t wLen, u16 *data) {
+	job->type = type;
+	job->addr = addr;
+	job->len = wLen;
+	job->data = data;
+	job->aux = NULL;
+	job->done = NULL;
+	job->ctx = NULL;
+	UioSubmit(UioGet(), job);
+}
+
+// Transfers wLen words in chunks. Two chunks are kept queued on the I/O
+// thread, so the device is busy while the previous chunk is hooked and
+// the progress bar drawn.
+static int ChunkXfer(MdmaDir dir, uint32_t addr, u16 *buf, uint32_t wLen,
+		int columns) {
+	UioJobType type = MDMA_DIR_WRITE == dir ? UIO_WRITE : UIO_READ;
+	const char *name = MDMA_DIR_WRITE == dir ? "write range" : "read range";
+	uint64_t trc = TrcStart();
+	UioJob job[2];
+	uint32_t i, step, queued = 0;
+	int cur = 0, n = 0;
+	// Address string, e.g.: 0x123456
+	char addrStr[9];
+
+	PrgBegin(MDMA_DIR_WRITE == dir ? "write" : "read", 2, columns);
+	for (i = 0; i < wLen; i += step) {
+		for (; n < 2 && queued < wLen; n++) {
+			step = MIN(chunkLen[dir], wLen - queued);
+			ChunkSubmit(&job[(cur + n) & 1], type, addr + queued, step,
+					buf + queued);
+			queued += step;
+		}
+		step = job[cur].len;
+		if (UioWait(&job[cur])) {
+			// Do not leave a transfer on a buffer about to be freed
+			if (n > 1) UioWait(&job[cur ^ 1]);
+			PrgEnd();
+			TrcEvent("mdma", name, trc, addr, wLen, -1);
+			return -1;
+		}
+		cur ^= 1;
+		n--;
+		ChunkHook(dir, addr + i, buf + i, step);
+		sprintf(addrStr, "0x%06X", addr + i + step);
+		PrgPost(i + step, wLen, addrStr);
+	}
+	PrgEnd();
+	TrcEvent("mdma", name, trc, addr, wLen, 0);
+
+	return 0;
+}
+
+// Flashes wrLen words of a byte swapped buffer to the address in fWr.
+int FlashBuf(const MemImage *fWr, const u16 *buf, uint32_t wrLen,
+		int columns) {
+	uint64_t trc = TrcStart();
+
+   	printf("Flashing ROM %s starting at 0x%06X...\n", fWr->file, fWr->addr);
+
+	if (ChunkXfer(MDMA_DIR_WRITE, fWr->addr, (u16*)buf, wrLen, columns)) {
+		PrintErr("Couldn't write to cart!\n");
+		MtrCount(MTR_FLASH_ERR, 1);
+		TrcEvent("mdma", "flash", trc, fWr->addr, fWr->len, -1);
+		return -1;
+	}
+   	putchar('\n');
+	MtrCount(MTR_FLASH_OK, 1);
+	// Trimmed padding is not written, but it is part of the image
+	if (fWr->len > wrLen) {
+		ChunkHook(MDMA_DIR_WRITE, fWr->addr + wrLen, buf + wrLen,
+				fWr->len - wrLen);
+	}
+	TrcEvent("mdma", "flash", trc, fWr->addr, fWr->len, 0);
+
+	return 0;
+}
+
+// Checks the state of a sector left erased by an interrupted job. Returns
+// JN_SECT_PROGRAMMED if it already holds the image, JN_SECT_ERASED if the
+// image can be programmed without erasing (only 1 to 0 bit changes), or
+// JN_SECT_PENDING if it must be erased again. Returns -1 on read error.
+static int SectResumeCheck(uint32_t addr, const u16 *img, uint32_t wLen,
+		u16 *tmp) {
+	uint32_t i;
+	int st = JN_SECT_PROGRAMMED;
+
+	if (MDMA_read(wLen, addr, tmp)) return -1;
+	for (i = 0; i < wLen; i++) {
+		if (tmp[i] == img[i]) continue;
+		if ((tmp[i] & img[i]) != img[i]) return JN_SECT_PENDING;
+		st = JN_SECT_ERASED;
+	}
+
+	return st;
+}
+
+// Flashes a byte swapped buffer sector by sector, recording progress in
+// the journal.
+int FlashJournaled(const MemImage *fWr, const u16 *buf, uint32_t wrLen,
+		Journal *jn, int resume, int verify, int columns) {
+	uint64_t trc = TrcStart();
+	uint32_t sect, addr, len, off, prog;
+	int st;
+	u16 *tmp;
+	// Address string, e.g.: 0x123456
+	char addrStr[9];
+
+	if (!(tmp = MDMA_BufAlloc(MDMA_SECT_LEN))) {
+		perror("Allocating sector buffer RAM");
+		return -1;
+	}
+	printf("Flashing ROM %s starting at 0x%06X, journal %s...\n", fWr->file,
+			fWr->addr, jn->file);
+
+	PrgBegin("flash", 2, columns);
+	for (sect = 0; sect < jn->nSect; sect++) {
+		JnSectRange(jn, sect, &addr, &len);
+		off = addr - fWr->addr;
+		// Trimmed padding is not programmed, but it is erased
+		prog = off < wrLen ? MIN(len, wrLen - off) : 0;
+		st = jn->state[sect];
+		if (resume && JN_SECT_ERASED == st) {
+			// Programming might have been interrupted
+			if ((st = SectResumeCheck(addr, buf + off, len, tmp)) < 0) {
+				PrgEnd();
+				PrintErr("\nCouldn't read from cart!\n");
+				goto err;
+			}
+			printf("\nResuming sector 0x%06X: %s.\n", addr,
+					JN_SECT_PROGRAMMED == st ? "already programmed" :
+					JN_SECT_ERASED == st ? "programming" : "erasing again");
+			if (st != JN_SECT_ERASED && JnSet(jn, sect, (JnSectState)st)) {
+				goto errEnd;
+			}
+		}
+		if (JN_SECT_PENDING == st) {
+			if (MdmaRangeErase(addr, len, 0)) {
+				PrgEnd();
+				PrintErr("\nCouldn't erase cart!\n");
+				goto err;
+			}
+			if (JnSet(jn, sect, JN_SECT_ERASED)) goto errEnd;
+			st = JN_SECT_ERASED;
+		}
+		if (JN_SECT_ERASED == st) {
+			if (prog && MDMA_write(prog, addr, (u16*)buf + off)) {
+				PrgEnd();
+				PrintErr("\nCouldn't write to cart!\n");
+				goto err;
+			}
+			if (JnSet(jn, sect, JN_SECT_PROGRAMMED)) goto errEnd;
+			st = JN_SECT_PROGRAMMED;
+		}
+		if (verify && JN_SECT_PROGRAMMED == st) {
+			if (MDMA_read(len, addr, tmp)) {
+				PrgEnd();
+				PrintErr("\nCouldn't read from cart!\n");
+				goto err;
+			}
+			if (memcmp(tmp, buf + off, len<<1)) {
+				PrgEnd();
+				putchar('\n');
+				MdmaVerifyFail(addr, buf + off, tmp, len);
+				goto err;
+			}
+			if (JnSet(jn, sect, JN_SECT_VERIFIED)) goto errEnd;
+		}
+		ChunkHook(MDMA_DIR_WRITE, addr, buf + off, len);
+		sprintf(addrStr, "0x%06X", addr + len);
+		PrgPost(off + len, fWr->len, addrStr);
+	}
+	PrgEnd();
+	putchar('\n');
+	if (verify) printf("Verify OK!\n");
+	MDMA_BufFree(tmp);
+	MtrCount(MTR_FLASH_OK, 1);
+	TrcEvent("mdma", "flash journaled", trc, fWr->addr, fWr->len, 0);
+	return 0;
+
+errEnd:
+	PrgEnd();
+err:
+	MDMA_BufFree(tmp);
+	MtrCount(MTR_FLASH_ERR, 1);
+	TrcEvent("mdma", "flash journaled", trc, fWr->addr, fWr->len, -1);
+	return -1;
+}
+
 // Allocs a buffer, reads a file to the buffer, and flashes the file pointed 
 // by the file argument. The buffer must be deallocated when not needed,
-// using free() call.
+// using MDMA_BufFree() call.
 // Note fWr.len is updated if not specified.
 // Note buffer is byte swapped before returned.
 u16 *AllocAndFlash(MemImage *fWr, int autoErase, int columns) {
-    FILE *rom;
-	u16 *writeBuf;
-	uint32_t addr;
-	int toWrite;
-	uint32_t i;
-	// Address string, e.g.: 0x123456
-	char addrStr[9];
+	RomImg img;
 
-	// Open the file to flash
-	if (!(rom = fopen(fWr->file, "rb"))) {
-		perror(fWr->file);
+	// Erase while the image loads
+	if (RomImgLoadStart(&img, fWr)) return NULL;
+	if (autoErase && AutoErase(fWr, columns)) {
+		RomImgLoadWait(&img);
+		RomImgFree(&img);
+		return NULL;
+	}
+	if (RomImgLoadWait(&img) ||
+			FlashBuf(fWr, img.buf, img.wrLen, columns)) {
+		RomImgFree(&img);
 		return NULL;
 	}
 
-	// Obtain length if not specified
-	if (!fWr->len) {
+	return img.buf;
+}
+
+// Allocs a buffer and reads from cart. Does NOT save the buffer to a file.
+// Buffer must be deallocated using MDMA_BufFree() when not needed anymore.
+u16 *AllocAndRead(MemImage *fRd, int columns) {
+	u16 *readBuf;
 
-	    fseek(rom, 0, SEEK_END);
-	    fWr->len = ftell(rom)>>1;
-	    fseek(rom, 0, SEEK_SET);
+	readBuf = MDMA_BufAlloc(fRd->len);
+	if (!readBuf) {
+		perror("Allocating read buffer RAM");
+		return NULL;
 	}
+	printf("Reading cart starting at 0x%06X...\n", fRd->addr);
 
-    writeBuf = (u16*)malloc(fWr->len<<1);
-	if (!writeBuf) {
-		perror("Allocating write buffer RAM");
-		fclose(rom);
+	fflush(stdout);
+	if (ChunkXfer(MDMA_DIR_READ, fRd->addr, readBuf, fRd->len, columns)) {
+		MDMA_BufFree(readBuf);
+		PrintErr("Couldn't read from cart!\n");
 		return NULL;
 	}
-    fread(writeBuf, fWr->len<<1, 1, rom);
-	fclose(rom);
-   	// Do byte swaps
-   	for (i = 0; i < fWr->len; i++) ByteSwapWord(writeBuf[i]);
-
-	// If requested, perform auto-erase
-	if (autoErase) {
-		printf("Auto-erasing range 0x%06X:%06X... ", fWr->addr, fWr->len);
-		fflush(stdout);
-		if (MDMA_range_erase(fWr->addr, fWr->len)) {
-			free(writeBuf);
-			PrintErr("Auto-erase failed!\n");
-			return NULL;
+	putchar('\n');
+	return readBuf;
+}
+
+
+
+// Obtains the most read value of a word. Returns how many times it was read.
+static int ReadVoteWord(u16 *const copy[], int nCopies, uint32_t pos,
+		u16 *value) {
+	int i, j, count, best = 0;
+
+	for (i = 0; i < nCopies; i++) {
+		for (j = i, count = 0; j < nCopies; j++) {
+			if (copy[j][pos] == copy[i][pos]) count++;
+		}
+		if (count > best) {
+			best = count;
+			*value = copy[i][pos];
 		}
-		printf("OK!\n");
 	}
 
-   	printf("Flashing ROM %s starting at 0x%06X...\n", fWr->file, fWr->addr);
+	return best;
+}
 
-	for (i = 0, addr = fWr->addr; i < fWr->len;) {
-		toWrite = MIN(65536>>1, fWr->len - i);
-		if (MDMA_write(toWrite, addr, writeBuf + i)) {
-			free(writeBuf);
-			fclose(rom);
-			PrintErr("Couldn't write to cart!\n");
-			return NULL;
+// Reads a chunk passes times. If copies disagree, only the disagreeing
+// range is read again, until every word value has been read passes times.
+// copy[0] is the output buffer. Returns the number of unstable words, or
+// -1 on read error.
+static int ReadVoteChunk(uint32_t addr, uint16_t wLen, int passes,
+		u16 *copy[], uint32_t *unresolved, int *reported) {
+	uint32_t first = wLen, last = 0, j;
+	int n, count, stable;
+	int unstable = 0;
+	int printed = FALSE;
+	uint64_t trc;
+	u16 value;
+
+	for (n = 0; n < passes; n++) {
+		if (MDMA_read(wLen, addr, copy[n])) return -1;
+	}
+	// Fast path: all copies are equal
+	for (n = 1; n < passes && !memcmp(copy[0], copy[n], wLen<<1); n++);
+	if (n == passes) return 0;
+
+	// Obtain the range where copies disagree
+	for (n = 1; n < passes; n++) {
+		for (j = 0; j < wLen; j++) {
+			if (copy[0][j] != copy[n][j]) {
+				first = MIN(first, j);
+				last = MAX(last, j);
+			}
 		}
-		// Update vars and draw progress bar
-		i += toWrite;
-		addr += toWrite;
-   	    sprintf(addrStr, "0x%06X", addr);
-   	    ProgBarDraw(i, fWr->len, columns, addrStr);
 	}
-   	putchar('\n');
-	return writeBuf;
+
+	// Read the range again until a quorum is reached for every word
+	for (stable = FALSE; !stable && n < (passes + READ_VOTE_RETRIES); n++) {
+		readRetries++;
+		trc = TrcStart();
+		if (MDMA_read(last - first + 1, addr + first, copy[n] + first)) {
+			return -1;
+		}
+		TrcEvent("mdma", "read retry", trc, addr + first, last - first + 1,
+				0);
+		for (j = first, stable = TRUE; stable && j <= last; j++) {
+			stable = ReadVoteWord(copy, n + 1, j, &value) >= passes;
+		}
+	}
+
+	// Keep the most read value, and report unstable words
+	for (j = first; j <= last; j++) {
+		count = ReadVoteWord(copy, n, j, &value);
+		if (count == n) continue;
+		unstable++;
+		if (count < passes) (*unresolved)++;
+		if ((*reported)++ < READ_VOTE_REPORT_MAX) {
+			printed = TRUE;
+			printf("\nUnstable word at 0x%06X: 0x%04X read %d/%d times%s",
+					addr + j, value, count, n,
+					count < passes ? " (UNRESOLVED)" : "");
+		}
+		copy[0][j] = value;
+	}
+	if (printed) putchar('\n');
+
+	return unstable;
 }
 
-// Allocs a buffer and reads from cart. Does NOT save the buffer to a file.
-// Buffer must be deallocated using free() when not needed anymore.
-u16 *AllocAndRead(MemImage *fRd, int columns) {
+// Allocs a buffer and reads from cart, reading each chunk passes times and
+// re-reading disagreeing ranges until they reach a quorum. Does NOT save
+// the buffer to a file. Buffer must be deallocated using MDMA_BufFree()
+// when not needed anymore.
+u16 *AllocAndReadVote(MemImage *fRd, int passes, int columns,
+		uint32_t *unresolved) {
 	u16 *readBuf;
+	u16 *copy[READ_VOTE_RETRIES + 16];
+	u16 *scratch;
 	int toRead;
+	int ret;
+	int reported = 0;
+	uint32_t unstable = 0;
 	uint32_t addr;
 	uint32_t i;
+	int n;
+	const int nCopies = passes + READ_VOTE_RETRIES;
 	// Address string, e.g.: 0x123456
 	char addrStr[9];
 
-	readBuf = (u16*)malloc(fRd->len<<1);
-	if (!readBuf) {
+	*unresolved = 0;
+	if (passes < 2) return AllocAndRead(fRd, columns);
+	if (passes > 16) {
+		PrintErr("Error: at most 16 read passes are supported\n");
+		return NULL;
+	}
+
+	readBuf = MDMA_BufAlloc(fRd->len);
+	scratch = MDMA_BufAlloc((nCopies - 1) * MDMA_CHUNK_LEN_MAX);
+	if (!readBuf || !scratch) {
 		perror("Allocating read buffer RAM");
+		MDMA_BufFree(readBuf);
+		MDMA_BufFree(scratch);
 		return NULL;
 	}
-	printf("Reading cart starting at 0x%06X...\n", fRd->addr);
+	for (n = 1; n < nCopies; n++) {
+		copy[n] = scratch + (n - 1) * MDMA_CHUNK_LEN_MAX;
+	}
 
+	printf("Reading cart starting at 0x%06X, %d passes...\n", fRd->addr,
+			passes);
 	fflush(stdout);
+	PrgBegin("read", 2, columns);
 	for (i = 0, addr = fRd->addr; i < fRd->len;) {
-		toRead = MIN(65536>>1, fRd->len - i);
-		if (MDMA_read(toRead, addr, readBuf + i)) {
-			free(readBuf);
+		toRead = MIN(chunkLen[MDMA_DIR_READ], fRd->len - i);
+		copy[0] = readBuf + i;
+		ret = ReadVoteChunk(addr, toRead, passes, copy, unresolved,
+				&reported);
+		if (ret < 0) {
+			PrgEnd();
+			MDMA_BufFree(readBuf);
+			MDMA_BufFree(scratch);
 			PrintErr("Couldn't read from cart!\n");
 			return NULL;
 		}
-		fflush(stdout);
+		unstable += ret;
+		ChunkHook(MDMA_DIR_READ, addr, readBuf + i, toRead);
 		// Update vars and draw progress bar
 		i += toRead;
 		addr += toRead;
    	    sprintf(addrStr, "0x%06X", addr);
-   	    ProgBarDraw(i, fRd->len, columns, addrStr);
+   	    PrgPost(i, fRd->len, addrStr);
 	}
+	PrgEnd();
 	putchar('\n');
+	MDMA_BufFree(scratch);
+
+	if (unstable) {
+		printf("%u unstable word(s), %u unresolved.\n", unstable,
+				*unresolved);
+	} else {
+		printf("All %d passes match.\n", passes);
+	}
+
 	return readBuf;
 }
 
+/// Word written to a verified range, 0xFFFF if the range must be erased
+static inline u16 VerifyWord(const u16 *wr, uint32_t i) {
+	return wr ? wr[i] : 0xFFFF;
+}
 
+void MdmaVerifyFail(uint32_t addr, const u16 *wr, const u16 *rd,
+		uint32_t len) {
+	uint32_t i, start;
+
+	for (i = 0; i < len && VerifyWord(wr, i) == rd[i]; i++);
+	if (i == len) return;
+	PrintErr("Verify failed at addr 0x%06X! Wrote: 0x%04X; Read: 0x%04X\n",
+			addr + i, VerifyWord(wr, i), rd[i]);
+	PROBE_VERIFY_MISMATCH(addr + i, len);
+	MtrCount(MTR_VERIFY_FAIL, 1);
+	// Record all the mismatching ranges from the first one
+	while (i < len) {
+		for (start = i; i < len && VerifyWord(wr, i) != rd[i]; i++);
+		RptMismatch(addr + start, i - start);
+		for (; i < len && VerifyWord(wr, i) == rd[i]; i++);
+	}
+}
+
+// Reads several cart regions, merging overlapping and adjacent ones so each
+// memory range is read only once. A buffer is allocated for each region,
+// and must be deallocated using MDMA_BufFree() when not needed anymore.
+int ReadRegions(const MemImage rd[], int n, u16 *buf[], int passes,
+		int columns, uint32_t *unresolved) {
+	int order[MDMA_READ_SPANS_MAX];
+	MemImage span;
+	u16 *spanBuf;
+	uint32_t spanEnd, spanUnresolved, retries;
+	int i, j, tmp, first, op;
+	uint64_t trc;
+
+	*unresolved = 0;
+	if (n > MDMA_READ_SPANS_MAX) return -1;
+	for (i = 0; i < n; i++) {
+		order[i] = i;
+		buf[i] = NULL;
+	}
+	// Sort regions by start address (insertion sort, there are few)
+	for (i = 1; i < n; i++) {
+		for (j = i; j && rd[order[j - 1]].addr > rd[order[j]].addr; j--) {
+			tmp = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = tmp;
+		}
+	}
+
+	for (i = 0; i < n;) {
+		// Extend span while next region overlaps or is adjacent
+		first = i;
+		span.file = NULL;
+		span.addr = rd[order[i]].addr;
+		spanEnd = span.addr + rd[order[i]].len;
+		for (i++; i < n && rd[order[i]].addr <= spanEnd; i++) {
+			spanEnd = MAX(spanEnd, rd[order[i]].addr + rd[order[i]].len);
+		}
+		span.len = spanEnd - span.addr;
+
+		spanBuf = NULL;
+		if (span.len) {
+			op = RptOpBegin("read", span.addr, span.len);
+			trc = TrcStart();
+			retries = readRetries;
+			spanBuf = AllocAndReadVote(&span, passes, columns,
+					&spanUnresolved);
+			RptOpEnd(op, !spanBuf);
+			TrcEvent("mdma", "read", trc, span.addr, span.len, !spanBuf);
+			if (!spanBuf) goto err;
+			RptOpRetries(op, readRetries - retries, spanUnresolved);
+			*unresolved += spanUnresolved;
+		}
+
+		// A span with a single region is handed over without copying
+		if (spanBuf && i - first == 1) {
+			buf[order[first]] = spanBuf;
+			continue;
+		}
+		// Split span data into the requested regions
+		for (j = first; j < i; j++) {
+			tmp = order[j];
+			buf[tmp] = MDMA_BufAlloc(MAX(rd[tmp].len, 1));
+			if (!buf[tmp]) {
+				perror("Allocating read buffer RAM");
+				MDMA_BufFree(spanBuf);
+				goto err;
+			}
+			if (rd[tmp].len) {
+				memcpy(buf[tmp], spanBuf + (rd[tmp].addr - span.addr),
+						rd[tmp].len<<1);
+			}
+		}
+		MDMA_BufFree(spanBuf);
+	}
+
+	return 0;
+
+err:
+	for (i = 0; i < n; i++) {
+		MDMA_BufFree(buf[i]);
+		buf[i] = NULL;
+	}
+	return -1;
+}
@@ -3,11 +3,27 @@
 
 #include <stdint.h>
 #include "util.h"
+#include "journal.h"
 
 /// Maximum length of a file
 #define MAX_FILELEN		255
 /// Maximum length of a memory range.
 #define MAX_MEM_RANGE	24
+/// Length of a flash sector in words
+#define MDMA_SECT_LEN	(64 * 1024 / 2)
+/// Default length in words of the chunks transferred with each command
+#define MDMA_CHUNK_LEN_DEF	(65536>>1)
+/// Maximum length in words of the chunks transferred with each command
+#define MDMA_CHUNK_LEN_MAX	(65536>>1)
+/// Minimum length in words of the chunks transferred with each command
+#define MDMA_CHUNK_LEN_MIN	256
+/// Maximum number of regions read in a single invocation
+#define MDMA_READ_REGIONS_MAX	16
+/// Maximum number of regions read by ReadRegions(): the regions to read,
+/// plus the written range when verifying
+#define MDMA_READ_SPANS_MAX		(MDMA_READ_REGIONS_MAX + 1)
+/// Interval between erase progress updates, in milliseconds
+#define MDMA_ERASE_POLL_MS	100
 #define VERSION_MAJOR	0x00
 #define VERSION_MINOR	0x05
 
@@ -18,10 +34,36 @@ typedef struct {
 	uint32_t len;
 } MemImage;
 
+/// Direction of a cart transfer
+typedef enum {
+	MDMA_DIR_READ = 0,	///< Data read from the cart.
+	MDMA_DIR_WRITE		///< Data written to the cart.
+} MdmaDir;
+
+/// Hook called each time a chunk of (byte swapped) data is transferred.
+typedef void (*MdmaChunkHook)(void *ctx, MdmaDir dir, uint32_t addr,
+		const u16 *data, uint32_t wLen);
+
+/// Called periodically while waiting for an erase to complete.
+typedef void (*MdmaEraseProg)(void *ctx, uint32_t elapsedMs,
+		uint32_t expectMs);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Installs a hook, called with each chunk read from or written to the cart
+// by the functions in this module. Set hook to NULL to remove it.
+void MdmaChunkHookSet(MdmaChunkHook hook, void *ctx);
+
+// Sets the length in words of the chunks read or written with each command
+// (MDMA_CHUNK_LEN_MIN to MDMA_CHUNK_LEN_MAX).
+void MdmaChunkLenSet(MdmaDir dir, uint32_t wLen);
+
+// Returns the length in words of the chunks read or written with each
+// command.
+uint32_t MdmaChunkLenGet(MdmaDir dir);
+
 /// Receives a MemImage pointer with full info in file name (e.g.
 /// m->file = "rom.bin:6000:1"). Removes from m->file information other
 /// than the file name, and fills the remaining structure fields if info
@@ -46,17 +88,91 @@ void PrintMemError(int code);
  ****************************************************************************/
 int ParseMemRange(char inStr[], uint32_t *addr, uint32_t *len);
 
+// Forgets the detected flash chip, so it is detected again the next time
+// its erase times are needed. Call it when the programmer is opened or
+// closed, and when the cart may have been replaced.
+void MdmaChipReset(void);
+
+// Obtains the expected erase time of a range (len 0 for the whole chip)
+// for the flash chip, and the time after which the erase is considered
+// failed, in milliseconds. The chip is detected on the first call, so it
+// must not be called while an erase is in progress, unless the erase was
+// started with MdmaEraseStart().
+void MdmaEraseTime(uint32_t addr, uint32_t len, uint32_t *expectMs,
+		uint32_t *timeoutMs);
+
+// Detects the flash chip (if not done yet) and starts erasing a range (len
+// 0 for the whole chip), without waiting for the erase to complete.
+// Returns 0 on success, -1 on error.
+int MdmaEraseStart(uint32_t addr, uint32_t len);
+
+// Waits for the erase started with MdmaEraseStart() to complete, calling
+// prog (if not NULL) every MDMA_ERASE_POLL_MS. Gives up when the erase
+// takes too long for the detected chip. Returns 0 on success, -1 on error.
+int MdmaEraseWait(uint32_t addr, uint32_t len, MdmaEraseProg prog,
+		void *ctx);
+
+// Erases the entire flash chip. If columns is not 0, a progress bar with
+// the elapsed and expected erase time is drawn. Returns 0 on success, -1
+// on error.
+int MdmaCartErase(int columns);
+
+// Erases a flash range. If columns is not 0, a progress bar with the
+// elapsed and expected erase time is drawn. Returns 0 on success, -1 on
+// error.
+int MdmaRangeErase(uint32_t addr, uint32_t len, int columns);
+
+// Erases the cart range where the image will be flashed.
+// Returns 0 on success, -1 on error.
+int AutoErase(const MemImage *fWr, int columns);
+
+// Flashes wrLen words of a byte swapped buffer to the address in fWr.
+// Returns 0 on success, -1 on error.
+int FlashBuf(const MemImage *fWr, const u16 *buf, uint32_t wrLen,
+		int columns);
+
+// Flashes a byte swapped buffer sector by sector, erasing each sector
+// before programming it, and verifying it if verify is TRUE. Sector states
+// are recorded in the journal. On resume, completed sectors are skipped,
+// and erased sectors are read back to check if they need erasing again.
+// The journal must cover the fWr range. Returns 0 on success, -1 on error.
+int FlashJournaled(const MemImage *fWr, const u16 *buf, uint32_t wrLen,
+		Journal *jn, int resume, int verify, int columns);
+
 // Allocs a buffer, reads a file to the buffer, and flashes the file pointed 
 // by the file argument. The buffer must be deallocated when not needed,
-// using free() call.
+// using MDMA_BufFree() call.
 // Note fWr.len is updated if not specified.
 // Note buffer is byte swapped before returned.
 u16 *AllocAndFlash(MemImage *fWr, int autoErase, int columns);
 
 // Allocs a buffer and reads from cart. Does NOT save the buffer to a file.
-// Buffer must be deallocated using free() when not needed anymore.
+// Buffer must be deallocated using MDMA_BufFree() when not needed anymore.
 u16 *AllocAndRead(MemImage *fRd, int columns);
 
+// Allocs a buffer and reads from cart, reading each chunk passes times and
+// re-reading the disagreeing ranges until every word is read passes times
+// with the same value. Words without a quorum are counted in unresolved.
+// Buffer must be deallocated using MDMA_BufFree() when not needed anymore.
+u16 *AllocAndReadVote(MemImage *fRd, int passes, int columns,
+		uint32_t *unresolved);
+
+// Reads several cart regions, merging overlapping and adjacent ones so
+// each memory range is read only once, using AllocAndReadVote(). A buffer
+// is allocated for each region in buf[]. Buffers must be deallocated
+// using MDMA_BufFree() when not needed anymore. Up to MDMA_READ_SPANS_MAX
+// regions can be read. Returns 0 on success, -1 on error.
+int ReadRegions(const MemImage rd[], int n, u16 *buf[], int passes,
+		int columns, uint32_t *unresolved);
+
+// Reports a failed verify of the len words at addr, written from wr (NULL
+// if the words must be erased) and read back to rd: prints the first
+// mismatching word, records the mismatching ranges in the report, and
+// counts the failure in the metrics and probes. Progress of the running
+// operation must be ended before.
+void MdmaVerifyFail(uint32_t addr, const u16 *wr, const u16 *rd,
+		uint32_t len);
+
 #ifdef __cplusplus
 }
 #endif
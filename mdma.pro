@@ -17,11 +17,19 @@ DEFINES += QT_DEPRECATED_WARNINGS
 #CONFIG+=no_smart_library_merge
 #QTPLUGIN+=qwindows
 
-# Link with libusb-1.0
-LIBS += -lusb-1.0
+# Link with libusb-1.0 and pthreads
+LIBS += -lusb-1.0 -lpthread
 
 DEFINES += QT
 
 # Input files
-HEADERS = flashdlg.h commands.h esp-prog.h mdma.h progbar.h flash_man.h
-SOURCES += main.cpp flashdlg.cpp commands.c esp-prog.c mdma.c progbar.c flash_man.cpp
+HEADERS = flashdlg.h commands.h esp-prog.h mdma.h progbar.h flash_man.h \
+		  rom_img.h quick_verify.h manifest.h burn_in.h journal.h \
+		  shell.h mdz.h tune.h usb_io.h daemon.h watch.h \
+		  production.h copy.h stats.h report.h metrics.h trace.h recorder.h \
+		  probes.h progress.h rle.h
+SOURCES += main.cpp flashdlg.cpp commands.c esp-prog.c mdma.c progbar.c flash_man.cpp \
+		   rom_img.c quick_verify.c manifest.c burn_in.c journal.c \
+		   shell.c mdz.c tune.c usb_io.c daemon.c watch.c \
+		   production.c copy.c stats.c report.c metrics.c trace.c recorder.c \
+		   progress.c rle.c
@@ -0,0 +1,557 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief MDZ compressed ROM container.
+ *
+ * Implements the LZ77 class codec, the streaming writer (compressing
+ * frames on a worker thread) and the random access reader.
+ *
+ * The codec encodes sequences of a token byte, literals, a 16-bit match
+ * offset and a match length. The token holds the literal count in the
+ * high nibble and the match length minus MDZ_MIN_MATCH in the low nibble.
+ * A nibble value of 15 is followed by extra length bytes, added until a
+ * byte other than 255 is found. The last sequence has only literals.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mdz.h"
+
+/// Minimum match length
+#define MDZ_MIN_MATCH	4
+/// Bits of the match finder hash table index
+#define MDZ_HASH_BITS	13
+/// Matches do not start in the last bytes of the input
+#define MDZ_MATCH_GUARD	12
+/// Last bytes of the input are always literals
+#define MDZ_LAST_LITS	5
+/// Frame size flag signalling data stored without compression
+#define MDZ_STORED		0x80000000U
+/// Length of the file header
+#define MDZ_HEAD_LEN	8
+/// Length of the file trailer
+#define MDZ_TRAIL_LEN	20
+/// Maximum supported frame length
+#define MDZ_FRAME_MAX	(16 * 1024 * 1024)
+
+struct MdzWriter {
+	FILE *f;					///< Output file.
+	char *file;					///< Output file name.
+	uint32_t addr;				///< Start word address of the cart range.
+	uint32_t len;				///< Length in words of the cart range.
+	uint32_t pos;				///< Words of the cart range received.
+	uint8_t *slot[MDZ_QUEUE_LEN];	///< Frames being filled or queued.
+	uint32_t slotLen[MDZ_QUEUE_LEN];	///< Length of queued frames.
+	uint32_t head;				///< Frame being filled.
+	uint32_t tail;				///< Next frame to compress.
+	uint32_t fill;				///< Bytes in the frame being filled.
+	uint8_t *out;				///< Compressed frame buffer.
+	uint64_t *index;			///< Offset of each frame.
+	uint32_t nFrames;			///< Number of frames written.
+	uint32_t indexCap;			///< Capacity of the index.
+	uint64_t rawLen;			///< Uncompressed bytes written.
+	uint64_t outPos;			///< Current file offset.
+	int done;					///< No more frames will be queued.
+	int abort;					///< Stop compressing.
+	int err;					///< Compression thread error.
+	pthread_t thread;			///< Compression thread.
+	pthread_mutex_t lock;		///< Queue lock.
+	pthread_cond_t cond;		///< Queue state changes.
+};
+
+struct MdzReader {
+	FILE *f;					///< Input file.
+	uint32_t frameLen;			///< Uncompressed length of frames.
+	uint64_t rawLen;			///< Uncompressed length of the data.
+	uint32_t nFrames;			///< Number of frames.
+	uint64_t *index;			///< Offset of each frame.
+	uint8_t *cBuf;				///< Compressed frame buffer.
+	uint8_t *fBuf;				///< Decompressed frame buffer.
+	uint32_t cur;				///< Frame in fBuf (UINT32_MAX if none).
+};
+
+static inline uint32_t MdzHash(const uint8_t *p) {
+	uint32_t v = p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+
+	return (v * 2654435761U) >> (32 - MDZ_HASH_BITS);
+}
+
+static inline uint8_t *MdzLenPut(uint8_t *op, uint32_t len) {
+	for (; len >= 255; len -= 255) *op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+static inline void MdzU32Put(uint8_t *p, uint32_t val) {
+	p[0] = val; p[1] = val>>8; p[2] = val>>16; p[3] = val>>24;
+}
+
+static inline uint32_t MdzU32Get(const uint8_t *p) {
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static inline void MdzU64Put(uint8_t *p, uint64_t val) {
+	MdzU32Put(p, val);
+	MdzU32Put(p + 4, val>>32);
+}
+
+static inline uint64_t MdzU64Get(const uint8_t *p) {
+	return MdzU32Get(p) | ((uint64_t)MdzU32Get(p + 4)<<32);
+}
+
+uint32_t MdzCompress(const uint8_t *src, uint32_t len, uint8_t *dst,
+		uint32_t cap) {
+	// Position + 1 of the last occurrence of each hash, 0 if none
+	uint32_t table[1<<MDZ_HASH_BITS];
+	const uint8_t *ip = src, *anchor = src, *match;
+	const uint8_t *end = src + len;
+	const uint8_t *mLimit = len > MDZ_MATCH_GUARD ?
+		end - MDZ_MATCH_GUARD : src;
+	uint8_t *op = dst;
+	uint32_t h, ref, lit, mLen, off;
+
+	memset(table, 0, sizeof(table));
+	while (ip < mLimit) {
+		h = MdzHash(ip);
+		ref = table[h];
+		table[h] = ip - src + 1;
+		match = src + ref - 1;
+		if (!ref || (ip - match) > 0xFFFF || memcmp(match, ip, 4)) {
+			ip++;
+			continue;
+		}
+		for (mLen = MDZ_MIN_MATCH; ip + mLen < end - MDZ_LAST_LITS &&
+				ip[mLen] == match[mLen]; mLen++);
+		lit = ip - anchor;
+		// Token, extra lengths, literals and offset must fit
+		if ((uint32_t)(op - dst) + lit + lit / 255 + mLen / 255 + 5 > cap) {
+			return 0;
+		}
+		*op = (MIN(lit, 15)<<4) | MIN(mLen - MDZ_MIN_MATCH, 15);
+		op++;
+		if (lit >= 15) op = MdzLenPut(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+		off = ip - match;
+		*op++ = off;
+		*op++ = off>>8;
+		if (mLen - MDZ_MIN_MATCH >= 15) {
+			op = MdzLenPut(op, mLen - MDZ_MIN_MATCH - 15);
+		}
+		ip += mLen;
+		anchor = ip;
+	}
+	// Last literals
+	lit = end - anchor;
+	if ((uint32_t)(op - dst) + lit + lit / 255 + 2 > cap) return 0;
+	*op++ = MIN(lit, 15)<<4;
+	if (lit >= 15) op = MdzLenPut(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
+
+int MdzDecompress(const uint8_t *src, uint32_t len, uint8_t *dst,
+		uint32_t outLen) {
+	const uint8_t *ip = src, *iEnd = src + len;
+	uint8_t *op = dst, *oEnd = dst + outLen;
+	const uint8_t *match;
+	uint32_t lit, mLen, off;
+	uint8_t tok, b;
+
+	while (ip < iEnd) {
+		tok = *ip++;
+		lit = tok>>4;
+		if (15 == lit) do {
+			if (ip >= iEnd) return -1;
+			lit += (b = *ip++);
+		} while (255 == b);
+		if (lit > (uint32_t)(iEnd - ip) || lit > (uint32_t)(oEnd - op)) {
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		// Last sequence has no match
+		if (ip == iEnd) break;
+		if (iEnd - ip < 2) return -1;
+		off = ip[0] | (ip[1]<<8);
+		ip += 2;
+		if (!off || off > (uint32_t)(op - dst)) return -1;
+		mLen = tok & 15;
+		if (15 == mLen) do {
+			if (ip >= iEnd) return -1;
+			mLen += (b = *ip++);
+		} while (255 == b);
+		mLen += MDZ_MIN_MATCH;
+		if (mLen > (uint32_t)(oEnd - op)) return -1;
+		// Matches can overlap the output, copy byte by byte
+		for (match = op - off; mLen; mLen--) *op++ = *match++;
+	}
+
+	return op == oEnd ? 0 : -1;
+}
+
+int MdzIsName(const char *file) {
+	size_t len = strlen(file);
+
+	return len >= sizeof(MDZ_EXT) &&
+		!strcmp(file + len - (sizeof(MDZ_EXT) - 1), MDZ_EXT);
+}
+
+/// Compresses a frame and appends it to the file
+static int MdzFrameWrite(MdzWriter *w, const uint8_t *data, uint32_t len) {
+	uint8_t hdr[4];
+	uint32_t cLen;
+	uint64_t *index;
+
+	if (w->nFrames == w->indexCap) {
+		w->indexCap = MAX(2 * w->indexCap, 64);
+		if (!(index = (uint64_t*)realloc(w->index,
+						w->indexCap * sizeof(uint64_t)))) {
+			perror("Allocating MDZ index RAM");
+			return -1;
+		}
+		w->index = index;
+	}
+	w->index[w->nFrames++] = w->outPos;
+
+	// Frames that do not compress are stored
+	cLen = MdzCompress(data, len, w->out, len - 1);
+	MdzU32Put(hdr, cLen ? cLen : (len | MDZ_STORED));
+	if (!cLen) cLen = len;
+	else data = w->out;
+	if ((fwrite(hdr, sizeof(hdr), 1, w->f) != 1) ||
+			(fwrite(data, cLen, 1, w->f) != 1)) {
+		perror(w->file);
+		return -1;
+	}
+	w->outPos += sizeof(hdr) + cLen;
+	w->rawLen += len;
+
+	return 0;
+}
+
+static void *MdzWriterThread(void *arg) {
+	MdzWriter *w = (MdzWriter*)arg;
+	uint32_t s;
+	int err;
+
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		while (w->tail == w->head && !w->done && !w->abort) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (w->abort || w->tail == w->head) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		s = w->tail % MDZ_QUEUE_LEN;
+		pthread_mutex_unlock(&w->lock);
+
+		err = MdzFrameWrite(w, w->slot[s], w->slotLen[s]);
+
+		pthread_mutex_lock(&w->lock);
+		w->tail++;
+		w->err = err;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		if (err) break;
+	}
+
+	return NULL;
+}
+
+/// Frees writer resources
+static void MdzWriterFree(MdzWriter *w) {
+	int i;
+
+	if (w->f) fclose(w->f);
+	for (i = 0; i < MDZ_QUEUE_LEN; i++) free(w->slot[i]);
+	free(w->out);
+	free(w->index);
+	free(w->file);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	free(w);
+}
+
+MdzWriter *MdzWriterNew(const char *file, uint32_t addr, uint32_t len) {
+	MdzWriter *w;
+	uint8_t hdr[MDZ_HEAD_LEN];
+	int i;
+
+	if (!(w = (MdzWriter*)calloc(1, sizeof(MdzWriter)))) {
+		perror("Allocating MDZ writer RAM");
+		return NULL;
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->addr = addr;
+	w->len = len;
+	for (i = 0; i < MDZ_QUEUE_LEN; i++) {
+		if (!(w->slot[i] = (uint8_t*)malloc(MDZ_FRAME_LEN))) break;
+	}
+	w->out = (uint8_t*)malloc(MDZ_FRAME_LEN);
+	w->file = (char*)malloc(strlen(file) + 1);
+	if (i < MDZ_QUEUE_LEN || !w->out || !w->file) {
+		perror("Allocating MDZ writer RAM");
+		MdzWriterFree(w);
+		return NULL;
+	}
+	strcpy(w->file, file);
+	memcpy(hdr, MDZ_MAGIC, 4);
+	MdzU32Put(hdr + 4, MDZ_FRAME_LEN);
+	if (!(w->f = fopen(file, "wb")) ||
+			(fwrite(hdr, sizeof(hdr), 1, w->f) != 1)) {
+		perror(file);
+		MdzWriterFree(w);
+		return NULL;
+	}
+	w->outPos = sizeof(hdr);
+	if (pthread_create(&w->thread, NULL, MdzWriterThread, w)) {
+		PrintErr("Error: could not start compression thread\n");
+		MdzWriterFree(w);
+		remove(file);
+		return NULL;
+	}
+
+	return w;
+}
+
+/// Queues the frame being filled
+static void MdzWriterPush(MdzWriter *w) {
+	pthread_mutex_lock(&w->lock);
+	w->slotLen[w->head % MDZ_QUEUE_LEN] = w->fill;
+	w->head++;
+	w->fill = 0;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+int MdzWriterPut(MdzWriter *w, const uint8_t *data, uint32_t len) {
+	uint32_t n;
+	int err;
+
+	while (len) {
+		// Wait for a free slot to fill
+		pthread_mutex_lock(&w->lock);
+		while ((w->head - w->tail) == MDZ_QUEUE_LEN && !w->err) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		err = w->err;
+		pthread_mutex_unlock(&w->lock);
+		if (err) return err;
+
+		n = MIN(len, MDZ_FRAME_LEN - w->fill);
+		memcpy(w->slot[w->head % MDZ_QUEUE_LEN] + w->fill, data, n);
+		w->fill += n;
+		data += n;
+		len -= n;
+		if (MDZ_FRAME_LEN == w->fill) MdzWriterPush(w);
+	}
+
+	return 0;
+}
+
+void MdzHook(void *ctx, MdmaDir dir, uint32_t addr, const u16 *data,
+		uint32_t wLen) {
+	MdzWriter **w;
+	uint8_t buf[512];
+	uint32_t start, end, i, n;
+
+	if (dir != MDMA_DIR_READ) return;
+	for (w = (MdzWriter**)ctx; *w; w++) {
+		// Chunks arrive in address order, take the next part of the range
+		start = MAX(addr, (*w)->addr + (*w)->pos);
+		end = MIN(addr + wLen, (*w)->addr + (*w)->len);
+		if (start != (*w)->addr + (*w)->pos) continue;
+		for (; start < end; start += n) {
+			n = MIN(end - start, sizeof(buf) / 2);
+			for (i = 0; i < n; i++) {
+				buf[2 * i]     = data[start - addr + i]>>8;
+				buf[2 * i + 1] = data[start - addr + i];
+			}
+			MdzWriterPut(*w, buf, n * 2);
+			(*w)->pos += n;
+		}
+	}
+}
+
+int MdzWriterClose(MdzWriter *w) {
+	uint8_t trail[MDZ_TRAIL_LEN];
+	uint8_t off[8];
+	uint64_t indexPos;
+	uint32_t i;
+	int err = 0;
+
+	if (w->fill) MdzWriterPush(w);
+	pthread_mutex_lock(&w->lock);
+	w->done = TRUE;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	if ((err = w->err)) goto out;
+	indexPos = w->outPos;
+	for (i = 0; i < w->nFrames; i++) {
+		MdzU64Put(off, w->index[i]);
+		if (fwrite(off, sizeof(off), 1, w->f) != 1) break;
+	}
+	MdzU64Put(trail, indexPos);
+	MdzU64Put(trail + 8, w->rawLen);
+	memcpy(trail + 16, MDZ_END_MAGIC, 4);
+	if ((i < w->nFrames) || (fwrite(trail, sizeof(trail), 1, w->f) != 1) ||
+			fclose(w->f)) {
+		perror(w->file);
+		err = -1;
+	}
+	w->f = NULL;
+
+out:
+	if (err) {
+		if (w->f) fclose(w->f);
+		w->f = NULL;
+		remove(w->file);
+	}
+	MdzWriterFree(w);
+
+	return err;
+}
+
+void MdzWriterAbort(MdzWriter *w) {
+	if (!w) return;
+	pthread_mutex_lock(&w->lock);
+	w->abort = TRUE;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	fclose(w->f);
+	w->f = NULL;
+	remove(w->file);
+	MdzWriterFree(w);
+}
+
+MdzReader *MdzOpen(const char *file) {
+	MdzReader *rd;
+	uint8_t hdr[MDZ_TRAIL_LEN];
+	uint64_t indexPos, frames;
+	long fLen;
+	uint32_t i;
+
+	if (!(rd = (MdzReader*)calloc(1, sizeof(MdzReader)))) {
+		perror("Allocating MDZ reader RAM");
+		return NULL;
+	}
+	rd->cur = UINT32_MAX;
+	if (!(rd->f = fopen(file, "rb"))) {
+		perror(file);
+		goto err;
+	}
+	if ((fread(hdr, MDZ_HEAD_LEN, 1, rd->f) != 1) ||
+			memcmp(hdr, MDZ_MAGIC, 4)) goto invalid;
+	rd->frameLen = MdzU32Get(hdr + 4);
+	if (!rd->frameLen || rd->frameLen > MDZ_FRAME_MAX) goto invalid;
+	if (fseek(rd->f, 0, SEEK_END) || (fLen = ftell(rd->f)) <
+			MDZ_HEAD_LEN + MDZ_TRAIL_LEN) goto invalid;
+	if (fseek(rd->f, fLen - MDZ_TRAIL_LEN, SEEK_SET) ||
+			(fread(hdr, MDZ_TRAIL_LEN, 1, rd->f) != 1) ||
+			memcmp(hdr + 16, MDZ_END_MAGIC, 4)) goto invalid;
+	indexPos = MdzU64Get(hdr);
+	rd->rawLen = MdzU64Get(hdr + 8);
+	frames = rd->rawLen / rd->frameLen + !!(rd->rawLen % rd->frameLen);
+	// Bound the frame count by the file length before sizing the index
+	if (frames > UINT32_MAX ||
+			frames > (uint64_t)(fLen - MDZ_TRAIL_LEN) / 8) goto invalid;
+	if (indexPos != fLen - MDZ_TRAIL_LEN - frames * 8) goto invalid;
+	rd->nFrames = frames;
+	rd->index = (uint64_t*)malloc(MAX(rd->nFrames, 1) * sizeof(uint64_t));
+	rd->cBuf = (uint8_t*)malloc(rd->frameLen);
+	rd->fBuf = (uint8_t*)malloc(rd->frameLen);
+	if (!rd->index || !rd->cBuf || !rd->fBuf) {
+		perror("Allocating MDZ reader RAM");
+		goto err;
+	}
+	if (fseek(rd->f, indexPos, SEEK_SET)) goto invalid;
+	for (i = 0; i < rd->nFrames; i++) {
+		if (fread(hdr, 8, 1, rd->f) != 1) goto invalid;
+		rd->index[i] = MdzU64Get(hdr);
+		if (rd->index[i] < MDZ_HEAD_LEN || rd->index[i] >= indexPos) {
+			goto invalid;
+		}
+	}
+
+	return rd;
+
+invalid:
+	PrintErr("Error: invalid MDZ file %s\n", file);
+err:
+	MdzClose(rd);
+	return NULL;
+}
+
+uint64_t MdzRawLen(const MdzReader *rd) {
+	return rd->rawLen;
+}
+
+/// Loads and decompresses a frame in the frame buffer
+static int MdzFrameLoad(MdzReader *rd, uint32_t frame) {
+	uint8_t hdr[4];
+	uint32_t size, outLen;
+
+	if (rd->cur == frame) return 0;
+	rd->cur = UINT32_MAX;
+	outLen = MIN(rd->frameLen, rd->rawLen - (uint64_t)frame * rd->frameLen);
+	if (fseek(rd->f, rd->index[frame], SEEK_SET) ||
+			(fread(hdr, sizeof(hdr), 1, rd->f) != 1)) return -1;
+	size = MdzU32Get(hdr);
+	if (size & MDZ_STORED) {
+		if ((size & ~MDZ_STORED) != outLen ||
+				(fread(rd->fBuf, outLen, 1, rd->f) != 1)) return -1;
+	} else if (!size || size > rd->frameLen ||
+			(fread(rd->cBuf, size, 1, rd->f) != 1) ||
+			MdzDecompress(rd->cBuf, size, rd->fBuf, outLen)) {
+		return -1;
+	}
+	rd->cur = frame;
+
+	return 0;
+}
+
+int MdzRead(MdzReader *rd, uint64_t off, uint32_t len, uint8_t *out) {
+	uint32_t frame, pos, n;
+
+	if (off + len > rd->rawLen) return -1;
+	while (len) {
+		frame = off / rd->frameLen;
+		pos = off % rd->frameLen;
+		if (MdzFrameLoad(rd, frame)) {
+			PrintErr("Error: corrupt MDZ frame %u\n", frame);
+			return -1;
+		}
+		n = MIN(len, rd->frameLen - pos);
+		memcpy(out, rd->fBuf + pos, n);
+		out += n;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+void MdzClose(MdzReader *rd) {
+	if (!rd) return;
+	if (rd->f) fclose(rd->f);
+	free(rd->index);
+	free(rd->cBuf);
+	free(rd->fBuf);
+	free(rd);
+}
+
@@ -0,0 +1,187 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief MDZ compressed ROM container.
+ *
+ * \defgroup mdz mdz
+ * \{
+ * \brief MDZ compressed ROM container.
+ *
+ * MDZ files store ROM images compressed with a fast LZ77 class codec.
+ * Data is split in independent frames, and an index of the frame offsets
+ * is stored at the end of the file, so any part of the image can be
+ * decompressed without decoding the previous frames.
+ *
+ * File layout (integers are little endian):
+ * \verbatim
+   "MDZ1" | frame_len (u32)
+   frame: size (u32, bit 31 set if stored uncompressed) | data
+   [...]
+   index: offset (u64) of each frame
+   trailer: index_offset (u64) | raw_len (u64) | "MDZE"
+   \endverbatim
+ *
+ * Frames are compressed on a worker thread, so dumps are compressed while
+ * the cart is being read.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _MDZ_H_
+#define _MDZ_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "util.h"
+#include "mdma.h"
+
+/// Magic string at the start of MDZ files
+#define MDZ_MAGIC		"MDZ1"
+/// Magic string at the end of MDZ files
+#define MDZ_END_MAGIC	"MDZE"
+/// Extension of MDZ files
+#define MDZ_EXT			".mdz"
+/// Uncompressed length of each frame, in bytes
+#define MDZ_FRAME_LEN	(64 * 1024)
+/// Number of frames queued for compression
+#define MDZ_QUEUE_LEN	4
+
+/// Streaming MDZ writer
+typedef struct MdzWriter MdzWriter;
+
+/// MDZ reader, with random access
+typedef struct MdzReader MdzReader;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Compresses a buffer.
+ *
+ * \param[in]  src Data to compress.
+ * \param[in]  len Length of the data to compress, in bytes.
+ * \param[out] dst Buffer for the compressed data.
+ * \param[in]  cap Capacity of dst in bytes.
+ *
+ * \return Length of the compressed data, or 0 if it does not fit in dst.
+ ****************************************************************************/
+uint32_t MdzCompress(const uint8_t *src, uint32_t len, uint8_t *dst,
+		uint32_t cap);
+
+/************************************************************************//**
+ * Decompresses a buffer.
+ *
+ * \param[in]  src    Compressed data.
+ * \param[in]  len    Length of the compressed data, in bytes.
+ * \param[out] dst    Buffer for the decompressed data.
+ * \param[in]  outLen Expected length of the decompressed data.
+ *
+ * \return 0 on success, -1 if data is corrupt.
+ ****************************************************************************/
+int MdzDecompress(const uint8_t *src, uint32_t len, uint8_t *dst,
+		uint32_t outLen);
+
+/************************************************************************//**
+ * Checks if a file name has the MDZ extension.
+ *
+ * \param[in] file File name.
+ *
+ * \return TRUE if file name ends with MDZ_EXT, FALSE otherwise.
+ ****************************************************************************/
+int MdzIsName(const char *file);
+
+/************************************************************************//**
+ * Creates a MDZ file and starts the compression thread.
+ *
+ * \param[in] file File name.
+ * \param[in] addr Start word address of the cart range to compress, used
+ *            by MdzHook().
+ * \param[in] len  Length in words of the cart range.
+ *
+ * \return The writer, or NULL on error.
+ ****************************************************************************/
+MdzWriter *MdzWriterNew(const char *file, uint32_t addr, uint32_t len);
+
+/************************************************************************//**
+ * Appends data to the file. Blocks if the compression queue is full.
+ *
+ * \param[in] w    Writer.
+ * \param[in] data Data to append.
+ * \param[in] len  Length of the data in bytes.
+ *
+ * \return 0 on success, non-zero on error.
+ ****************************************************************************/
+int MdzWriterPut(MdzWriter *w, const uint8_t *data, uint32_t len);
+
+/************************************************************************//**
+ * Chunk hook appending the cart data read to a NULL terminated array of
+ * writers. Data is stored in file (big endian) order. Install it calling
+ * MdmaChunkHookSet(MdzHook, writerArray).
+ ****************************************************************************/
+void MdzHook(void *ctx, MdmaDir dir, uint32_t addr, const u16 *data,
+		uint32_t wLen);
+
+/************************************************************************//**
+ * Compresses the pending data, writes the index and closes the file.
+ *
+ * \param[in] w Writer. It is freed even if an error occurs.
+ *
+ * \return 0 on success, non-zero on error.
+ ****************************************************************************/
+int MdzWriterClose(MdzWriter *w);
+
+/************************************************************************//**
+ * Stops the compression thread, and removes the file.
+ *
+ * \param[in] w Writer to free. Can be NULL.
+ ****************************************************************************/
+void MdzWriterAbort(MdzWriter *w);
+
+/************************************************************************//**
+ * Opens a MDZ file.
+ *
+ * \param[in] file File name.
+ *
+ * \return The reader, or NULL if the file is not a valid MDZ file.
+ ****************************************************************************/
+MdzReader *MdzOpen(const char *file);
+
+/************************************************************************//**
+ * Obtains the uncompressed length of the data in a MDZ file.
+ *
+ * \param[in] rd Reader.
+ *
+ * \return Uncompressed length in bytes.
+ ****************************************************************************/
+uint64_t MdzRawLen(const MdzReader *rd);
+
+/************************************************************************//**
+ * Decompresses a part of the data in a MDZ file. Only the frames covering
+ * the requested range are read.
+ *
+ * \param[in]  rd  Reader.
+ * \param[in]  off Offset of the data to read, in bytes.
+ * \param[in]  len Length of the data to read, in bytes.
+ * \param[out] out Buffer for the data.
+ *
+ * \return 0 on success, non-zero on error.
+ ****************************************************************************/
+int MdzRead(MdzReader *rd, uint64_t off, uint32_t len, uint8_t *out);
+
+/************************************************************************//**
+ * Closes a MDZ file.
+ *
+ * \param[in] rd Reader to close. Can be NULL.
+ ****************************************************************************/
+void MdzClose(MdzReader *rd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_MDZ_H_*/
+
+/** \} */
+
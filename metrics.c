@@ -0,0 +1,367 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Prometheus metrics exporter.
+ *
+ * Latency histograms are converted from the stats module buckets to the
+ * cumulative buckets in mtrBucketUs, so all the series have the same le
+ * labels. Payload byte counters and failed transfer counters are also
+ * obtained from the stats module, and the erase times are the reply phase
+ * of the erase commands.
+ *
+ * The textfile is written to a temporary file and then renamed, so the
+ * collector never reads a partially written file.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "stats.h"
+#include "commands.h"
+#include "util.h"
+
+#ifndef __OS_WIN
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+int mtrOn = FALSE;
+
+/// Upper bounds of the latency histogram buckets, in microseconds
+static const uint64_t mtrBucketUs[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+	500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+/// Exporter state
+typedef struct {
+	int port;				///< TCP port to serve metrics on, 0 for none.
+	const char *file;		///< Textfile path, NULL for none.
+	time_t start;			///< Start date.
+	pthread_t th;			///< Exporter thread.
+	volatile int stop;		///< Thread stop requested.
+	uint64_t count[MTR_COUNTERS];	///< Counters.
+} Mtr;
+
+static Mtr mtr;
+/// Socket metrics are served on
+static int mtrSock = -1;
+/// Protects the counters
+static pthread_mutex_t mtrLock = PTHREAD_MUTEX_INITIALIZER;
+#ifndef __OS_WIN
+/// Remote counter, NULL to count locally
+static MtrRemote mtrRemote = NULL;
+#endif
+
+int MtrParse(const char *spec) {
+	char *endPtr;
+	long port;
+
+	if (!*spec) return 1;
+	port = strtol(spec, &endPtr, 10);
+	if ('\0' == *endPtr) {
+		if (port <= 0 || port > 65535) return 1;
+		mtr.port = port;
+	} else mtr.file = spec;
+	mtrOn = TRUE;
+
+	return 0;
+}
+
+void MtrRemoteSet(MtrRemote remote) {
+#ifdef __OS_WIN
+	// There is no daemon to count on
+	(void)remote;
+#else
+	mtrRemote = remote;
+#endif
+}
+
+void MtrCount(MtrCounter counter, uint32_t n) {
+#ifndef __OS_WIN
+	if (mtrRemote) {
+		mtrRemote(counter, n);
+		return;
+	}
+#endif
+	if (!mtrOn) return;
+
+	pthread_mutex_lock(&mtrLock);
+	mtr.count[counter] += n;
+	pthread_mutex_unlock(&mtrLock);
+}
+
+/// Writes the header of a metric
+static void MtrHead(FILE *out, const char *name, const char *type,
+		const char *help) {
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/// Writes a latency histogram, with its labels
+static void MtrHist(FILE *out, const char *name, const char *labels,
+		const StatsHist *h) {
+	unsigned int i;
+
+	for (i = 0; i < sizeof(mtrBucketUs) / sizeof(uint64_t); i++) {
+		fprintf(out, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+				mtrBucketUs[i] / 1e6,
+				(unsigned long long)StatsCountBelow(h, mtrBucketUs[i]));
+	}
+	fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+			(unsigned long long)h->n);
+	fprintf(out, "%s_sum{%s} %.6f\n", name, labels, h->totalUs / 1e6);
+	fprintf(out, "%s_count{%s} %llu\n", name, labels,
+			(unsigned long long)h->n);
+}
+
+/// Writes all the metrics
+static void MtrWrite(FILE *out) {
+	uint64_t count[MTR_COUNTERS];
+	uint64_t rdBytes = 0, wrBytes = 0;
+	StatsHist h;
+	unsigned int op, p;
+	char labels[64];
+
+	pthread_mutex_lock(&mtrLock);
+	memcpy(count, mtr.count, sizeof(count));
+	pthread_mutex_unlock(&mtrLock);
+
+	MtrHead(out, "mdma_start_time_seconds", "gauge",
+			"Start time of the process since unix epoch in seconds.");
+	fprintf(out, "mdma_start_time_seconds %llu\n",
+			(unsigned long long)mtr.start);
+	MtrHead(out, "mdma_flash_total", "counter", "Images flashed.");
+	fprintf(out, "mdma_flash_total{result=\"ok\"} %llu\n",
+			(unsigned long long)count[MTR_FLASH_OK]);
+	fprintf(out, "mdma_flash_total{result=\"error\"} %llu\n",
+			(unsigned long long)count[MTR_FLASH_ERR]);
+	MtrHead(out, "mdma_production_carts_total", "counter",
+			"Carts programmed in production mode.");
+	fprintf(out, "mdma_production_carts_total{result=\"pass\"} %llu\n",
+			(unsigned long long)count[MTR_CART_PASS]);
+	fprintf(out, "mdma_production_carts_total{result=\"fail\"} %llu\n",
+			(unsigned long long)count[MTR_CART_FAIL]);
+	MtrHead(out, "mdma_verify_failures_total", "counter",
+			"Flash contents that did not match the image.");
+	fprintf(out, "mdma_verify_failures_total %llu\n",
+			(unsigned long long)count[MTR_VERIFY_FAIL]);
+
+	MtrHead(out, "mdma_usb_errors_total", "counter",
+			"Failed USB transfers.");
+	for (op = 0; op < STATS_OP_MAX; op++) {
+		for (p = 0; p < STATS_PHASES; p++) {
+			StatsGet(op, (StatsPhase)p, &h);
+			if (STATS_PAYLOAD == p && MDMA_READ == op) rdBytes += h.bytes;
+			else if (STATS_PAYLOAD == p) wrBytes += h.bytes;
+			if (!h.errors) continue;
+			fprintf(out, "mdma_usb_errors_total{op=\"%s\",phase=\"%s\"} "
+					"%llu\n", StatsOpName(op), StatsPhaseName((StatsPhase)p),
+					(unsigned long long)h.errors);
+		}
+	}
+	MtrHead(out, "mdma_payload_bytes_total", "counter",
+			"Command payload bytes transferred.");
+	fprintf(out, "mdma_payload_bytes_total{direction=\"read\"} %llu\n",
+			(unsigned long long)rdBytes);
+	fprintf(out, "mdma_payload_bytes_total{direction=\"write\"} %llu\n",
+			(unsigned long long)wrBytes);
+
+	MtrHead(out, "mdma_command_seconds", "histogram",
+			"Device command latency per opcode and phase.");
+	for (op = 0; op < STATS_OP_MAX; op++) {
+		for (p = 0; p < STATS_PHASES; p++) {
+			StatsGet(op, (StatsPhase)p, &h);
+			if (!h.n) continue;
+			sprintf(labels, "op=\"%s\",phase=\"%s\"", StatsOpName(op),
+					StatsPhaseName((StatsPhase)p));
+			MtrHist(out, "mdma_command_seconds", labels, &h);
+		}
+	}
+}
+
+/// Writes the textfile
+static int MtrFileWrite(void) {
+	char *tmp;
+	FILE *out;
+	int err;
+
+	if (!(tmp = (char*)malloc(strlen(mtr.file) + 5))) return -1;
+	sprintf(tmp, "%s.tmp", mtr.file);
+	if (!(out = fopen(tmp, "w"))) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+	MtrWrite(out);
+	err = fclose(out);
+#ifdef __OS_WIN
+	// rename() does not replace existing files
+	if (!err) remove(mtr.file);
+#endif
+	if (err || rename(tmp, mtr.file)) {
+		perror(mtr.file);
+		remove(tmp);
+		err = -1;
+	}
+	free(tmp);
+
+	return err;
+}
+
+#ifndef __OS_WIN
+
+/// Creates the loopback socket metrics are served on
+static int MtrListen(int port) {
+	struct sockaddr_in in;
+	int fd, one = 1;
+
+	memset(&in, 0, sizeof(in));
+	in.sin_family = AF_INET;
+	in.sin_port = htons(port);
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (!bind(fd, (struct sockaddr*)&in, sizeof(in)) &&
+			!listen(fd, SOMAXCONN)) return fd;
+	close(fd);
+
+	return -1;
+}
+
+/// Receives a HTTP request and replies to it
+static void MtrServe(int fd) {
+	struct pollfd pfd = {fd, POLLIN, 0};
+	char req[1024];
+	size_t len = 0;
+	ssize_t r;
+	FILE *out;
+
+	// Only the request line is used, but the whole header is received
+	req[0] = '\0';
+	while (len < sizeof(req) - 1 && !strstr(req, "\r\n\r\n")) {
+		if (poll(&pfd, 1, MTR_REQ_TIMEOUT_MS) <= 0) break;
+		if ((r = recv(fd, req + len, sizeof(req) - 1 - len, 0)) < 0 &&
+				EINTR == errno) continue;
+		if (r <= 0) break;
+		len += r;
+		req[len] = '\0';
+	}
+	if (!(out = fdopen(fd, "w"))) {
+		close(fd);
+		return;
+	}
+	if (strncmp(req, "GET ", 4)) {
+		fprintf(out, "HTTP/1.0 405 Method Not Allowed\r\n"
+				"Content-Type: text/plain\r\n\r\nOnly GET is supported.\n");
+	} else if (strncmp(req + 4, "/metrics ", 9) && strncmp(req + 4, "/ ", 2)) {
+		fprintf(out, "HTTP/1.0 404 Not Found\r\n"
+				"Content-Type: text/plain\r\n\r\nMetrics are on /metrics.\n");
+	} else {
+		fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+				"version=0.0.4\r\n\r\n");
+		MtrWrite(out);
+	}
+	fclose(out);
+}
+
+static void *MtrThread(void *arg) {
+	struct pollfd pfd = {mtrSock, POLLIN, 0};
+	uint64_t next = MonoUs() + MTR_FILE_PERIOD_S * 1000000ULL;
+	int fd;
+
+	while (!mtr.stop) {
+		if (mtrSock < 0) DelayMs(MTR_POLL_MS);
+		else if (poll(&pfd, 1, MTR_POLL_MS) > 0 &&
+				(fd = accept(mtrSock, NULL, NULL)) >= 0) {
+			MtrServe(fd);
+		}
+		if (mtr.file && MonoUs() >= next) {
+			MtrFileWrite();
+			next += MTR_FILE_PERIOD_S * 1000000ULL;
+		}
+	}
+
+	return NULL;
+}
+
+#else
+
+static void *MtrThread(void *arg) {
+	uint64_t next = MonoUs() + MTR_FILE_PERIOD_S * 1000000ULL;
+
+	while (!mtr.stop) {
+		DelayMs(MTR_POLL_MS);
+		if (MonoUs() >= next) {
+			MtrFileWrite();
+			next += MTR_FILE_PERIOD_S * 1000000ULL;
+		}
+	}
+
+	return NULL;
+}
+
+#endif /*__OS_WIN*/
+
+int MtrStart(void) {
+	if (!mtrOn) return 0;
+
+	if (mtr.port) {
+#ifdef __OS_WIN
+		PrintErr("Error: metrics HTTP endpoint is not supported on this "
+				"platform\n");
+		goto err;
+#else
+		if ((mtrSock = MtrListen(mtr.port)) < 0) {
+			PrintErr("Error: could not listen on tcp:%d for metrics: %s\n",
+					mtr.port, strerror(errno));
+			goto err;
+		}
+		// Scrapers closing early must not kill the process
+		signal(SIGPIPE, SIG_IGN);
+#endif
+	}
+	mtr.start = time(NULL);
+	StatsEnable(TRUE);
+	// Check the textfile can be written before the job starts
+	if (mtr.file && MtrFileWrite()) goto err;
+	mtr.stop = FALSE;
+	if (pthread_create(&mtr.th, NULL, MtrThread, NULL)) {
+		PrintErr("Error: could not start metrics thread\n");
+		goto err;
+	}
+
+	return 0;
+
+err:
+#ifndef __OS_WIN
+	if (mtrSock >= 0) close(mtrSock);
+#endif
+	mtrSock = -1;
+	mtrOn = FALSE;
+	return -1;
+}
+
+void MtrStop(void) {
+	if (!mtrOn) return;
+
+	mtr.stop = TRUE;
+	pthread_join(mtr.th, NULL);
+	if (mtr.file) MtrFileWrite();
+#ifndef __OS_WIN
+	if (mtrSock >= 0) close(mtrSock);
+#endif
+	mtrSock = -1;
+	mtrOn = FALSE;
+}
+
@@ -0,0 +1,105 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Prometheus metrics exporter.
+ *
+ * \defgroup metrics metrics
+ * \{
+ * \brief Prometheus metrics exporter.
+ *
+ * Exports counters of the flash jobs, production carts, verify failures and
+ * failed USB transfers, along with the device command latency histograms
+ * recorded by the stats module, using the Prometheus text format. Metrics
+ * are served over HTTP on a loopback TCP port, or written every
+ * MTR_FILE_PERIOD_S seconds (and when the program ends) to a file for the
+ * node exporter textfile collector. A background thread does both, so
+ * metrics are updated while long running modes (daemon, watch, production)
+ * keep the main thread busy.
+ *
+ * Counting functions do nothing if metrics are not enabled, unless a remote
+ * counter is installed: clients of the programmer daemon send their counts
+ * to the daemon, which exports them along with the command statistics.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+/// Period of the textfile updates, in seconds
+#define MTR_FILE_PERIOD_S	15
+/// Poll period of the exporter thread, in milliseconds
+#define MTR_POLL_MS			200
+/// Maximum time to receive a HTTP request, in milliseconds
+#define MTR_REQ_TIMEOUT_MS	1000
+
+/// Counters
+typedef enum {
+	MTR_FLASH_OK = 0,		///< Images flashed.
+	MTR_FLASH_ERR,			///< Images that failed to flash.
+	MTR_CART_PASS,			///< Production carts passed.
+	MTR_CART_FAIL,			///< Production carts failed.
+	MTR_VERIFY_FAIL,		///< Verify failures.
+	MTR_COUNTERS
+} MtrCounter;
+
+/// Counts on a remote exporter
+typedef void (*MtrRemote)(MtrCounter counter, uint32_t n);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Metrics are counted only while enabled
+extern int mtrOn;
+
+/************************************************************************//**
+ * Parses the metrics argument: a TCP port number to serve metrics on, or
+ * the path of the textfile to write them to.
+ *
+ * \param[in] spec Metrics argument.
+ *
+ * \return 0 if OK, 1 if the argument is not valid.
+ ****************************************************************************/
+int MtrParse(const char *spec);
+
+/************************************************************************//**
+ * Starts counting and exporting metrics, if requested. Enables the latency
+ * statistics recording.
+ *
+ * \return 0 if OK or no metrics requested, -1 on error.
+ ****************************************************************************/
+int MtrStart(void);
+
+/************************************************************************//**
+ * Installs a handler counting all the counter increments on a remote
+ * exporter, instead of the local one.
+ *
+ * \param[in] remote Remote counter, or NULL to count locally.
+ ****************************************************************************/
+void MtrRemoteSet(MtrRemote remote);
+
+/************************************************************************//**
+ * Increments a counter. Can be called from any thread.
+ *
+ * \param[in] counter Counter to increment.
+ * \param[in] n       Increment.
+ ****************************************************************************/
+void MtrCount(MtrCounter counter, uint32_t n);
+
+/************************************************************************//**
+ * Stops exporting metrics. The textfile, if any, is written a last time.
+ ****************************************************************************/
+void MtrStop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_METRICS_H_*/
+
+/** \} */
+
@@ -0,0 +1,82 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief USDT static probes.
+ *
+ * \defgroup probes probes
+ * \{
+ * \brief USDT static probes.
+ *
+ * SystemTap/USDT probes of the provider "mdma", placed on the transfer hot
+ * path, so bpftrace, perf or SystemTap can trace a running mdma without
+ * rebuilding it, e.g.:
+ *
+ *     bpftrace -e 'usdt:./mdma:mdma:cmd_send { @[arg0] = count(); }'
+ *
+ * A probe site is a single nop instruction until a tracer attaches to it.
+ * Probes are built on Linux when sys/sdt.h (systemtap-sdt-dev package) is
+ * found, unless MDMA_NO_SDT is defined. Otherwise they compile to nothing.
+ *
+ * Probes and their arguments (addresses and lengths in words, but lengths
+ * of WiFi and ESP commands in bytes, UINT32_MAX when not applicable):
+ * - cmd_send(op, addr, len): command frame about to be sent.
+ * - cmd_reply(op, addr, len, result): command reply received, with the
+ *   libusb result.
+ * - payload_start(op, addr, len): payload transfer about to start. Read
+ *   payloads are received in chunks, each with its own probes.
+ * - payload_end(op, addr, len, result): payload transfer completed.
+ * - erase_start(op, addr, len): erase command sent.
+ * - erase_end(op, addr, len, result): erase completed, with the reply
+ *   transfer status (sector erases: libusb result).
+ * - esp_send(op, addr, len): WiFi module bootloader packet about to be
+ *   sent, addr is the checksum.
+ * - verify_mismatch(addr, len): flash contents differ from the image,
+ *   addr is the first differing word of the len words compared (the
+ *   start of the sector for journaled flashes).
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#if !defined(MDMA_NO_SDT) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MDMA_SDT
+#endif
+#endif
+
+#ifdef MDMA_SDT
+#define PROBE_CMD_SEND(op, addr, len)	\
+	DTRACE_PROBE3(mdma, cmd_send, op, addr, len)
+#define PROBE_CMD_REPLY(op, addr, len, result)	\
+	DTRACE_PROBE4(mdma, cmd_reply, op, addr, len, result)
+#define PROBE_PAYLOAD_START(op, addr, len)	\
+	DTRACE_PROBE3(mdma, payload_start, op, addr, len)
+#define PROBE_PAYLOAD_END(op, addr, len, result)	\
+	DTRACE_PROBE4(mdma, payload_end, op, addr, len, result)
+#define PROBE_ERASE_START(op, addr, len)	\
+	DTRACE_PROBE3(mdma, erase_start, op, addr, len)
+#define PROBE_ERASE_END(op, addr, len, result)	\
+	DTRACE_PROBE4(mdma, erase_end, op, addr, len, result)
+#define PROBE_ESP_SEND(op, addr, len)	\
+	DTRACE_PROBE3(mdma, esp_send, op, addr, len)
+#define PROBE_VERIFY_MISMATCH(addr, len)	\
+	DTRACE_PROBE2(mdma, verify_mismatch, addr, len)
+#else
+#define PROBE_CMD_SEND(op, addr, len)				do{}while(0)
+#define PROBE_CMD_REPLY(op, addr, len, result)		do{}while(0)
+#define PROBE_PAYLOAD_START(op, addr, len)			do{}while(0)
+#define PROBE_PAYLOAD_END(op, addr, len, result)	do{}while(0)
+#define PROBE_ERASE_START(op, addr, len)			do{}while(0)
+#define PROBE_ERASE_END(op, addr, len, result)		do{}while(0)
+#define PROBE_ESP_SEND(op, addr, len)				do{}while(0)
+#define PROBE_VERIFY_MISMATCH(addr, len)			do{}while(0)
+#endif
+
+#endif /*_PROBES_H_*/
+
+/** \} */
+
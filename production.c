@@ -0,0 +1,186 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Pushbutton triggered production loop.
+ *
+ * The pushbutton event flag of the programmer is polled every PROD_POLL_MS,
+ * so short presses released between two polls are not missed. Events
+ * raised while a cart is being programmed are discarded.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "production.h"
+#include "commands.h"
+#include "quick_verify.h"
+#include "metrics.h"
+#include "util.h"
+
+#ifdef __OS_WIN
+#define PROD_PASS_STR	"PASS"
+#define PROD_FAIL_STR	"FAIL"
+#else
+#define PROD_PASS_STR	"\e[1;32mPASS\e[0m"
+#define PROD_FAIL_STR	"\e[1;31mFAIL\e[0m"
+#endif
+
+/// Times of the steps of a cart job, in microseconds
+typedef struct {
+	uint64_t erase;		///< Erase time.
+	uint64_t flash;		///< Flash time.
+	uint64_t verify;	///< Verify time.
+	uint64_t total;		///< Total job time.
+} ProdTimes;
+
+/// Stop requested by SIGINT
+static volatile sig_atomic_t prodStop = FALSE;
+
+// The cart being programmed is completed before stopping. A second SIGINT
+// kills the process.
+static void ProdSigStop(int sig) {
+	prodStop = TRUE;
+	signal(SIGINT, SIG_DFL);
+}
+
+// Waits for a pushbutton press. A release of the button held when waiting
+// starts is not a press. Returns 0 on press, 1 if stopped, -1 on error.
+static int ProdWait(void) {
+	uint8_t st;
+	int held;
+
+	// Discard the events raised while the previous cart was programmed
+	if (MDMA_button_get(&st)) return -1;
+	held = st & PROD_BUTTON_PRESSED;
+	while (!prodStop) {
+		DelayMs(PROD_POLL_MS);
+		if (MDMA_button_get(&st)) return -1;
+		if ((st & PROD_BUTTON_EVENT) &&
+				((st & PROD_BUTTON_PRESSED) || !held)) return 0;
+		held = st & PROD_BUTTON_PRESSED;
+	}
+
+	return 1;
+}
+
+/// Compares the flashed range against the image
+static int ProdVerify(const MemImage *fWr, const u16 *buf, int columns) {
+	MemImage rd = {NULL, fWr->addr, fWr->len};
+	u16 *rdBuf;
+
+	if (!(rdBuf = AllocAndRead(&rd, columns))) return -1;
+	if (memcmp(rdBuf, buf, fWr->len<<1)) {
+		MdmaVerifyFail(fWr->addr, buf, rdBuf, fWr->len);
+		MDMA_BufFree(rdBuf);
+		return 1;
+	}
+	MDMA_BufFree(rdBuf);
+	printf("Verify OK!\n");
+
+	return 0;
+}
+
+// Programs a cart. Returns 0 if it passed.
+static int ProdJob(const ProdCfg *cfg, const MemImage *fWr, const RomImg *img,
+		int columns, ProdTimes *t) {
+	uint64_t start = MonoUs();
+	uint64_t step = start;
+	int err = 0;
+
+	memset(t, 0, sizeof(ProdTimes));
+	if (PROD_ERASE_FULL == cfg->erase && (err = MdmaCartErase(columns))) {
+		PrintErr("Couldn't erase cart!\n");
+		goto out;
+	}
+	if (PROD_ERASE_AUTO == cfg->erase && (err = AutoErase(fWr, columns))) {
+		goto out;
+	}
+	t->erase = MonoUs() - step;
+	step = MonoUs();
+	if ((err = FlashBuf(fWr, img->buf, img->wrLen, columns))) goto out;
+	t->flash = MonoUs() - step;
+	step = MonoUs();
+	if (cfg->verify) err = ProdVerify(fWr, img->buf, columns);
+	else if (cfg->qvConf) {
+		err = QvRun(fWr, img->buf, img->hash, cfg->qvConf, cfg->qvDefect);
+	}
+	t->verify = MonoUs() - step;
+
+out:
+	t->total = MonoUs() - start;
+	return err;
+}
+
+/// Appends a cart result to the log
+static void ProdLog(FILE *log, unsigned int cart, int err,
+		const ProdTimes *t) {
+	char date[32];
+	time_t now = time(NULL);
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	fprintf(log, "%s,%u,%s,%.3f,%.3f,%.3f,%.3f\n", date, cart,
+			err ? "FAIL" : "PASS", t->erase / 1e6, t->flash / 1e6,
+			t->verify / 1e6, t->total / 1e6);
+	fflush(log);
+}
+
+int ProdRun(const ProdCfg *cfg, const MemImage *fWr, const RomImg *img,
+		int columns) {
+	void (*prevSig)(int);
+	unsigned int cart = 0, failed = 0;
+	uint64_t totalUs = 0;
+	FILE *log = NULL;
+	ProdTimes t;
+	int err, r;
+
+	if (cfg->log) {
+		if (!(log = fopen(cfg->log, "a"))) {
+			perror(cfg->log);
+			return -1;
+		}
+		fseek(log, 0, SEEK_END);
+		if (!ftell(log)) {
+			fprintf(log, "date,cart,result,erase_s,flash_s,verify_s,"
+					"total_s\n");
+		}
+	}
+
+	prodStop = FALSE;
+	prevSig = signal(SIGINT, ProdSigStop);
+	printf("Production mode: press the programmer button to flash %s, "
+			"Ctrl+C to stop.\n", fWr->file);
+	fflush(stdout);
+	while (!(r = ProdWait())) {
+		printf("\nCart %u:\n", ++cart);
+		// A new cart may carry a different flash chip
+		MdmaChipReset();
+		err = ProdJob(cfg, fWr, img, columns, &t);
+		if (err) failed++;
+		MtrCount(err ? MTR_CART_FAIL : MTR_CART_PASS, 1);
+		totalUs += t.total;
+		// Ring the bell once on pass, three times on fail
+		printf("Cart %u %s%s: erase %.2f s, flash %.2f s, verify %.2f s, "
+				"total %.2f s.\n", cart, err ? PROD_FAIL_STR : PROD_PASS_STR,
+				err ? "\a\a\a" : "\a", t.erase / 1e6, t.flash / 1e6,
+				t.verify / 1e6, t.total / 1e6);
+		if (log) ProdLog(log, cart, err, &t);
+		printf("Insert the next cart and press the button.\n");
+		fflush(stdout);
+	}
+	signal(SIGINT, prevSig);
+	if (r < 0) PrintErr("Couldn't read pushbutton!\n");
+	if (log) fclose(log);
+
+	printf("\n%u cart(s): %u passed, %u failed", cart, cart - failed, failed);
+	if (cart) printf(", %.2f s average cycle", totalUs / 1e6 / cart);
+	printf(".\n");
+
+	return r < 0 ? -1 : (failed ? 1 : 0);
+}
+
@@ -0,0 +1,75 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Pushbutton triggered production loop.
+ *
+ * \defgroup production production
+ * \{
+ * \brief Pushbutton triggered production loop.
+ *
+ * Keeps the programmer session and the ROM image loaded, waiting for the
+ * programmer pushbutton. Each press runs the configured erase, flash and
+ * verify job on the inserted cart, signals the result on the terminal
+ * and logs the per cart timing.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _PRODUCTION_H_
+#define _PRODUCTION_H_
+
+#include "mdma.h"
+#include "rom_img.h"
+
+/// Pushbutton polling interval, in milliseconds
+#define PROD_POLL_MS		20
+
+/// Pushbutton status bits, as returned by MDMA_button_get()
+#define PROD_BUTTON_PRESSED	0x01
+#define PROD_BUTTON_EVENT	0x02
+
+/// Erase done before flashing each cart
+typedef enum {
+	PROD_ERASE_NONE = 0,	///< Do not erase.
+	PROD_ERASE_AUTO,		///< Erase the range where the image is flashed.
+	PROD_ERASE_FULL			///< Erase the entire flash chip.
+} ProdErase;
+
+/************************************************************************//**
+ * Production job configuration.
+ ****************************************************************************/
+typedef struct {
+	ProdErase erase;		///< Erase before flashing.
+	int verify;				///< Read back and compare the whole image.
+	double qvConf;			///< Quick verify confidence (0 for none).
+	double qvDefect;		///< Quick verify defect size.
+	const char *log;		///< CSV log file (NULL for none).
+} ProdCfg;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Runs the production loop until SIGINT is received.
+ *
+ * \param[in] cfg     Job configuration.
+ * \param[in] fWr     Memory image with the address and length to flash.
+ * \param[in] img     Loaded image to flash.
+ * \param[in] columns Progress bar width.
+ *
+ * \return 0 if all carts passed, 1 if any cart failed, -1 on error (e.g.
+ * the programmer or the log file are not accessible).
+ ****************************************************************************/
+int ProdRun(const ProdCfg *cfg, const MemImage *fWr, const RomImg *img,
+		int columns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_PRODUCTION_H_*/
+
+/** \} */
+
@@ -13,6 +13,9 @@
  * \date   2015
  ****************************************************************************/
 
+/// Maximum line width, wider lines are drawn with this width
+#define PROGBAR_WIDTH_MAX	512
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -22,7 +25,8 @@ extern "C" {
  *
  * \param[in] pos Position (relative to max).
  * \param[in] max Maximum position (pos) value.
- * \param[in] width Line width. Drawn bar will fill a complete line.
+ * \param[in] width Line width. Drawn bar will fill a complete line. Nothing
+ *            is drawn if it is less than 9 characters.
  * \param[in] text  Text drawn at the beginning of the line (NULL for none).
  ****************************************************************************/
 void ProgBarDraw(unsigned int pos, unsigned int max, unsigned int width,
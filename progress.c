@@ -0,0 +1,313 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Progress of the running operation.
+ *
+ * Publishers and the render thread share the operation state under a lock
+ * held only to copy it. Renders are serialized by a second lock, so the
+ * last event rendered by PrgEnd() cannot be followed by a render of an
+ * older state.
+ *
+ * The speed is an exponential moving average of the speed between posts
+ * seen by consecutive renders, using the post timestamps, so renders not
+ * seeing a new post do not lower it.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "progress.h"
+#include "progbar.h"
+#include "util.h"
+
+/// Weight of the last speed sample in the moving average
+#define PRG_ALPHA	0.25
+
+/// Progress output
+typedef enum {
+	PRG_OUT_BAR = 0,	///< Terminal progress bar.
+	PRG_OUT_JSON,		///< JSON lines.
+	PRG_OUT_NONE		///< No progress output.
+} PrgOut;
+
+/// Published state of the running operation
+typedef struct {
+	const char *name;		///< Operation name.
+	char text[PRG_TEXT_MAX];	///< Position text.
+	uint32_t pos;			///< Position.
+	uint32_t max;			///< Maximum position.
+	uint32_t unit;			///< Bytes per position unit.
+	int columns;			///< Terminal width.
+	uint64_t start;			///< Operation start time (us).
+	uint64_t postUs;		///< Time of the last post (us).
+	uint32_t seq;			///< Posts since the operation started.
+	uint32_t op;			///< Operations started.
+	uint32_t quiet;			///< Quiet operations running.
+	int active;				///< TRUE while the operation runs.
+} PrgState;
+
+/// Published state
+static PrgState prg;
+/// Guards the published state
+static pthread_mutex_t prgLock = PTHREAD_MUTEX_INITIALIZER;
+/// Serializes renders, and guards the render state below
+static pthread_mutex_t prgRenderLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Installed sink
+static PrgSink prgSink;
+/// Context of the installed sink
+static void *prgSinkCtx;
+/// Operation of the last render
+static uint32_t prgOp;
+/// Post count of the last render
+static uint32_t prgSeq;
+/// Position of the last speed sample
+static uint32_t prgLastPos;
+/// Post time of the last speed sample (us)
+static uint64_t prgLastUs;
+/// Smoothed speed (position units per second)
+static double prgRate;
+
+/// Selected progress output
+static PrgOut prgOut = PRG_OUT_BAR;
+/// JSON lines file, NULL for stderr
+static const char *prgFile;
+/// JSON lines output
+static FILE *prgJson;
+
+// Builds the event for a copy of the state, updating the speed. Must be
+// called with the render lock held.
+static void PrgEventGet(const PrgState *s, int end, PrgEvent *ev) {
+	uint64_t now = MonoUs();
+	double sample;
+
+	if (s->op != prgOp) {
+		prgOp = s->op;
+		prgLastPos = 0;
+		prgLastUs = s->start;
+		prgRate = 0;
+	}
+	if (s->pos < prgLastPos) {
+		// Position restarted (e.g. maximum changed), restart the samples
+		prgLastPos = s->pos;
+		prgLastUs = s->postUs;
+	} else if (s->pos > prgLastPos && s->postUs > prgLastUs) {
+		sample = (s->pos - prgLastPos) * 1000000.0 / (s->postUs - prgLastUs);
+		prgRate = prgRate ? prgRate + PRG_ALPHA * (sample - prgRate) : sample;
+		prgLastPos = s->pos;
+		prgLastUs = s->postUs;
+	}
+	prgSeq = s->seq;
+
+	ev->name = s->name;
+	memcpy(ev->text, s->text, PRG_TEXT_MAX);
+	ev->pos = s->pos;
+	ev->max = s->max;
+	ev->unit = s->unit;
+	ev->columns = s->columns;
+	ev->elapsedUs = now - s->start;
+	ev->end = end;
+	if (end) {
+		// Average speed of the whole operation
+		ev->rate = ev->elapsedUs ? s->pos * 1000000.0 / ev->elapsedUs : 0;
+		ev->etaS = 0;
+	} else {
+		ev->rate = prgRate;
+		ev->etaS = prgRate > 0 && s->max > s->pos ?
+			(int32_t)((s->max - s->pos) / prgRate + 0.5) : -1;
+	}
+}
+
+static void *PrgThread(void *arg) {
+	PrgState s;
+	PrgEvent ev;
+	int render;
+
+	while (TRUE) {
+		DelayMs(PRG_PERIOD_MS);
+		pthread_mutex_lock(&prgRenderLock);
+		pthread_mutex_lock(&prgLock);
+		render = prgSink && prg.active && prg.seq &&
+			(prg.op != prgOp || prg.seq != prgSeq);
+		if (render) memcpy(&s, &prg, sizeof(PrgState));
+		pthread_mutex_unlock(&prgLock);
+		if (render) {
+			PrgEventGet(&s, FALSE, &ev);
+			prgSink(prgSinkCtx, &ev);
+		}
+		pthread_mutex_unlock(&prgRenderLock);
+	}
+
+	return NULL;
+}
+
+int PrgInit(void) {
+	pthread_t th;
+
+	if (pthread_create(&th, NULL, PrgThread, NULL)) {
+		PrintErr("Error: could not start progress render thread\n");
+		return -1;
+	}
+	pthread_detach(th);
+
+	return 0;
+}
+
+void PrgSinkSet(PrgSink sink, void *ctx) {
+	pthread_mutex_lock(&prgRenderLock);
+	prgSink = sink;
+	prgSinkCtx = ctx;
+	pthread_mutex_unlock(&prgRenderLock);
+}
+
+void PrgBegin(const char *name, uint32_t unit, int columns) {
+	pthread_mutex_lock(&prgLock);
+	if (!columns) {
+		prg.quiet++;
+		pthread_mutex_unlock(&prgLock);
+		return;
+	}
+	prg.name = name;
+	prg.text[0] = '\0';
+	prg.pos = prg.max = 0;
+	prg.unit = unit;
+	prg.columns = columns;
+	prg.start = prg.postUs = MonoUs();
+	prg.seq = 0;
+	prg.op++;
+	prg.active = TRUE;
+	pthread_mutex_unlock(&prgLock);
+}
+
+void PrgPost(uint32_t pos, uint32_t max, const char *text) {
+	uint64_t now = MonoUs();
+
+	pthread_mutex_lock(&prgLock);
+	if (prg.active && !prg.quiet) {
+		prg.pos = MIN(pos, max);
+		prg.max = max;
+		if (text) {
+			strncpy(prg.text, text, PRG_TEXT_MAX - 1);
+			prg.text[PRG_TEXT_MAX - 1] = '\0';
+		} else {
+			prg.text[0] = '\0';
+		}
+		prg.postUs = now;
+		prg.seq++;
+	}
+	pthread_mutex_unlock(&prgLock);
+}
+
+void PrgEnd(void) {
+	PrgState s;
+	PrgEvent ev;
+	int render;
+
+	pthread_mutex_lock(&prgRenderLock);
+	pthread_mutex_lock(&prgLock);
+	if (prg.quiet) {
+		prg.quiet--;
+		pthread_mutex_unlock(&prgLock);
+		pthread_mutex_unlock(&prgRenderLock);
+		return;
+	}
+	render = prgSink && prg.active && prg.seq;
+	if (render) memcpy(&s, &prg, sizeof(PrgState));
+	prg.active = FALSE;
+	pthread_mutex_unlock(&prgLock);
+	if (render) {
+		PrgEventGet(&s, TRUE, &ev);
+		prgSink(prgSinkCtx, &ev);
+	}
+	pthread_mutex_unlock(&prgRenderLock);
+}
+
+/// Draws the terminal progress bar, e.g.:
+/// 0x1A0000 812 KiB/s ETA 0:03 [=======>      ] 52%
+static void PrgBarSink(void *ctx, const PrgEvent *ev) {
+	// Position text, speed and time
+	char str[PRG_TEXT_MAX + 40];
+	int n;
+
+	if (!ev->columns) return;
+	n = sprintf(str, "%s", ev->text);
+	if (ev->unit && ev->rate > 0) {
+		n += sprintf(str + n, "%s%.0f KiB/s", n ? " " : "",
+				ev->rate * ev->unit / 1024);
+	}
+	if (ev->end && ev->unit) {
+		n += sprintf(str + n, "%s%.1fs", n ? " " : "",
+				ev->elapsedUs / 1000000.0);
+	} else if (!ev->end && ev->etaS >= 0) {
+		n += sprintf(str + n, "%sETA %d:%02d", n ? " " : "",
+				ev->etaS / 60, ev->etaS % 60);
+	}
+	ProgBarDraw(ev->pos, ev->max, ev->columns, n ? str : NULL);
+}
+
+/// Writes a progress event as a JSON line to the FILE pointed by ctx
+static void PrgJsonSink(void *ctx, const PrgEvent *ev) {
+	FILE *out = (FILE*)ctx;
+
+	fprintf(out, "{\"op\":\"%s\",\"pos\":%u,\"max\":%u,\"text\":\"%s\","
+			"\"elapsed_s\":%.3f", ev->name, ev->pos, ev->max, ev->text,
+			ev->elapsedUs / 1000000.0);
+	if (ev->unit) {
+		fprintf(out, ",\"bytes\":%llu,\"kib_per_s\":%.1f",
+				(unsigned long long)ev->pos * ev->unit,
+				ev->rate * ev->unit / 1024);
+	}
+	if (ev->etaS >= 0) fprintf(out, ",\"eta_s\":%d", ev->etaS);
+	fprintf(out, ",\"end\":%s}\n", ev->end ? "true" : "false");
+	fflush(out);
+}
+
+int PrgParse(const char *spec) {
+	if (!strcmp(spec, "bar")) {
+		prgOut = PRG_OUT_BAR;
+	} else if (!strcmp(spec, "none")) {
+		prgOut = PRG_OUT_NONE;
+	} else if (!strncmp(spec, "json", 4) && (!spec[4] ||
+				(':' == spec[4] && spec[5]))) {
+		prgOut = PRG_OUT_JSON;
+		prgFile = spec[4] ? spec + 5 : NULL;
+	} else {
+		return 1;
+	}
+
+	return 0;
+}
+
+int PrgOpen(int *columns) {
+	switch (prgOut) {
+		case PRG_OUT_BAR:
+			PrgSinkSet(PrgBarSink, NULL);
+			break;
+
+		case PRG_OUT_JSON:
+			prgJson = prgFile ? fopen(prgFile, "w") : stderr;
+			if (!prgJson) {
+				perror(prgFile);
+				return -1;
+			}
+			PrgSinkSet(PrgJsonSink, prgJson);
+			if (!*columns) *columns = PRG_JSON_COLUMNS;
+			break;
+
+		default:
+			PrgSinkSet(NULL, NULL);
+	}
+
+	return 0;
+}
+
+void PrgClose(void) {
+	PrgSinkSet(NULL, NULL);
+	if (prgJson && prgJson != stderr) fclose(prgJson);
+	prgJson = NULL;
+}
+
@@ -0,0 +1,134 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Progress of the running operation.
+ *
+ * \defgroup progress progress
+ * \{
+ * \brief Progress of the running operation.
+ *
+ * Transfer loops publish their progress with PrgBegin(), PrgPost() and
+ * PrgEnd(). Posting only stores the position under a lock, so it does not
+ * slow down the loop. A render thread passes the progress to the installed
+ * sink (terminal bar, JSON lines, GUI) every PRG_PERIOD_MS, along with the
+ * smoothed speed and the estimated time to completion, so rendering never
+ * stalls the USB transfers.
+ *
+ * The last event of each operation is rendered by PrgEnd() on the calling
+ * thread, so it is complete when PrgEnd() returns, and shows the average
+ * speed of the whole operation.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+
+#include <stdint.h>
+
+/// Interval between progress renders, in milliseconds
+#define PRG_PERIOD_MS	100
+/// Maximum length of the position text, including the null termination
+#define PRG_TEXT_MAX	32
+/// Width given to operations when writing JSON lines without a terminal
+#define PRG_JSON_COLUMNS	80
+
+/// Progress event, passed to the sinks
+typedef struct {
+	const char *name;	///< Operation name (e.g. "flash").
+	char text[PRG_TEXT_MAX];	///< Position text (e.g. the address).
+	uint32_t pos;		///< Position, relative to max.
+	uint32_t max;		///< Maximum position.
+	uint32_t unit;		///< Bytes per position unit, 0 if not bytes.
+	int columns;		///< Terminal width.
+	uint64_t elapsedUs;	///< Time since the operation started.
+	double rate;		///< Position units per second.
+	int32_t etaS;		///< Seconds to completion, -1 if not known.
+	int end;			///< TRUE on the last event of the operation.
+} PrgEvent;
+
+/// Renders a progress event. Called from the render thread, and from the
+/// thread calling PrgEnd() for the last event of each operation.
+typedef void (*PrgSink)(void *ctx, const PrgEvent *ev);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Starts the render thread.
+ *
+ * \return 0 if OK, -1 on error.
+ ****************************************************************************/
+int PrgInit(void);
+
+/************************************************************************//**
+ * Installs the sink rendering the progress events. When this function
+ * returns, the previous sink is not running and will not be called again.
+ *
+ * \param[in] sink Sink to install, NULL to render nothing.
+ * \param[in] ctx  Context passed to the sink.
+ ****************************************************************************/
+void PrgSinkSet(PrgSink sink, void *ctx);
+
+/************************************************************************//**
+ * Parses the progress output argument: "bar" (the default), "json" to
+ * write JSON lines to stderr, "json:file" to write them to file, or "none".
+ *
+ * \param[in] spec Argument to parse.
+ *
+ * \return 0 if OK, 1 if the argument is not valid.
+ ****************************************************************************/
+int PrgParse(const char *spec);
+
+/************************************************************************//**
+ * Opens the output selected with PrgParse() and installs its sink.
+ *
+ * \param[inout] columns Terminal width. JSON lines do not need a terminal,
+ *                so it is set to PRG_JSON_COLUMNS if 0 and JSON lines are
+ *                selected, for the operations to publish their progress.
+ *
+ * \return 0 if OK, -1 if the output file could not be created.
+ ****************************************************************************/
+int PrgOpen(int *columns);
+
+/************************************************************************//**
+ * Removes the sink installed by PrgOpen(), closing its output file.
+ ****************************************************************************/
+void PrgClose(void);
+
+/************************************************************************//**
+ * Starts publishing the progress of an operation.
+ *
+ * \param[in] name    Operation name. Must be a string literal.
+ * \param[in] unit    Bytes per position unit (2 for words), 0 if the
+ *                    positions are not bytes (e.g. iterations).
+ * \param[in] columns Terminal width. If 0, the operation is quiet: it does
+ *                    not publish its progress, so it can run inside another
+ *                    operation (e.g. a sector erase while flashing).
+ ****************************************************************************/
+void PrgBegin(const char *name, uint32_t unit, int columns);
+
+/************************************************************************//**
+ * Publishes the progress of the running operation.
+ *
+ * \param[in] pos  Position, relative to max.
+ * \param[in] max  Maximum position.
+ * \param[in] text Position text, NULL for none.
+ ****************************************************************************/
+void PrgPost(uint32_t pos, uint32_t max, const char *text);
+
+/************************************************************************//**
+ * Ends the running operation, rendering its last published progress.
+ ****************************************************************************/
+void PrgEnd(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_PROGRESS_H_*/
+
+/** \} */
+
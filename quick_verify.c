@@ -0,0 +1,169 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Sampled quick verify.
+ *
+ * Verifies a flashed image reading only a pseudo-random sample of blocks,
+ * plus the header, the first and last sectors and an address line pattern.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "quick_verify.h"
+#include "commands.h"
+
+/// xorshift64* pseudo-random number generator
+static uint64_t QvRand(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/// Marks the blocks in the word range [start, start + len)
+static uint32_t QvMark(uint8_t *mark, uint32_t nBlocks, uint32_t start,
+		uint32_t len) {
+	uint32_t i, marked = 0;
+	uint32_t end = MIN(nBlocks, (start + len + QV_BLOCK_LEN - 1) /
+			QV_BLOCK_LEN);
+
+	for (i = start / QV_BLOCK_LEN; i < end; i++) {
+		if (!mark[i]) marked++;
+		mark[i] = TRUE;
+	}
+
+	return marked;
+}
+
+int QvParse(const char *arg, double *conf, double *defect) {
+	char *endPtr;
+
+	*conf = strtod(arg, &endPtr);
+	*defect = QV_DEFECT_DEF;
+	if (':' == *endPtr) *defect = strtod(endPtr + 1, &endPtr);
+	if (*endPtr != '\0' || *conf <= 0 || *conf >= 100 || *defect <= 0 ||
+			*defect > 100) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/// Reads the marked blocks, merging consecutive ones, and compares them
+/// with the image. Returns 0 if OK, 1 on mismatch, -1 on read error.
+static int QvCompare(const MemImage *fWr, const u16 *buf,
+		const uint8_t *mark, uint32_t nBlocks) {
+	u16 *readBuf;
+	uint32_t blk, start, len;
+	int ret = 0;
+
+	if (!(readBuf = MDMA_BufAlloc(MDMA_CHUNK_LEN_MAX))) {
+		perror("Allocating read buffer RAM");
+		return -1;
+	}
+
+	for (blk = 0; !ret && blk < nBlocks;) {
+		if (!mark[blk]) {
+			blk++;
+			continue;
+		}
+		// Merge consecutive marked blocks in a single read
+		start = blk * QV_BLOCK_LEN;
+		for (len = 0; blk < nBlocks && mark[blk] &&
+				(len + QV_BLOCK_LEN) <= MDMA_CHUNK_LEN_MAX; blk++) {
+			len += QV_BLOCK_LEN;
+		}
+		len = MIN(len, fWr->len - start);
+		if (MDMA_read(len, fWr->addr + start, readBuf)) {
+			PrintErr("Couldn't read from cart!\n");
+			ret = -1;
+		} else if (memcmp(readBuf, buf + start, len<<1)) {
+			MdmaVerifyFail(fWr->addr + start, buf + start, readBuf, len);
+			ret = 1;
+		}
+	}
+	MDMA_BufFree(readBuf);
+
+	return ret;
+}
+
+int QvRun(const MemImage *fWr, const u16 *buf, uint64_t seed, double conf,
+		double defect) {
+	uint8_t *mark;
+	uint32_t nBlocks, nSamples, marked, blk, forced;
+	uint32_t lines, covered, bit, top, ones, end;
+	uint64_t state = seed ? seed : 1;
+	double miss, achieved;
+	int ret;
+
+	if (!fWr->len) return 0;
+	nBlocks = (fWr->len + QV_BLOCK_LEN - 1) / QV_BLOCK_LEN;
+	if (!(mark = (uint8_t*)calloc(nBlocks, 1))) {
+		perror("Allocating quick verify RAM");
+		return -1;
+	}
+
+	// Header, first and last sectors are always verified
+	marked = QvMark(mark, nBlocks, 0, QV_HEAD_LEN);
+	marked += QvMark(mark, nBlocks, 0, QV_SECT_LEN);
+	marked += QvMark(mark, nBlocks, fWr->len > QV_SECT_LEN ?
+			fWr->len - QV_SECT_LEN : 0, QV_SECT_LEN);
+
+	// Address line pattern: for each line, the cart words with only that
+	// line set and with all the other lines set. A stuck or shorted line
+	// makes at least one of them read a different word. When the image does
+	// not reach the word with all the lines set, the top line is left clear
+	// in the second word. Lines are covered when both words are in the image.
+	end = fWr->addr + fWr->len;
+	for (top = 1, lines = 0; top < end; top <<= 1, lines++);
+	ones = (top - 1) < end ? top - 1 : (top>>1) - 1;
+	for (bit = 1, covered = 0; bit < top; bit <<= 1) {
+		if (bit >= fWr->addr && bit < end) {
+			marked += QvMark(mark, nBlocks, bit - fWr->addr, 1);
+		}
+		if ((ones & ~bit) >= fWr->addr && (ones & ~bit) < end) {
+			marked += QvMark(mark, nBlocks, (ones & ~bit) - fWr->addr, 1);
+			if (bit >= fWr->addr && bit < end) covered++;
+		}
+	}
+	forced = marked;
+
+	// Number of random samples needed for the requested confidence
+	for (nSamples = 0, miss = 1; miss > (1 - conf / 100) &&
+			nSamples < nBlocks; nSamples++) {
+		miss *= 1 - defect / 100;
+	}
+	nSamples = MIN(nSamples, nBlocks - marked);
+	achieved = 100 * (1 - miss);
+
+	// Pick samples at random, without repetition
+	while (nSamples) {
+		blk = QvRand(&state) % nBlocks;
+		if (!mark[blk]) {
+			mark[blk] = TRUE;
+			marked++;
+			nSamples--;
+		}
+	}
+
+	printf("Quick verifying %u of %u blocks (%u random)...\n", marked,
+			nBlocks, marked - forced);
+	fflush(stdout);
+	ret = QvCompare(fWr, buf, mark, nBlocks);
+	if (!ret) {
+		printf("Quick verify OK! Coverage: %.2f%% of the image, "
+				"%u/%u address lines, %.3f%% confidence for defects "
+				"in %.2f%% of the blocks.\n", 100.0 * marked / nBlocks,
+				covered, lines, marked == nBlocks ? 100.0 : achieved, defect);
+	}
+	free(mark);
+
+	return ret;
+}
+
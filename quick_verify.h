@@ -0,0 +1,76 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Sampled quick verify.
+ *
+ * \defgroup quick_verify quick_verify
+ * \{
+ * \brief Sampled quick verify.
+ *
+ * Verifies a flashed image reading only a pseudo-random sample of blocks,
+ * instead of reading back the complete image. The sample is seeded from the
+ * image hash, so the same image is always verified using the same blocks.
+ * The sample always includes the ROM header, the first and last flash
+ * sectors of the image, and the cart words of an address line pattern
+ * inside the image, so gross failures (missing chip, dead address lines,
+ * wrong image) are detected.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _QUICK_VERIFY_H_
+#define _QUICK_VERIFY_H_
+
+#include <stdint.h>
+#include "util.h"
+#include "mdma.h"
+
+/// Length in words of each sampled block
+#define QV_BLOCK_LEN		64
+/// Length in words of a flash sector
+#define QV_SECT_LEN			MDMA_SECT_LEN
+/// Length in words of the ROM header
+#define QV_HEAD_LEN			(512 / 2)
+/// Default minimum defect size to detect, in percent of the blocks
+#define QV_DEFECT_DEF		1.0
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Parses a quick verify argument, with the format confidence[:defect],
+ * both numbers in percent. E.g. "99.9:1" requests detecting with a 99.9%
+ * confidence defects affecting at least 1% of the blocks.
+ *
+ * \param[in]  arg    Argument string.
+ * \param[out] conf   Requested confidence.
+ * \param[out] defect Minimum defect size.
+ *
+ * \return 0 if OK, 1 if error.
+ ****************************************************************************/
+int QvParse(const char *arg, double *conf, double *defect);
+
+/************************************************************************//**
+ * Verifies a sample of an image flashed to the cart.
+ *
+ * \param[in] fWr    Memory image with the address and length of the image.
+ * \param[in] buf    Byte swapped image data.
+ * \param[in] seed   Seed for the sample (e.g. the image hash).
+ * \param[in] conf   Confidence, in percent.
+ * \param[in] defect Minimum defect size to detect, in percent of blocks.
+ *
+ * \return 0 if verify is OK, 1 if a mismatch is found, -1 on read error.
+ ****************************************************************************/
+int QvRun(const MemImage *fWr, const u16 *buf, uint64_t seed, double conf,
+		double defect);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_QUICK_VERIFY_H_*/
+
+/** \} */
+
@@ -0,0 +1,187 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Flight recorder of the last USB transfers.
+ *
+ * Writers claim a ring slot by atomically incrementing the transfer count,
+ * and guard the slot with a sequence number: it is cleared before the slot
+ * is written, and set to the transfer count once written. Readers copy a
+ * slot and check its sequence number did not change while copying, so
+ * slots being written or overwritten are skipped without locking writers.
+ *
+ * SIGUSR1 is blocked in all the threads but the recorder thread, that
+ * waits for it with sigwait(), so the dump does not run in a signal
+ * handler.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "recorder.h"
+#include "commands.h"
+#include "util.h"
+
+#ifndef __OS_WIN
+#include <signal.h>
+#endif
+
+/// Recorded transfer
+typedef struct {
+	uint64_t seq;		///< Transfer count once written, 0 while writing.
+	uint64_t start;		///< Start time (us).
+	uint32_t us;		///< Duration (us).
+	uint32_t addr;		///< Word address of the command.
+	uint32_t len;		///< Length of the command.
+	uint32_t bytes;		///< Bytes transferred.
+	int32_t result;		///< libusb result.
+	uint16_t thread;	///< Thread that made the transfer.
+	uint8_t op;			///< Command opcode.
+	uint8_t phase;		///< Command phase.
+} RecEntry;
+
+/// Transfer ring
+static RecEntry rec[REC_ENTRIES];
+/// Transfers recorded
+static uint64_t recCount;
+/// Transfers recorded when the previous dump was made
+static uint64_t recDumped;
+/// Serializes dumps
+static pthread_mutex_t recLock = PTHREAD_MUTEX_INITIALIZER;
+/// Threads that recorded a transfer
+static uint16_t recThreads;
+/// Number of the calling thread, 0 if not given yet
+static __thread uint16_t recThread;
+
+void RecAdd(uint8_t op, StatsPhase phase, uint64_t start, uint32_t addr,
+		uint32_t len, uint32_t bytes, int result) {
+	uint64_t end = MonoUs();
+	uint64_t seq = __atomic_add_fetch(&recCount, 1, __ATOMIC_RELAXED);
+	RecEntry *e = &rec[(seq - 1) & (REC_ENTRIES - 1)];
+
+	if (!recThread) {
+		recThread = __atomic_add_fetch(&recThreads, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->start = start;
+	e->us = end - start;
+	e->addr = addr;
+	e->len = len;
+	e->bytes = bytes;
+	e->result = result;
+	e->thread = recThread;
+	e->op = op;
+	e->phase = phase;
+	__atomic_store_n(&e->seq, seq, __ATOMIC_RELEASE);
+}
+
+/// Copies the slot of a transfer. Returns FALSE if it was overwritten or
+/// is still being written.
+static int RecGet(uint64_t seq, RecEntry *copy) {
+	RecEntry *e = &rec[(seq - 1) & (REC_ENTRIES - 1)];
+
+	if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq) return FALSE;
+	memcpy(copy, e, sizeof(RecEntry));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/// Formats a libusb result
+static const char *RecResult(char *str, int result) {
+	if (!result) return "OK";
+	// Asynchronous transfers record the transfer status
+	if (result > 0) sprintf(str, "STATUS_%d", result);
+	else sprintf(str, "%s", libusb_error_name(result));
+
+	return str;
+}
+
+/// Formats an address or length, empty if not applicable
+static const char *RecNum(char *str, const char *fmt, uint32_t val) {
+	if (UINT32_MAX == val) str[0] = '\0';
+	else sprintf(str, fmt, val);
+
+	return str;
+}
+
+void RecDump(RecDumpMode mode) {
+	uint64_t now = MonoUs();
+	uint64_t count, seq, first;
+	unsigned int skipped = 0;
+	char addr[16], len[16], result[32];
+	RecEntry e;
+
+	pthread_mutex_lock(&recLock);
+	count = __atomic_load_n(&recCount, __ATOMIC_ACQUIRE);
+	first = count > REC_ENTRIES ? count - REC_ENTRIES + 1 : 1;
+	if (REC_DUMP_NEW == mode) first = MAX(first, recDumped + 1);
+	recDumped = count;
+	if (first > count) {
+		pthread_mutex_unlock(&recLock);
+		return;
+	}
+
+	PrintErr("\nFlight recorder: transfers %llu to %llu of %llu, oldest "
+			"first (time in ms before this dump):\n", (unsigned long long)
+			first, (unsigned long long)count, (unsigned long long)count);
+	PrintErr("%10s %3s %-13s %-7s %8s %7s %6s %8s %s\n", "time", "thr",
+			"command", "phase", "address", "length", "bytes", "us", "result");
+	for (seq = first; seq <= count; seq++) {
+		if (!RecGet(seq, &e)) {
+			skipped++;
+			continue;
+		}
+		PrintErr("%10.3f %3u %-13s %-7s %8s %7s %6u %8u %s\n",
+				now > e.start ? (now - e.start) / -1000.0 : 0.0, e.thread,
+				StatsOpName(e.op), StatsPhaseName((StatsPhase)e.phase),
+				RecNum(addr, "0x%06X", e.addr), RecNum(len, "%u", e.len),
+				e.bytes, e.us, RecResult(result, e.result));
+	}
+	if (skipped) {
+		PrintErr("%u transfer(s) overwritten while dumping.\n", skipped);
+	}
+	pthread_mutex_unlock(&recLock);
+}
+
+#ifndef __OS_WIN
+
+static void *RecThread(void *arg) {
+	sigset_t *set = (sigset_t*)arg;
+	int sig;
+
+	while (!sigwait(set, &sig)) RecDump(REC_DUMP_ALL);
+
+	return NULL;
+}
+
+int RecInit(void) {
+	static sigset_t set;
+	pthread_t th;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	// Threads created from now on inherit the mask
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) ||
+			pthread_create(&th, NULL, RecThread, &set)) {
+		PrintErr("Error: could not start flight recorder thread\n");
+		return -1;
+	}
+	pthread_detach(th);
+
+	return 0;
+}
+
+#else
+
+int RecInit(void) {
+	// No SIGUSR1, the ring is only dumped on errors and on exit
+	return 0;
+}
+
+#endif /*__OS_WIN*/
+
@@ -0,0 +1,82 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Flight recorder of the last USB transfers.
+ *
+ * \defgroup recorder recorder
+ * \{
+ * \brief Flight recorder of the last USB transfers.
+ *
+ * Each USB bulk transfer is recorded in a fixed size ring, holding the last
+ * REC_ENTRIES transfers with their opcode, command phase, address, length,
+ * bytes transferred, libusb result, start time and duration. Recording is
+ * always on: it takes no locks and no allocations, so its cost is a few
+ * stores per transfer.
+ *
+ * The ring is dumped to stderr when a transfer fails (only the transfers
+ * not dumped before), when the process receives SIGUSR1, and when the
+ * program ends if requested, so rare failures can be analyzed after they
+ * happen without running in verbose mode.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <stdint.h>
+#include "stats.h"
+
+/// Transfers held in the ring (must be a power of 2)
+#define REC_ENTRIES		256
+
+/// Transfers to dump
+typedef enum {
+	REC_DUMP_ALL = 0,	///< All the transfers in the ring.
+	REC_DUMP_NEW		///< Transfers recorded since the previous dump.
+} RecDumpMode;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Installs the SIGUSR1 handler dumping the ring. Must be called before
+ * creating any other thread, so the signal is only received by the
+ * recorder thread.
+ *
+ * \return 0 if OK, -1 on error.
+ ****************************************************************************/
+int RecInit(void);
+
+/************************************************************************//**
+ * Records a USB transfer. Can be called from any thread.
+ *
+ * \param[in] op     Opcode of the command the transfer belongs to.
+ * \param[in] phase  Command phase of the transfer.
+ * \param[in] start  Transfer start time (us, as returned by MonoUs()).
+ * \param[in] addr   Word address of the command, UINT32_MAX if none.
+ * \param[in] len    Length of the command, UINT32_MAX if none.
+ * \param[in] bytes  Bytes transferred.
+ * \param[in] result libusb result of the transfer.
+ ****************************************************************************/
+void RecAdd(uint8_t op, StatsPhase phase, uint64_t start, uint32_t addr,
+		uint32_t len, uint32_t bytes, int result);
+
+/************************************************************************//**
+ * Prints the recorded transfers to stderr, oldest first. Can be called
+ * from any thread, while other threads record transfers.
+ *
+ * \param[in] mode Transfers to dump.
+ ****************************************************************************/
+void RecDump(RecDumpMode mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_RECORDER_H_*/
+
+/** \} */
+
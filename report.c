@@ -0,0 +1,223 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Machine readable job reports.
+ *
+ * Operations are recorded in memory, and the whole report is written when
+ * the job ends. Addresses and lengths are in words, as in the command
+ * line, and byte counts are added to ease throughput calculations.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "report.h"
+#include "commands.h"
+#include "mdma.h"
+#include "util.h"
+
+/// Recorded operation
+typedef struct {
+	const char *name;		///< Operation name.
+	uint32_t addr;			///< Word address.
+	uint32_t len;			///< Length in words.
+	uint64_t start;			///< Start time (us).
+	uint64_t us;			///< Duration (us).
+	uint32_t retries;		///< Chunk reads retried.
+	uint32_t unresolved;	///< Words without a read quorum.
+	int err;				///< Operation result.
+} RptOp;
+
+/// Range that failed to verify
+typedef struct {
+	uint32_t addr;			///< Word address.
+	uint32_t len;			///< Length in words.
+} RptRange;
+
+/// Report state
+typedef struct {
+	int on;					///< Report requested.
+	const char *file;		///< Output file, NULL for RPT_FD.
+	FILE *out;				///< Output stream.
+	time_t date;			///< Job start date.
+	uint64_t start;			///< Job start time (us).
+	char serial[64];		///< Programmer serial number.
+	uint16_t bcdDevice;		///< Programmer firmware version.
+	int devValid;			///< Programmer identity obtained.
+	uint16_t ids[4];		///< Manufacturer and device IDs.
+	int idsValid;			///< Chip IDs obtained.
+	RptOp op[RPT_OPS_MAX];	///< Recorded operations.
+	int nOp;				///< Number of operations recorded.
+	uint32_t dropped;		///< Operations not recorded.
+	const char *verifyMethod;	///< Verify method.
+	RptVerifyResult verify;	///< Verify result.
+	RptRange miss[RPT_MISMATCH_MAX];	///< Ranges that failed to verify.
+	int nMiss;				///< Number of ranges recorded.
+	uint32_t missWords;		///< Words that failed to verify.
+} Rpt;
+
+static Rpt rpt;
+
+int RptParse(const char *spec) {
+	if (strncmp(spec, "json", 4) || (spec[4] && ':' != spec[4]) ||
+			(':' == spec[4] && !spec[5])) return 1;
+	rpt.on = TRUE;
+	rpt.file = spec[4] ? spec + 5 : NULL;
+
+	return 0;
+}
+
+int RptOpen(void) {
+	if (!rpt.on) return 0;
+
+	rpt.out = rpt.file ? fopen(rpt.file, "w") : fdopen(RPT_FD, "w");
+	if (!rpt.out) {
+		if (rpt.file) perror(rpt.file);
+		else PrintErr("Error: report file descriptor %d is not open!\n",
+				RPT_FD);
+		rpt.on = FALSE;
+		return -1;
+	}
+	rpt.date = time(NULL);
+	rpt.start = MonoUs();
+
+	return 0;
+}
+
+void RptIdentify(void) {
+	if (!rpt.on) return;
+
+	rpt.devValid = !UsbDevInfoGet(rpt.serial, sizeof(rpt.serial),
+			&rpt.bcdDevice);
+	rpt.idsValid = !MDMA_manId_get(rpt.ids) && !MDMA_devId_get(rpt.ids + 1);
+}
+
+int RptOpBegin(const char *name, uint32_t addr, uint32_t len) {
+	RptOp *o;
+
+	if (!rpt.on) return -1;
+	if (rpt.nOp == RPT_OPS_MAX) {
+		rpt.dropped++;
+		return -1;
+	}
+	o = &rpt.op[rpt.nOp];
+	memset(o, 0, sizeof(RptOp));
+	o->name = name;
+	o->addr = addr;
+	o->len = len;
+	o->start = MonoUs();
+
+	return rpt.nOp++;
+}
+
+void RptOpEnd(int op, int err) {
+	if (op < 0) return;
+
+	rpt.op[op].us = MonoUs() - rpt.op[op].start;
+	rpt.op[op].err = err;
+}
+
+void RptOpRetries(int op, uint32_t retries, uint32_t unresolved) {
+	if (op < 0) return;
+
+	rpt.op[op].retries = retries;
+	rpt.op[op].unresolved = unresolved;
+}
+
+void RptVerify(const char *method, RptVerifyResult result) {
+	rpt.verifyMethod = method;
+	rpt.verify = result;
+}
+
+void RptMismatch(uint32_t addr, uint32_t len) {
+	if (!rpt.on) return;
+
+	rpt.missWords += len;
+	if (rpt.nMiss < RPT_MISMATCH_MAX) {
+		rpt.miss[rpt.nMiss].addr = addr;
+		rpt.miss[rpt.nMiss++].len = len;
+	}
+}
+
+/// Writes a JSON string
+static void RptStr(FILE *out, const char *str) {
+	fputc('"', out);
+	for (; *str; str++) {
+		if ('"' == *str || '\\' == *str) fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20) {
+			fprintf(out, "\\u%04x", (unsigned char)*str);
+		} else fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+static void RptOpWrite(FILE *out, const RptOp *o) {
+	uint64_t bytes = (uint64_t)o->len<<1;
+
+	fprintf(out, "    {\"op\": ");
+	RptStr(out, o->name);
+	fprintf(out, ", \"addr\": %u, \"words\": %u, \"bytes\": %llu, "
+			"\"duration_s\": %.6f, \"throughput_kib_s\": %.1f, "
+			"\"result\": \"%s\", \"retries\": %u, \"unresolved_words\": %u}",
+			o->addr, o->len, (unsigned long long)bytes, o->us / 1e6,
+			o->us ? bytes / 1.024 / o->us * 1000 : 0.0,
+			o->err ? "error" : "ok", o->retries, o->unresolved);
+}
+
+void RptClose(int exitStatus) {
+	static const char * const verifyStr[] = {"not_run", "ok", "failed"};
+	FILE *out = rpt.out;
+	uint32_t retries = 0;
+	char date[32];
+	int i;
+
+	if (!rpt.on) return;
+
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&rpt.date));
+	fprintf(out, "{\n  \"tool\": \"mdma\",\n  \"version\": \"%d.%d\",\n"
+			"  \"start\": \"%s\",\n  \"duration_s\": %.6f,\n", VERSION_MAJOR,
+			VERSION_MINOR, date, (MonoUs() - rpt.start) / 1e6);
+	fprintf(out, "  \"device\": ");
+	if (rpt.devValid) {
+		fprintf(out, "{\"serial\": ");
+		RptStr(out, rpt.serial);
+		fprintf(out, ", \"bcd_device\": \"0x%04X\"}", rpt.bcdDevice);
+	} else fprintf(out, "null");
+	fprintf(out, ",\n  \"chip\": ");
+	if (rpt.idsValid) {
+		fprintf(out, "{\"manufacturer_id\": \"0x%04X\", \"device_ids\": "
+				"[\"0x%04X\", \"0x%04X\", \"0x%04X\"]}", rpt.ids[0],
+				rpt.ids[1], rpt.ids[2], rpt.ids[3]);
+	} else fprintf(out, "null");
+
+	fprintf(out, ",\n  \"operations\": [");
+	for (i = 0; i < rpt.nOp; i++) {
+		fprintf(out, "%s\n", i ? "," : "");
+		RptOpWrite(out, &rpt.op[i]);
+		retries += rpt.op[i].retries;
+	}
+	fprintf(out, "%s],\n  \"operations_dropped\": %u,\n", rpt.nOp ? "\n  " :
+			"", rpt.dropped);
+
+	fprintf(out, "  \"verify\": {\"method\": ");
+	if (rpt.verifyMethod) RptStr(out, rpt.verifyMethod);
+	else fprintf(out, "null");
+	fprintf(out, ", \"result\": \"%s\", \"mismatch_words\": %u, "
+			"\"mismatches\": [", verifyStr[rpt.verify], rpt.missWords);
+	for (i = 0; i < rpt.nMiss; i++) {
+		fprintf(out, "%s{\"addr\": %u, \"words\": %u}", i ? ", " : "",
+				rpt.miss[i].addr, rpt.miss[i].len);
+	}
+	fprintf(out, "]},\n  \"retries\": %u,\n  \"exit_status\": %d\n}\n",
+			retries, exitStatus);
+
+	fclose(out);
+	rpt.out = NULL;
+	rpt.on = FALSE;
+}
+
@@ -0,0 +1,125 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Machine readable job reports.
+ *
+ * \defgroup report report
+ * \{
+ * \brief Machine readable job reports.
+ *
+ * Records the programmer and flash chip identity, the operations run with
+ * their range, duration and throughput, the verify result with the
+ * mismatching ranges, and the exit status of the job. The record is
+ * written as a JSON object when the job ends, to a file or to file
+ * descriptor 3, so it is not mixed with the console output.
+ *
+ * All the functions do nothing if no report was requested.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _REPORT_H_
+#define _REPORT_H_
+
+#include <stdint.h>
+
+/// Maximum number of operations recorded
+#define RPT_OPS_MAX			256
+/// Maximum number of mismatching ranges recorded
+#define RPT_MISMATCH_MAX	64
+/// File descriptor the report is written to if no file is given
+#define RPT_FD				3
+
+/// Verify result
+typedef enum {
+	RPT_VERIFY_NONE = 0,	///< No verify requested.
+	RPT_VERIFY_OK,			///< Cart contents match the image.
+	RPT_VERIFY_FAILED		///< Cart contents differ from the image.
+} RptVerifyResult;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Parses the report argument, with format json[:file].
+ *
+ * \param[in] spec Report argument.
+ *
+ * \return 0 if OK, 1 if the argument is not valid.
+ ****************************************************************************/
+int RptParse(const char *spec);
+
+/************************************************************************//**
+ * Opens the report output, and starts timing the job.
+ *
+ * \return 0 if OK or no report requested, -1 on error.
+ ****************************************************************************/
+int RptOpen(void);
+
+/************************************************************************//**
+ * Queries the programmer and flash chip identity. The programmer must be
+ * open.
+ ****************************************************************************/
+void RptIdentify(void);
+
+/************************************************************************//**
+ * Starts recording an operation.
+ *
+ * \param[in] name Operation name (e.g. "flash").
+ * \param[in] addr Word address of the operation range.
+ * \param[in] len  Length of the range in words (0 for the whole chip).
+ *
+ * \return Operation handle, -1 if not recorded.
+ ****************************************************************************/
+int RptOpBegin(const char *name, uint32_t addr, uint32_t len);
+
+/************************************************************************//**
+ * Ends recording an operation, obtaining its duration.
+ *
+ * \param[in] op  Operation handle returned by RptOpBegin().
+ * \param[in] err Result of the operation (0 if OK).
+ ****************************************************************************/
+void RptOpEnd(int op, int err);
+
+/************************************************************************//**
+ * Sets the read retries of an operation.
+ *
+ * \param[in] op         Operation handle returned by RptOpBegin().
+ * \param[in] retries    Chunk reads retried.
+ * \param[in] unresolved Words without a read quorum.
+ ****************************************************************************/
+void RptOpRetries(int op, uint32_t retries, uint32_t unresolved);
+
+/************************************************************************//**
+ * Sets the verify result.
+ *
+ * \param[in] method Verify method (e.g. "full" or "quick").
+ * \param[in] result Verify result.
+ ****************************************************************************/
+void RptVerify(const char *method, RptVerifyResult result);
+
+/************************************************************************//**
+ * Records a range of words that failed to verify.
+ *
+ * \param[in] addr Word address of the range.
+ * \param[in] len  Length of the range in words.
+ ****************************************************************************/
+void RptMismatch(uint32_t addr, uint32_t len);
+
+/************************************************************************//**
+ * Writes the report and closes its output.
+ *
+ * \param[in] exitStatus Exit status of the program.
+ ****************************************************************************/
+void RptClose(int exitStatus);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_REPORT_H_*/
+
+/** \} */
+
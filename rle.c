@@ -0,0 +1,65 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Run-length encoding of MDMA_WRITE_RLE payloads.
+ *
+ * Runs of MDMA_RLE_RUN_MIN or more equal words are encoded as run blocks,
+ * other words are gathered in literal blocks. Encoding stops as soon as
+ * the output would not be shorter than the input, so raw writes are used
+ * for incompressible data without encoding it all.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include "rle.h"
+
+// Stores a word at dst, little-endian
+static void RleWordPut(void *dst, u16 word) {
+	u8 *b = (u8*)dst;
+
+	b[0] = word & 0xFF;
+	b[1] = word>>8;
+}
+
+u16 RleEncode(const u16 *data, u16 wLen, u16 *enc) {
+	uint32_t i, k, run;
+	uint32_t o = 0;
+	// Position of the header of the current literal block, if any
+	int32_t lit = -1;
+	// Length of the current literal block
+	u16 litLen = 0;
+
+	for (i = 0; i < wLen; i += run) {
+		for (run = 1; (i + run < wLen) && (run < MDMA_RLE_COUNT_MAX) &&
+				(data[i + run] == data[i]); run++);
+		if (run >= MDMA_RLE_RUN_MIN) {
+			if (o + 2 >= wLen) return 0;
+			RleWordPut(enc + o++, MDMA_RLE_RUN | run);
+			// Data words are copied as stored, they are already in wire order
+			enc[o++] = data[i];
+			lit = -1;
+			continue;
+		}
+		for (k = 0; k < run; k++) {
+			if (lit < 0 || MDMA_RLE_COUNT_MAX == litLen) {
+				if (o + 2 >= wLen) return 0;
+				lit = o++;
+				litLen = 0;
+			} else if (o + 1 >= wLen) return 0;
+			enc[o++] = data[i];
+			RleWordPut(enc + lit, ++litLen);
+		}
+	}
+
+	return o;
+}
+
+void RleFrameFill(u8 *frame, u16 wLen, u16 encLen, int addr) {
+	RleWordPut(frame + 1, wLen);
+	frame[3] = addr & 0xFF;
+	frame[4] = (addr>>8) & 0xFF;
+	frame[5] = (addr>>16) & 0xFF;
+	RleWordPut(frame + 6, encLen);
+}
+
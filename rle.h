@@ -0,0 +1,71 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Run-length encoding of MDMA_WRITE_RLE payloads.
+ *
+ * \defgroup rle rle
+ * \{
+ * \brief Run-length encoding of MDMA_WRITE_RLE payloads.
+ *
+ * The payload is a sequence of blocks, each one starting with a header
+ * word. If bit 15 of the header is set, the low 15 bits are a repeat count,
+ * followed by the word to repeat. Otherwise the header is the number of
+ * literal words that follow.
+ *
+ * Data words are sent as they are stored in the write buffers, that is,
+ * little-endian (the ROM image words are swapped when loaded). Header words
+ * and the command frame lengths are also sent little-endian, and are
+ * serialized byte by byte, so the wire format does not depend on the host.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _RLE_H_
+#define _RLE_H_
+
+#include "util.h"
+
+/// Bit set in the header of run blocks
+#define MDMA_RLE_RUN			0x8000
+/// Maximum count of a run or literal block
+#define MDMA_RLE_COUNT_MAX		0x7FFF
+/// Minimum run length encoded as a run block
+#define MDMA_RLE_RUN_MIN		3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Run-length encodes a write payload.
+ *
+ * \param[in]  data Words to encode.
+ * \param[in]  wLen Number of words to encode.
+ * \param[out] enc  Encoded payload. Must hold wLen words.
+ *
+ * \return Encoded length in words, or 0 if it is not shorter than wLen.
+ ****************************************************************************/
+u16 RleEncode(const u16 *data, u16 wLen, u16 *enc);
+
+/************************************************************************//**
+ * Fills the length and address fields of an MDMA_WRITE_RLE command frame:
+ * the decoded length in words goes in bytes 1 and 2, the address in bytes
+ * 3 to 5, and the encoded length in words in bytes 6 and 7, all of them
+ * little-endian.
+ *
+ * \param[out] frame  Command frame bytes.
+ * \param[in]  wLen   Decoded length in words.
+ * \param[in]  encLen Encoded length in words.
+ * \param[in]  addr   Word address to write to.
+ ****************************************************************************/
+void RleFrameFill(u8 *frame, u16 wLen, u16 encLen, int addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_RLE_H_*/
+
+/** \} */
+
@@ -0,0 +1,201 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief ROM image loader.
+ *
+ * Loads ROM images to be flashed to the cartridge. The file is read,
+ * decoded, byte swapped, trimmed and hashed on a worker thread, so all this
+ * work overlaps with programmer initialization and flash erase.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "rom_img.h"
+#include "commands.h"
+#include "mdz.h"
+
+/// FNV-1a 64-bit prime
+#define ROM_IMG_HASH_PRIME	0x100000001B3ULL
+
+/// Detects the image format, looking at the file length and header
+static RomImgFmt RomImgFmtGet(FILE *rom, long fLen) {
+	uint8_t head[10];
+
+	if ((fLen >= 4) && (fread(head, 4, 1, rom) == 1) &&
+			!memcmp(head, MDZ_MAGIC, 4)) {
+		return ROM_IMG_MDZ;
+	}
+	fseek(rom, 0, SEEK_SET);
+	if ((fLen < (ROM_IMG_SMD_HEAD_LEN + ROM_IMG_SMD_BLOCK_LEN)) ||
+			((fLen % ROM_IMG_SMD_BLOCK_LEN) != ROM_IMG_SMD_HEAD_LEN)) {
+		return ROM_IMG_RAW;
+	}
+	if (fread(head, sizeof(head), 1, rom) != 1) return ROM_IMG_RAW;
+	fseek(rom, 0, SEEK_SET);
+
+	return (0xAA == head[8] && 0xBB == head[9]) ? ROM_IMG_SMD : ROM_IMG_RAW;
+}
+
+/// Reads a SMD image. Each block stores odd bytes in the first half and
+/// even bytes in the second half. Output is in file (big endian) order.
+static int RomImgSmdRead(FILE *rom, uint8_t *out, uint32_t bLen) {
+	uint8_t block[ROM_IMG_SMD_BLOCK_LEN];
+	uint32_t pos, i, step;
+	const uint32_t half = ROM_IMG_SMD_BLOCK_LEN / 2;
+
+	if (fseek(rom, ROM_IMG_SMD_HEAD_LEN, SEEK_SET)) return -1;
+	for (pos = 0; pos < bLen; pos += ROM_IMG_SMD_BLOCK_LEN) {
+		if (fread(block, ROM_IMG_SMD_BLOCK_LEN, 1, rom) != 1) return -1;
+		step = MIN(ROM_IMG_SMD_BLOCK_LEN, bLen - pos);
+		for (i = 0; i < step / 2; i++) {
+			out[pos + 2 * i]     = block[half + i];
+			out[pos + 2 * i + 1] = block[i];
+		}
+	}
+
+	return 0;
+}
+
+/// Decompresses the beginning of a MDZ image
+static int RomImgMdzRead(const char *file, uint8_t *out, uint32_t bLen) {
+	MdzReader *rd;
+	int err;
+
+	if (!(rd = MdzOpen(file))) return -1;
+	err = MdzRead(rd, 0, bLen, out);
+	MdzClose(rd);
+
+	return err;
+}
+
+static void *RomImgLoadThread(void *arg) {
+	RomImg *img = (RomImg*)arg;
+	FILE *rom;
+	uint32_t i;
+	int err = 0;
+
+	if (ROM_IMG_MDZ == img->fmt) {
+		err = RomImgMdzRead(img->file, (uint8_t*)img->buf, img->len<<1);
+	} else {
+		if (!(rom = fopen(img->file, "rb"))) {
+			perror(img->file);
+			img->err = -1;
+			return NULL;
+		}
+		if (ROM_IMG_SMD == img->fmt) {
+			err = RomImgSmdRead(rom, (uint8_t*)img->buf, img->len<<1);
+		} else if (img->len &&
+				(fread(img->buf, img->len<<1, 1, rom) != 1)) {
+			err = -1;
+		}
+		fclose(rom);
+	}
+	if (err) {
+		PrintErr("Error: could not read %s\n", img->file);
+		img->err = -1;
+		return NULL;
+	}
+
+	// Do byte swaps
+	for (i = 0; i < img->len; i++) ByteSwapWord(img->buf[i]);
+
+	// Writing 0xFFFF to flash is a no-op, so trailing padding is trimmed
+	for (i = img->len; i && (0xFFFF == img->buf[i - 1]); i--);
+	img->wrLen = i;
+
+	img->hash = RomImgHash(img->buf, img->len, ROM_IMG_HASH_INIT);
+	img->err = 0;
+
+	return NULL;
+}
+
+int RomImgLoadStart(RomImg *img, MemImage *m) {
+	FILE *rom;
+	struct stat st;
+	MdzReader *mdz;
+	uint32_t avail;
+
+	memset(img, 0, sizeof(RomImg));
+	img->file = m->file;
+
+	if (stat(m->file, &st)) {
+		perror(m->file);
+		return -1;
+	}
+	if (!(rom = fopen(m->file, "rb"))) {
+		perror(m->file);
+		return -1;
+	}
+	img->fmt = RomImgFmtGet(rom, st.st_size);
+	fclose(rom);
+
+	if (ROM_IMG_MDZ == img->fmt) {
+		if (!(mdz = MdzOpen(m->file))) return -1;
+		avail = MIN(MdzRawLen(mdz), UINT32_MAX)>>1;
+		MdzClose(mdz);
+	} else if (ROM_IMG_SMD == img->fmt) {
+		avail = (st.st_size - ROM_IMG_SMD_HEAD_LEN)>>1;
+	} else {
+		avail = st.st_size>>1;
+	}
+	// Obtain length if not specified
+	if (!m->len) m->len = avail;
+	if (m->len > avail) {
+		PrintErr("Error: %s is shorter than the requested length\n",
+				m->file);
+		return -1;
+	}
+	img->len = m->len;
+
+	img->buf = MDMA_BufAlloc(img->len);
+	if (!img->buf) {
+		perror("Allocating write buffer RAM");
+		return -1;
+	}
+
+	if (pthread_create(&img->thread, NULL, RomImgLoadThread, img)) {
+		PrintErr("Error: could not start image loader thread\n");
+		RomImgFree(img);
+		return -1;
+	}
+
+	return 0;
+}
+
+int RomImgLoadWait(RomImg *img) {
+	pthread_join(img->thread, NULL);
+	// The buffer was allocated while the programmer was being opened, move
+	// it to device memory now that it can be used
+	if (!img->err) img->buf = MDMA_BufToDev(img->buf, img->len);
+
+	return img->err;
+}
+
+int RomImgLoad(RomImg *img, MemImage *m) {
+	if (RomImgLoadStart(img, m)) return -1;
+
+	return RomImgLoadWait(img);
+}
+
+void RomImgFree(RomImg *img) {
+	MDMA_BufFree(img->buf);
+	img->buf = NULL;
+}
+
+uint64_t RomImgHash(const u16 *buf, uint32_t wLen, uint64_t hash) {
+	uint32_t i;
+
+	for (i = 0; i < wLen; i++) {
+		hash ^= buf[i];
+		hash *= ROM_IMG_HASH_PRIME;
+	}
+
+	return hash;
+}
+
@@ -0,0 +1,124 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief ROM image loader.
+ *
+ * \defgroup rom_img rom_img
+ * \{
+ * \brief ROM image loader.
+ *
+ * Loads ROM images to be flashed to the cartridge. The file is read,
+ * decoded, byte swapped, trimmed and hashed on a worker thread, so all this
+ * work overlaps with programmer initialization and flash erase.
+ *
+ * Supported input formats are raw binary, Super Magic Drive (SMD)
+ * interleaved and MDZ compressed images.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _ROM_IMG_H_
+#define _ROM_IMG_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "util.h"
+#include "mdma.h"
+
+/// Length of the header prepended to SMD images
+#define ROM_IMG_SMD_HEAD_LEN	512
+/// Length of each interleaved block in SMD images
+#define ROM_IMG_SMD_BLOCK_LEN	16384
+
+/// Supported ROM image formats
+typedef enum {
+	ROM_IMG_RAW = 0,		///< Raw binary image.
+	ROM_IMG_SMD,			///< Super Magic Drive interleaved image.
+	ROM_IMG_MDZ				///< MDZ compressed image.
+} RomImgFmt;
+
+/************************************************************************//**
+ * ROM image being loaded.
+ ****************************************************************************/
+typedef struct {
+	const char *file;		///< File name.
+	uint32_t len;			///< Image length in words.
+	uint32_t wrLen;			///< Words to program (trailing 0xFFFF trimmed).
+	uint64_t hash;			///< Hash of the byte swapped image.
+	u16 *buf;				///< Byte swapped image data.
+	RomImgFmt fmt;			///< Format of the input file.
+	int err;				///< Load result: 0 on success.
+	pthread_t thread;		///< Worker thread loading the image.
+} RomImg;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Starts loading a ROM image on a worker thread. The format and length of
+ * the image are obtained before returning, so m->len is updated when not
+ * specified, and can be used (e.g. to auto-erase the cart) while the image
+ * is still loading.
+ *
+ * \param[out]   img Image to load.
+ * \param[inout] m   Memory image with file name, address and length.
+ *
+ * \return 0 if load started, non-zero on error (the file is not readable).
+ *
+ * \warning If this function succeeds, RomImgLoadWait() must be called.
+ ****************************************************************************/
+int RomImgLoadStart(RomImg *img, MemImage *m);
+
+/************************************************************************//**
+ * Waits until a load started with RomImgLoadStart() completes. If the load
+ * started before UsbInit(), the image is moved to device memory when
+ * possible, so img->buf must be read after this call.
+ *
+ * \param[inout] img Image being loaded.
+ *
+ * \return 0 if image was successfully loaded, non-zero otherwise.
+ ****************************************************************************/
+int RomImgLoadWait(RomImg *img);
+
+/************************************************************************//**
+ * Loads a ROM image, blocking until the load completes.
+ *
+ * \param[out]   img Image to load.
+ * \param[inout] m   Memory image with file name, address and length.
+ *
+ * \return 0 if image was successfully loaded, non-zero otherwise.
+ ****************************************************************************/
+int RomImgLoad(RomImg *img, MemImage *m);
+
+/************************************************************************//**
+ * Frees the image buffer.
+ *
+ * \param[in] img Image to free.
+ ****************************************************************************/
+void RomImgFree(RomImg *img);
+
+/************************************************************************//**
+ * Computes a 64-bit FNV-1a hash of a buffer of words.
+ *
+ * \param[in] buf  Buffer to hash.
+ * \param[in] wLen Length of the buffer in words.
+ * \param[in] hash Initial hash value. Use ROM_IMG_HASH_INIT for a new hash,
+ *            or the result of a previous call to continue hashing.
+ *
+ * \return The updated hash value.
+ ****************************************************************************/
+uint64_t RomImgHash(const u16 *buf, uint32_t wLen, uint64_t hash);
+
+/// Initial value for RomImgHash() calls
+#define ROM_IMG_HASH_INIT	0xCBF29CE484222325ULL
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_ROM_IMG_H_*/
+
+/** \} */
+
@@ -0,0 +1,504 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Interactive cart memory shell.
+ *
+ * Runs memory inspection commands over a paged LRU read cache, and stages
+ * writes in the cache until they are committed.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "shell.h"
+#include "commands.h"
+#include "mdma.h"
+#include "rom_img.h"
+#include "util.h"
+
+/// Cache page, holding a flash sector
+typedef struct {
+	uint32_t addr;		///< Sector word address (UINT32_MAX if empty).
+	uint32_t used;		///< Last use stamp, for LRU replacement.
+	u16 *data;			///< Sector data, with staged writes applied.
+	u16 *orig;			///< Sector data in flash (NULL if no staged writes).
+} ShPage;
+
+/// Shell state
+typedef struct {
+	ShPage page[SH_PAGES];	///< Cache pages.
+	uint32_t stamp;			///< Use stamp counter.
+	uint32_t hits;			///< Page cache hits.
+	uint32_t misses;		///< Page cache misses.
+} ShState;
+
+/// Command handler. Returns 0 on success, non-zero on error
+typedef int (*ShCmdFunc)(int argc, char *argv[]);
+
+/// Shell command
+typedef struct {
+	const char *name;		///< Command name.
+	int minArgs;			///< Minimum number of arguments.
+	ShCmdFunc func;			///< Command handler.
+	const char *usage;		///< Arguments and description.
+} ShCmd;
+
+static ShState sh;
+
+// Parses a number, returning non-zero on error.
+static int ShNum(const char *str, uint32_t *val) {
+	char *endPtr;
+
+	*val = strtoul(str, &endPtr, 0);
+	if (!*str || *endPtr) {
+		PrintErr("Invalid number: %s\n", str);
+		return 1;
+	}
+	return 0;
+}
+
+// Returns the page holding the sector of addr, loading it if needed.
+static ShPage *ShPageGet(uint32_t addr) {
+	uint32_t base = addr - addr % MDMA_SECT_LEN;
+	ShPage *pg = NULL;
+	int i;
+
+	sh.stamp++;
+	for (i = 0; i < SH_PAGES; i++) {
+		if (sh.page[i].addr == base) {
+			sh.hits++;
+			sh.page[i].used = sh.stamp;
+			return &sh.page[i];
+		}
+	}
+	// Replace the least recently used page without staged writes
+	for (i = 0; i < SH_PAGES; i++) {
+		if (sh.page[i].orig) continue;
+		if (!pg || sh.page[i].used < pg->used) pg = &sh.page[i];
+	}
+	if (!pg) {
+		PrintErr("Too many sectors with staged writes, commit first!\n");
+		return NULL;
+	}
+	sh.misses++;
+	pg->addr = UINT32_MAX;
+	if (!pg->data && !(pg->data = MDMA_BufAlloc(MDMA_SECT_LEN))) {
+		perror("Allocating page RAM");
+		return NULL;
+	}
+	if (MDMA_read(MDMA_SECT_LEN, base, pg->data)) {
+		PrintErr("Couldn't read from cart!\n");
+		return NULL;
+	}
+	pg->addr = base;
+	pg->used = sh.stamp;
+
+	return pg;
+}
+
+// Reads a range through the page cache.
+static int ShRead(uint32_t addr, uint32_t len, u16 *buf) {
+	ShPage *pg;
+	uint32_t off, n;
+
+	while (len) {
+		if (!(pg = ShPageGet(addr))) return -1;
+		off = addr - pg->addr;
+		n = MIN(len, MDMA_SECT_LEN - off);
+		memcpy(buf, pg->data + off, n<<1);
+		buf += n;
+		addr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Allocates a buffer and reads a range through the page cache.
+static u16 *ShAllocRead(uint32_t addr, uint32_t len) {
+	u16 *buf;
+
+	if (!(buf = (u16*)malloc(MAX(len, 1)<<1))) {
+		perror("Allocating read buffer RAM");
+		return NULL;
+	}
+	if (ShRead(addr, len, buf)) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+// Gets the byte at byte offset pos of a word buffer.
+static inline uint8_t ShByte(const u16 *buf, uint32_t pos) {
+	return (pos & 1) ? buf[pos>>1] & 0xFF : buf[pos>>1]>>8;
+}
+
+static int ShPeek(int argc, char *argv[]) {
+	uint32_t addr, len = 1, i;
+	u16 *buf;
+
+	if (ShNum(argv[1], &addr) || (argc > 2 && ShNum(argv[2], &len))) {
+		return 1;
+	}
+	if (!(buf = ShAllocRead(addr, len))) return 1;
+	for (i = 0; i < len; i++) {
+		if (!(i & 7)) printf("%s%06X:", i?"\n":"", addr + i);
+		printf(" %04X", buf[i]);
+	}
+	putchar('\n');
+	free(buf);
+
+	return 0;
+}
+
+static int ShHexdump(int argc, char *argv[]) {
+	uint32_t addr, len = 128, i, j;
+	uint8_t c;
+	u16 *buf;
+
+	if (ShNum(argv[1], &addr) || (argc > 2 && ShNum(argv[2], &len))) {
+		return 1;
+	}
+	if (!(buf = ShAllocRead(addr, len))) return 1;
+	for (i = 0; i < len; i += 8) {
+		printf("%06X: ", addr + i);
+		for (j = 0; j < 16; j++) {
+			if ((i<<1) + j < (len<<1)) printf("%02X ", ShByte(buf, (i<<1) + j));
+			else printf("   ");
+		}
+		putchar(' ');
+		for (j = 0; j < 16 && (i<<1) + j < (len<<1); j++) {
+			c = ShByte(buf, (i<<1) + j);
+			putchar(isprint(c) ? c : '.');
+		}
+		putchar('\n');
+	}
+	free(buf);
+
+	return 0;
+}
+
+static int ShDump(int argc, char *argv[]) {
+	uint32_t addr, len, i;
+	FILE *dump;
+	u16 *buf;
+
+	if (ShNum(argv[2], &addr) || ShNum(argv[3], &len)) return 1;
+	if (!(buf = ShAllocRead(addr, len))) return 1;
+	for (i = 0; i < len; i++) ByteSwapWord(buf[i]);
+	if (!(dump = fopen(argv[1], "wb"))) {
+		perror(argv[1]);
+		free(buf);
+		return 1;
+	}
+	if (fwrite(buf, len<<1, 1, dump) != 1) perror(argv[1]);
+	else printf("Wrote file %s.\n", argv[1]);
+	fclose(dump);
+	free(buf);
+
+	return 0;
+}
+
+// Parses a search pattern: a quoted string or hex bytes (e.g. 4D 45).
+static int ShPattern(int argc, char *argv[], uint8_t *pat, uint32_t *len) {
+	uint32_t val;
+	size_t n;
+	int i;
+	char *endPtr;
+
+	*len = 0;
+	if ('"' == argv[0][0]) {
+		n = strlen(argv[0]);
+		if (n < 3 || argv[0][n - 1] != '"' || n - 2 > SH_LINE_MAX) return 1;
+		memcpy(pat, argv[0] + 1, n - 2);
+		*len = n - 2;
+		return 0;
+	}
+	for (i = 0; i < argc; i++) {
+		val = strtoul(argv[i], &endPtr, 16);
+		if (!argv[i][0] || *endPtr || val > 0xFF) return 1;
+		pat[(*len)++] = val;
+	}
+	return 0;
+}
+
+static int ShSearch(int argc, char *argv[]) {
+	uint32_t addr, len, patLen, i, j, found = 0;
+	uint8_t pat[SH_LINE_MAX];
+	u16 *buf;
+
+	if (ShNum(argv[1], &addr) || ShNum(argv[2], &len)) return 1;
+	if (ShPattern(argc - 3, argv + 3, pat, &patLen) || !patLen) {
+		PrintErr("Invalid search pattern!\n");
+		return 1;
+	}
+	if (!(buf = ShAllocRead(addr, len))) return 1;
+	for (i = 0; i + patLen <= (len<<1); i++) {
+		for (j = 0; j < patLen && ShByte(buf, i + j) == pat[j]; j++);
+		if (j < patLen) continue;
+		if (found++ < SH_MATCH_MAX) {
+			printf("Found at 0x%06X%s\n", addr + (i>>1),
+					(i & 1) ? " (odd byte)" : "");
+		}
+	}
+	if (found > SH_MATCH_MAX) printf("... %u more\n", found - SH_MATCH_MAX);
+	printf("%u match(es).\n", found);
+	free(buf);
+
+	return 0;
+}
+
+static int ShCompare(int argc, char *argv[]) {
+	MemImage m = {argv[1], 0, 0};
+	RomImg img;
+	uint32_t i, start, diffs = 0, words = 0;
+	u16 *buf;
+
+	if (ParseMemArgument(&m)) {
+		PrintErr("Invalid file argument: %s\n", argv[1]);
+		return 1;
+	}
+	if (RomImgLoad(&img, &m)) {
+		RomImgFree(&img);
+		return 1;
+	}
+	if (!(buf = ShAllocRead(m.addr, m.len))) {
+		RomImgFree(&img);
+		return 1;
+	}
+	for (i = 0; i < m.len;) {
+		if (buf[i] == img.buf[i]) {
+			i++;
+			continue;
+		}
+		for (start = i; i < m.len && buf[i] != img.buf[i]; i++);
+		words += i - start;
+		if (diffs++ < SH_DIFF_MAX) {
+			printf("Differs at 0x%06X:%X (cart 0x%04X, file 0x%04X)\n",
+					m.addr + start, i - start, buf[start], img.buf[start]);
+		}
+	}
+	if (diffs > SH_DIFF_MAX) printf("... %u more\n", diffs - SH_DIFF_MAX);
+	if (diffs) printf("%u word(s) differ in %u range(s).\n", words, diffs);
+	else printf("Cart matches %s.\n", m.file);
+	free(buf);
+	RomImgFree(&img);
+
+	return 0;
+}
+
+static int ShPoke(int argc, char *argv[]) {
+	uint32_t addr, val;
+	ShPage *pg;
+	int i;
+
+	if (ShNum(argv[1], &addr)) return 1;
+	for (i = 2; i < argc; i++, addr++) {
+		if (ShNum(argv[i], &val)) return 1;
+		if (!(pg = ShPageGet(addr))) return 1;
+		if (!pg->orig) {
+			if (!(pg->orig = (u16*)malloc(MDMA_SECT_LEN<<1))) {
+				perror("Allocating page RAM");
+				return 1;
+			}
+			memcpy(pg->orig, pg->data, MDMA_SECT_LEN<<1);
+		}
+		pg->data[addr - pg->addr] = val;
+	}
+	return 0;
+}
+
+// Programs the staged writes of a page, erasing the sector only if any
+// bit must change from 0 to 1.
+static int ShPageCommit(ShPage *pg) {
+	uint32_t first, last, i;
+	int erase = FALSE;
+
+	for (first = 0; first < MDMA_SECT_LEN &&
+			pg->data[first] == pg->orig[first]; first++);
+	if (first == MDMA_SECT_LEN) goto done;
+	for (last = first, i = first; i < MDMA_SECT_LEN; i++) {
+		if (pg->data[i] == pg->orig[i]) continue;
+		last = i;
+		if ((pg->orig[i] & pg->data[i]) != pg->data[i]) erase = TRUE;
+	}
+	if (erase) {
+		// The whole sector must be programmed again
+		first = 0;
+		for (last = MDMA_SECT_LEN - 1; last && pg->data[last] == 0xFFFF;
+				last--);
+		if (MdmaRangeErase(pg->addr, MDMA_SECT_LEN, 0)) {
+			PrintErr("Couldn't erase sector 0x%06X!\n", pg->addr);
+			return -1;
+		}
+	}
+	if (MDMA_write(last - first + 1, pg->addr + first, pg->data + first)) {
+		PrintErr("Couldn't write sector 0x%06X!\n", pg->addr);
+		// Sector contents are unknown now
+		if (erase) memset(pg->orig, 0xFF, MDMA_SECT_LEN<<1);
+		return -1;
+	}
+	printf("Sector 0x%06X: %s 0x%06X:%X.\n", pg->addr,
+			erase ? "erased and programmed" : "programmed",
+			pg->addr + first, last - first + 1);
+done:
+	free(pg->orig);
+	pg->orig = NULL;
+
+	return 0;
+}
+
+static int ShCommit(int argc, char *argv[]) {
+	int i, err = 0;
+
+	for (i = 0; i < SH_PAGES; i++) {
+		if (sh.page[i].orig && ShPageCommit(&sh.page[i])) err = 1;
+	}
+	return err;
+}
+
+// Drops staged writes, returning the number of pages affected.
+static int ShDiscardAll(void) {
+	int i, n = 0;
+
+	for (i = 0; i < SH_PAGES; i++) {
+		if (!sh.page[i].orig) continue;
+		memcpy(sh.page[i].data, sh.page[i].orig, MDMA_SECT_LEN<<1);
+		free(sh.page[i].orig);
+		sh.page[i].orig = NULL;
+		n++;
+	}
+	return n;
+}
+
+static int ShDiscard(int argc, char *argv[]) {
+	printf("Discarded staged writes in %d sector(s).\n", ShDiscardAll());
+	return 0;
+}
+
+static int ShFlush(int argc, char *argv[]) {
+	int i;
+
+	for (i = 0; i < SH_PAGES; i++) {
+		if (!sh.page[i].orig) sh.page[i].addr = UINT32_MAX;
+	}
+	return 0;
+}
+
+static int ShStatus(int argc, char *argv[]) {
+	int i, cached = 0;
+
+	for (i = 0; i < SH_PAGES; i++) {
+		if (UINT32_MAX == sh.page[i].addr) continue;
+		cached++;
+		if (sh.page[i].orig) {
+			printf("Sector 0x%06X has staged writes.\n", sh.page[i].addr);
+		}
+	}
+	printf("%d/%d page(s) cached, %u hit(s), %u miss(es).\n", cached,
+			SH_PAGES, sh.hits, sh.misses);
+	return 0;
+}
+
+static int ShHelp(int argc, char *argv[]);
+
+/// Supported commands
+static const ShCmd shCmd[] = {
+	{"peek",    1, ShPeek,    "addr [len]: print words"},
+	{"hexdump", 1, ShHexdump, "addr [len]: print words as hex and text"},
+	{"dump",    3, ShDump,    "file addr len: write words to a file"},
+	{"search",  3, ShSearch,
+		"addr len pattern: find \"text\" or hex bytes (e.g. 53 45 47 41)"},
+	{"compare", 1, ShCompare,
+		"file[:addr[:len]]: compare a ROM file against the cart"},
+	{"poke",    2, ShPoke,    "addr word [word...]: stage words to write"},
+	{"commit",  0, ShCommit,  ": program staged writes to the cart"},
+	{"discard", 0, ShDiscard, ": drop staged writes"},
+	{"flush",   0, ShFlush,   ": drop cached pages without staged writes"},
+	{"status",  0, ShStatus,  ": show cache status and staged writes"},
+	{"help",    0, ShHelp,    ": show this help"},
+	{"quit",    0, NULL,      ": exit the shell"},
+	{NULL,      0, NULL,      NULL}
+};
+
+static int ShHelp(int argc, char *argv[]) {
+	int i;
+
+	printf("Addresses and lengths are in words. Commands:\n");
+	for (i = 0; shCmd[i].name; i++) {
+		printf(" %s%s%s.\n", shCmd[i].name,
+				':' == shCmd[i].usage[0] ? "" : " ", shCmd[i].usage);
+	}
+	return 0;
+}
+
+// Splits a line in arguments. Quoted arguments keep their quotes.
+static int ShSplit(char *line, char *argv[]) {
+	int argc = 0;
+
+	while (*line) {
+		while (isspace((unsigned char)*line)) *line++ = '\0';
+		if (!*line) break;
+		if (SH_ARGS_MAX == argc) return -1;
+		argv[argc++] = line;
+		if ('"' == *line) {
+			for (line++; *line && *line != '"'; line++);
+			if (*line) line++;
+		}
+		while (*line && !isspace((unsigned char)*line)) line++;
+	}
+	return argc;
+}
+
+int ShRun(FILE *in) {
+	char line[SH_LINE_MAX];
+	char *argv[SH_ARGS_MAX];
+	int argc, i, err = 0;
+
+	memset(&sh, 0, sizeof(ShState));
+	for (i = 0; i < SH_PAGES; i++) sh.page[i].addr = UINT32_MAX;
+#ifndef __OS_WIN
+	// Show the cursor, hidden for progress bar drawing
+	printf("\e[?25h");
+#endif
+	printf("MDMA shell, type help for a list of commands.\n");
+
+	while (1) {
+		printf("mdma> ");
+		fflush(stdout);
+		if (!fgets(line, SH_LINE_MAX, in)) {
+			putchar('\n');
+			break;
+		}
+		if ((argc = ShSplit(line, argv)) <= 0) {
+			if (argc < 0) PrintErr("Too many arguments!\n");
+			continue;
+		}
+		for (i = 0; shCmd[i].name && strcmp(argv[0], shCmd[i].name); i++);
+		if (!shCmd[i].name) {
+			PrintErr("Unknown command %s, type help for a list.\n", argv[0]);
+			err = 1;
+			continue;
+		}
+		if (!shCmd[i].func) break;
+		if (argc - 1 < shCmd[i].minArgs) {
+			PrintErr("Usage: %s %s.\n", shCmd[i].name,
+					shCmd[i].usage);
+			err = 1;
+			continue;
+		}
+		if (shCmd[i].func(argc, argv)) err = 1;
+	}
+
+	if ((i = ShDiscardAll())) {
+		PrintErr("Warning: staged writes in %d sector(s) not committed!\n", i);
+	}
+	for (i = 0; i < SH_PAGES; i++) MDMA_BufFree(sh.page[i].data);
+
+	return err;
+}
+
@@ -0,0 +1,59 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Interactive cart memory shell.
+ *
+ * \defgroup shell shell
+ * \{
+ * \brief Interactive cart memory shell.
+ *
+ * Keeps the programmer session open and runs memory inspection commands
+ * (peek, hexdump, dump, search, compare) typed by the user. Reads go
+ * through a LRU cache of flash sector sized pages, so inspecting nearby
+ * addresses again does not cause USB traffic. Writes (poke) are staged
+ * in the cached pages, and programmed sector by sector on commit.
+ *
+ * Addresses and lengths are in words, as in the rest of the program.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _SHELL_H_
+#define _SHELL_H_
+
+#include <stdio.h>
+
+/// Number of pages in the read cache
+#define SH_PAGES		16
+/// Maximum number of arguments of a command
+#define SH_ARGS_MAX		32
+/// Maximum length of a command line
+#define SH_LINE_MAX		512
+/// Maximum number of search matches printed
+#define SH_MATCH_MAX	32
+/// Maximum number of differing ranges printed by compare
+#define SH_DIFF_MAX		32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Runs the shell, reading commands from in until EOF or the quit command.
+ * The programmer must be initialized.
+ *
+ * \param[in] in Stream to read commands from (e.g. stdin).
+ *
+ * \return 0 if all commands succeeded, 1 if any command failed.
+ ****************************************************************************/
+int ShRun(FILE *in);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_SHELL_H_*/
+
+/** \} */
+
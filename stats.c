@@ -0,0 +1,211 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Device command latency statistics.
+ *
+ * Values below 2 * STATS_SUB_BUCKETS us have a bucket each. Above them,
+ * each power of 2 range is split in STATS_SUB_BUCKETS buckets, indexed by
+ * the STATS_SUB_BITS bits following the most significant bit set.
+ * Histograms are updated under a lock, so several I/O threads (e.g. when
+ * copying between two programmers) can record at the same time.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "commands.h"
+
+int statsOn = FALSE;
+
+/// Histograms of each opcode and phase
+static StatsHist hist[STATS_OP_MAX][STATS_PHASES];
+/// Protects the histograms
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+/// Time recording was enabled
+static uint64_t statsStart;
+
+/// Opcode names, as reported to the user
+static const char * const opName[STATS_OP_MAX] = {
+	"OK", "MANID_GET", "DEVID_GET", "READ", "CART_ERASE", "SECT_ERASE",
+	"WRITE", "MAN_CTRL", "BOOTLOADER", "BUTTON_GET", "WIFI_CMD",
+	"WIFI_CMD_LONG", "WIFI_CTRL", "RANGE_ERASE", "WRITE_RLE", "UNKNOWN"
+};
+
+/// Phase names, as reported to the user
+static const char * const phaseName[STATS_PHASES] = {
+	"send", "reply", "payload"
+};
+
+/// Obtains the bucket of a latency
+static unsigned int StatsBucket(uint64_t us) {
+	unsigned int shift;
+
+	if (us < 2 * STATS_SUB_BUCKETS) return us;
+	shift = 63 - __builtin_clzll(us) - STATS_SUB_BITS;
+
+	return MIN(shift * STATS_SUB_BUCKETS + (us>>shift), STATS_BUCKETS - 1);
+}
+
+/// Obtains the latency in the middle of a bucket
+static uint64_t StatsBucketUs(unsigned int bucket) {
+	unsigned int shift;
+
+	if (bucket < 2 * STATS_SUB_BUCKETS) return bucket;
+	shift = bucket / STATS_SUB_BUCKETS - 1;
+
+	return ((uint64_t)(bucket % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS) <<
+			shift) + ((1ULL<<shift)>>1);
+}
+
+void StatsEnable(int enable) {
+	pthread_mutex_lock(&statsLock);
+	if (enable && !statsOn) {
+		memset(hist, 0, sizeof(hist));
+		statsStart = MonoUs();
+	}
+	statsOn = enable;
+	pthread_mutex_unlock(&statsLock);
+}
+
+void StatsAdd(uint8_t op, StatsPhase phase, uint64_t start, uint32_t bytes) {
+	uint64_t us;
+	StatsHist *h;
+
+	if (!statsOn || !start || op >= STATS_OP_MAX) return;
+	us = MonoUs() - start;
+	h = &hist[op][phase];
+
+	pthread_mutex_lock(&statsLock);
+	if (!h->n || us < h->minUs) h->minUs = us;
+	if (us > h->maxUs) h->maxUs = us;
+	h->count[StatsBucket(us)]++;
+	h->n++;
+	h->totalUs += us;
+	h->bytes += bytes;
+	pthread_mutex_unlock(&statsLock);
+}
+
+void StatsErr(uint8_t op, StatsPhase phase) {
+	if (!statsOn || op >= STATS_OP_MAX) return;
+
+	pthread_mutex_lock(&statsLock);
+	hist[op][phase].errors++;
+	pthread_mutex_unlock(&statsLock);
+}
+
+void StatsGet(uint8_t op, StatsPhase phase, StatsHist *copy) {
+	if (op >= STATS_OP_MAX) {
+		memset(copy, 0, sizeof(StatsHist));
+		return;
+	}
+	pthread_mutex_lock(&statsLock);
+	*copy = hist[op][phase];
+	pthread_mutex_unlock(&statsLock);
+}
+
+uint64_t StatsQuantile(const StatsHist *h, double q) {
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (!h->n) return 0;
+	rank = MAX((uint64_t)(q * h->n + 0.5), 1);
+	for (i = 0; i < STATS_BUCKETS - 1 && (seen += h->count[i]) < rank; i++);
+
+	return MIN(MAX(StatsBucketUs(i), h->minUs), h->maxUs);
+}
+
+uint64_t StatsCountBelow(const StatsHist *h, uint64_t us) {
+	uint64_t n = 0;
+	unsigned int i;
+
+	if (us >= h->maxUs) return h->n;
+	for (i = 0; i < STATS_BUCKETS && StatsBucketUs(i) <= us; i++) {
+		n += h->count[i];
+	}
+
+	return n;
+}
+
+const char *StatsOpName(uint8_t op) {
+	return opName[MIN(op, STATS_OP_MAX - 1)];
+}
+
+const char *StatsPhaseName(StatsPhase phase) {
+	return phaseName[phase];
+}
+
+/// Formats a latency using 7 characters at most, e.g. 123us, 1.23ms, 12.3s
+static const char *StatsFmt(char *str, uint64_t us) {
+	if (us < 1000) sprintf(str, "%uus", (unsigned int)us);
+	else if (us < 10000) sprintf(str, "%.2fms", us / 1e3);
+	else if (us < 1000000) sprintf(str, "%.1fms", us / 1e3);
+	else if (us < 100000000) sprintf(str, "%.2fs", us / 1e6);
+	else sprintf(str, "%.0fs", us / 1e6);
+
+	return str;
+}
+
+void StatsPrint(void) {
+	StatsHist h;
+	uint64_t elapsed = MonoUs() - statsStart;
+	uint64_t phaseUs[STATS_PHASES] = {};
+	uint64_t inBytes = 0, inUs = 0, outBytes = 0, outUs = 0, busy;
+	uint64_t errors = 0;
+	unsigned int op, p;
+	int rows = 0;
+	char s[6][16];
+
+	printf("\nDevice command latencies:\n");
+	printf("%-13s %-7s %7s %8s %7s %7s %7s %7s %7s\n", "Command", "Phase",
+			"count", "total", "min", "p50", "p90", "p99", "max");
+	for (op = 0; op < STATS_OP_MAX; op++) {
+		for (p = 0; p < STATS_PHASES; p++) {
+			StatsGet(op, (StatsPhase)p, &h);
+			errors += h.errors;
+			if (!h.n) continue;
+			rows++;
+			phaseUs[p] += h.totalUs;
+			if (STATS_PAYLOAD == p && MDMA_READ == op) {
+				inBytes += h.bytes;
+				inUs += h.totalUs;
+			} else if (STATS_PAYLOAD == p) {
+				outBytes += h.bytes;
+				outUs += h.totalUs;
+			}
+			printf("%-13s %-7s %7llu %8s %7s %7s %7s %7s %7s\n",
+					StatsOpName(op), phaseName[p], (unsigned long long)h.n,
+					StatsFmt(s[0], h.totalUs), StatsFmt(s[1], h.minUs),
+					StatsFmt(s[2], StatsQuantile(&h, 0.5)),
+					StatsFmt(s[3], StatsQuantile(&h, 0.9)),
+					StatsFmt(s[4], StatsQuantile(&h, 0.99)),
+					StatsFmt(s[5], h.maxUs));
+		}
+	}
+	if (errors) printf("Failed USB transfers: %llu.\n",
+			(unsigned long long)errors);
+	if (!rows) {
+		printf("No device commands run by this process.\n");
+		return;
+	}
+
+	// Time not spent in device commands is spent by the host
+	busy = phaseUs[STATS_SEND] + phaseUs[STATS_REPLY] +
+		phaseUs[STATS_PAYLOAD];
+	elapsed = MAX(elapsed, 1);
+	printf("Elapsed %.2f s, in device commands %.1f%% (send %.1f%%, reply "
+			"%.1f%%, payload %.1f%%).\n", elapsed / 1e6, 100.0 * busy /
+			elapsed, 100.0 * phaseUs[STATS_SEND] / elapsed,
+			100.0 * phaseUs[STATS_REPLY] / elapsed,
+			100.0 * phaseUs[STATS_PAYLOAD] / elapsed);
+	if (inUs || outUs) {
+		printf("Payload throughput: in %.2f MiB/s, out %.2f MiB/s.\n",
+				inUs ? inBytes / 1.048576 / inUs : 0.0,
+				outUs ? outBytes / 1.048576 / outUs : 0.0);
+	}
+}
+
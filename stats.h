@@ -0,0 +1,164 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Device command latency statistics.
+ *
+ * \defgroup stats stats
+ * \{
+ * \brief Device command latency statistics.
+ *
+ * The commands module times each phase of the device commands: sending the
+ * command frame, waiting for the device reply and transferring the data
+ * payload. Latencies are kept in HDR style histograms per command opcode
+ * and phase, with logarithmic buckets split in STATS_SUB_BUCKETS linear
+ * sub-buckets, so percentiles are accurate to 1 / STATS_SUB_BUCKETS
+ * (6.25%) from 1 us to hours, using a fixed amount of memory.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include "util.h"
+
+/// Number of opcodes with statistics (opcodes above are not recorded)
+#define STATS_OP_MAX		16
+
+/// log2 of the number of linear sub-buckets of each power of 2 range
+#define STATS_SUB_BITS		4
+/// Number of linear sub-buckets of each power of 2 range
+#define STATS_SUB_BUCKETS	(1<<STATS_SUB_BITS)
+/// Histogram buckets, covering latencies up to 2^40 us
+#define STATS_BUCKETS		(40 * STATS_SUB_BUCKETS)
+
+/// Device command phases
+typedef enum {
+	STATS_SEND = 0,		///< Command frame sent to the device.
+	STATS_REPLY,		///< Wait for the device reply frame.
+	STATS_PAYLOAD,		///< Data payload transfer (in or out).
+	STATS_PHASES
+} StatsPhase;
+
+/************************************************************************//**
+ * Latency histogram of a command phase.
+ ****************************************************************************/
+typedef struct {
+	uint32_t count[STATS_BUCKETS];	///< Samples in each bucket.
+	uint64_t n;						///< Number of samples.
+	uint64_t totalUs;				///< Sum of the sample latencies.
+	uint64_t bytes;					///< Bytes transferred.
+	uint64_t minUs;					///< Minimum latency.
+	uint64_t maxUs;					///< Maximum latency.
+	uint64_t errors;				///< Failed transfers.
+} StatsHist;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Statistics are recorded only while enabled
+extern int statsOn;
+
+/************************************************************************//**
+ * Enables or disables recording. Enabling it clears the statistics.
+ *
+ * \param[in] enable TRUE to record statistics, FALSE to stop recording.
+ ****************************************************************************/
+void StatsEnable(int enable);
+
+/************************************************************************//**
+ * Obtains the start time of a phase.
+ *
+ * \return Monotonic time in microseconds, or 0 if not recording.
+ ****************************************************************************/
+static inline uint64_t StatsStart(void) {
+	return statsOn ? MonoUs() : 0;
+}
+
+/************************************************************************//**
+ * Records a phase that started at the time returned by StatsStart(). Can
+ * be called from any thread.
+ *
+ * \param[in] op    Command opcode.
+ * \param[in] phase Command phase.
+ * \param[in] start Phase start time, as returned by StatsStart().
+ * \param[in] bytes Bytes transferred during the phase.
+ ****************************************************************************/
+void StatsAdd(uint8_t op, StatsPhase phase, uint64_t start, uint32_t bytes);
+
+/************************************************************************//**
+ * Records a failed transfer during a command phase. Can be called from any
+ * thread.
+ *
+ * \param[in] op    Command opcode.
+ * \param[in] phase Command phase.
+ ****************************************************************************/
+void StatsErr(uint8_t op, StatsPhase phase);
+
+/************************************************************************//**
+ * Copies the histogram of a command phase.
+ *
+ * \param[in]  op    Command opcode.
+ * \param[in]  phase Command phase.
+ * \param[out] hist  Histogram copy.
+ ****************************************************************************/
+void StatsGet(uint8_t op, StatsPhase phase, StatsHist *hist);
+
+/************************************************************************//**
+ * Obtains a latency quantile from a histogram.
+ *
+ * \param[in] hist Histogram.
+ * \param[in] q    Quantile, from 0 to 1.
+ *
+ * \return Latency in microseconds (the middle of its bucket), 0 if the
+ * histogram is empty.
+ ****************************************************************************/
+uint64_t StatsQuantile(const StatsHist *hist, double q);
+
+/************************************************************************//**
+ * Obtains the number of samples of a histogram not above a latency.
+ * Samples in the bucket holding the latency are counted if the bucket
+ * middle is not above it.
+ *
+ * \param[in] hist Histogram.
+ * \param[in] us   Latency in microseconds.
+ *
+ * \return The number of samples.
+ ****************************************************************************/
+uint64_t StatsCountBelow(const StatsHist *hist, uint64_t us);
+
+/************************************************************************//**
+ * Obtains the name of a command opcode.
+ *
+ * \param[in] op Command opcode.
+ *
+ * \return The opcode name.
+ ****************************************************************************/
+const char *StatsOpName(uint8_t op);
+
+/************************************************************************//**
+ * Obtains the name of a command phase.
+ *
+ * \param[in] phase Command phase.
+ *
+ * \return The phase name.
+ ****************************************************************************/
+const char *StatsPhaseName(StatsPhase phase);
+
+/************************************************************************//**
+ * Prints the latency percentiles of each recorded command phase, and the
+ * share of the elapsed time the device spent in each phase.
+ ****************************************************************************/
+void StatsPrint(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_STATS_H_*/
+
+/** \} */
+
@@ -0,0 +1,134 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Host side test of the MDMA_WRITE_RLE payload encoding.
+ *
+ * Encodes several payloads with RleEncode(), decodes them back with a
+ * stand-in of the firmware decoder and checks the result matches the
+ * input. Build and run with "make -f Makefile-no-qt check".
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../rle.h"
+
+/// Longest payload, in words
+#define TEST_LEN_MAX	UINT16_MAX
+
+/// Number of failed checks
+static int fails;
+
+// Reads a little-endian word, as the firmware does
+static u16 WordGet(const void *src) {
+	const u8 *b = (const u8*)src;
+
+	return b[0] | (b[1]<<8);
+}
+
+// Firmware decoder stand-in. Returns the decoded length in words, or -1 if
+// the payload is malformed or decodes to more than max words.
+static int RleDecode(const u16 *enc, u16 encLen, u16 *dec, u16 max) {
+	uint32_t i = 0, o = 0;
+	u16 hdr, count;
+
+	while (i < encLen) {
+		hdr = WordGet(enc + i++);
+		count = hdr & MDMA_RLE_COUNT_MAX;
+		if (!count) return -1;
+		if (hdr & MDMA_RLE_RUN) {
+			if (i >= encLen || o + count > max) return -1;
+			while (count--) dec[o++] = enc[i];
+			i++;
+		} else {
+			if (i + count > encLen || o + count > max) return -1;
+			memcpy(dec + o, enc + i, count * sizeof(u16));
+			i += count;
+			o += count;
+		}
+	}
+
+	return o;
+}
+
+// Encodes and decodes data. If compressible, the encoded payload must be
+// shorter and decode back to data, otherwise RleEncode() must return 0.
+static void Check(const char *name, const u16 *data, u16 wLen,
+		int compressible) {
+	static u16 enc[TEST_LEN_MAX];
+	static u16 dec[TEST_LEN_MAX];
+	u8 frame[8] = {0};
+	u16 encLen;
+	int decLen;
+
+	encLen = RleEncode(data, wLen, enc);
+	if (!compressible) {
+		if (encLen) {
+			printf("FAIL %s: %u words encoded to %u\n", name, wLen, encLen);
+			fails++;
+		} else {
+			printf("ok   %s: not encoded\n", name);
+		}
+		return;
+	}
+	if (!encLen || encLen >= wLen) {
+		printf("FAIL %s: %u words encoded to %u\n", name, wLen, encLen);
+		fails++;
+		return;
+	}
+	decLen = RleDecode(enc, encLen, dec, wLen);
+	if (decLen != wLen || memcmp(dec, data, wLen * sizeof(u16))) {
+		printf("FAIL %s: decoded data does not match\n", name);
+		fails++;
+		return;
+	}
+	RleFrameFill(frame, wLen, encLen, 0x123456);
+	if (WordGet(frame + 1) != wLen || WordGet(frame + 6) != encLen ||
+			frame[3] != 0x56 || frame[4] != 0x34 || frame[5] != 0x12) {
+		printf("FAIL %s: bad command frame\n", name);
+		fails++;
+		return;
+	}
+	printf("ok   %s: %u words encoded to %u\n", name, wLen, encLen);
+}
+
+int main(void) {
+	static u16 data[TEST_LEN_MAX];
+	uint32_t i;
+
+	// Short runs mixed with literals
+	for (i = 0; i < 1024; i++) data[i] = (i % 16) < 10 ? 0x4E71 : i;
+	Check("runs", data, 1024, 1);
+
+	// Runs longer than a block, and run shorter than MDMA_RLE_RUN_MIN
+	for (i = 0; i < 40000; i++) data[i] = 0x0000;
+	data[40000] = data[40001] = 0x1234;
+	for (i = 40002; i < 50000; i++) data[i] = 0xA55A;
+	Check("long runs", data, 50000, 1);
+
+	// Literal block longer than MDMA_RLE_COUNT_MAX, followed by a run
+	for (i = 0; i < 0x8100; i++) data[i] = i;
+	for (; i < TEST_LEN_MAX; i++) data[i] = 0xFFFF;
+	Check("long literal", data, TEST_LEN_MAX, 1);
+
+	// Erased flash padding
+	for (i = 0; i < TEST_LEN_MAX; i++) data[i] = 0xFFFF;
+	Check("all 0xFFFF chunk", data, 256, 1);
+	Check("all 0xFFFF max", data, TEST_LEN_MAX, 1);
+
+	// Not compressible
+	for (i = 0; i < TEST_LEN_MAX; i++) data[i] = i * 40503;
+	Check("incompressible chunk", data, 256, 0);
+	Check("incompressible max", data, TEST_LEN_MAX, 0);
+	Check("single word", data, 1, 0);
+	Check("empty", data, 0, 0);
+
+	if (fails) printf("%d checks failed\n", fails);
+
+	return fails ? 1 : 0;
+}
+
@@ -0,0 +1,126 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Chrome trace of the device transfers and operations.
+ *
+ * Events are written as they end, using the JSON array format. The closing
+ * bracket is optional in this format, so the trace of a job killed before
+ * completing can still be loaded. Timestamps are relative to the trace
+ * start, and each thread gets a track id when it records its first event.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+int trcOn = FALSE;
+
+/// Trace file
+static FILE *trcOut;
+/// Trace start time (us)
+static uint64_t trcStart;
+/// Track ids given to threads
+static int trcTids;
+/// Serializes writes to the trace file
+static pthread_mutex_t trcLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Track id of the calling thread, 0 if not given yet
+static __thread int trcTid;
+/// Name of the calling thread, NULL for a default name
+static __thread const char *trcName;
+
+int TrcOpen(const char *file) {
+	if (!(trcOut = fopen(file, "w"))) {
+		perror(file);
+		return -1;
+	}
+	fputc('[', trcOut);
+	trcStart = MonoUs();
+	trcName = "main";
+	trcOn = TRUE;
+
+	return 0;
+}
+
+void TrcThreadName(const char *name) {
+	trcName = name;
+}
+
+// Gives a track id to the calling thread, naming its track. Must be
+// called with the lock held.
+static void TrcTidGet(void) {
+	trcTid = ++trcTids;
+	fprintf(trcOut, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"tid\":%d,\"args\":{\"name\":\"", 1 == trcTid ? "" : ",",
+			trcTid);
+	if (trcName) fprintf(trcOut, "%s\"}}", trcName);
+	else fprintf(trcOut, "thread %d\"}}", trcTid);
+}
+
+// Writes a complete event. args holds the event arguments, without braces.
+static void TrcWrite(const char *cat, const char *name, uint64_t start,
+		uint64_t end, const char *args) {
+	pthread_mutex_lock(&trcLock);
+	if (trcOut) {
+		if (!trcTid) TrcTidGet();
+		fprintf(trcOut, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+				"\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu,\"args\":{%s}}",
+				name, cat, trcTid, (unsigned long long)(start - trcStart),
+				(unsigned long long)(end - start), args);
+	}
+	pthread_mutex_unlock(&trcLock);
+}
+
+// Formats the address and length arguments, with a trailing comma
+static int TrcRange(char *args, uint32_t addr, uint32_t len) {
+	int n = 0;
+
+	if (TRC_NONE != addr) n += sprintf(args, "\"addr\":\"0x%06X\",", addr);
+	if (TRC_NONE != len) n += sprintf(args + n, "\"len\":%u,", len);
+
+	return n;
+}
+
+void TrcEvent(const char *cat, const char *name, uint64_t start,
+		uint32_t addr, uint32_t len, int result) {
+	uint64_t end = MonoUs();
+	char args[96];
+	int n;
+
+	if (!trcOn || !start) return;
+	n = TrcRange(args, addr, len);
+	sprintf(args + n, "\"result\":%d", result);
+	TrcWrite(cat, name, start, end, args);
+}
+
+void TrcXfer(uint8_t op, StatsPhase phase, uint64_t start, uint32_t addr,
+		uint32_t len, uint32_t bytes, int result) {
+	uint64_t end = MonoUs();
+	// Event name, e.g.: WRITE_RLE payload
+	char name[32];
+	char args[128];
+	int n;
+
+	if (!trcOn || !start) return;
+	sprintf(name, "%s %s", StatsOpName(op), StatsPhaseName(phase));
+	n = sprintf(args, "\"op\":\"%s\",", StatsOpName(op));
+	n += TrcRange(args + n, addr, len);
+	sprintf(args + n, "\"bytes\":%u,\"result\":%d", bytes, result);
+	TrcWrite("usb", name, start, end, args);
+}
+
+void TrcClose(void) {
+	if (!trcOn) return;
+
+	pthread_mutex_lock(&trcLock);
+	trcOn = FALSE;
+	fprintf(trcOut, "\n]\n");
+	fclose(trcOut);
+	trcOut = NULL;
+	pthread_mutex_unlock(&trcLock);
+}
+
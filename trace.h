@@ -0,0 +1,110 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Chrome trace of the device transfers and operations.
+ *
+ * \defgroup trace trace
+ * \{
+ * \brief Chrome trace of the device transfers and operations.
+ *
+ * Records each USB bulk transfer (command frame, reply and payload), and
+ * the higher level operations built on them (ranges read and written,
+ * erases, flash jobs, WiFi module commands), as complete events of the
+ * Chrome trace event format. The trace file can be opened with Perfetto
+ * (https://ui.perfetto.dev) or chrome://tracing, showing each thread on its
+ * own track, so gaps where the host keeps the device idle stand out.
+ *
+ * Event functions do nothing if no trace is being recorded. To keep the
+ * cost of the disabled trace low, callers obtain the event start time with
+ * TrcStart(), that returns 0 when not recording.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include "stats.h"
+#include "util.h"
+
+/// Event address or length not known
+#define TRC_NONE	UINT32_MAX
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Events are recorded only while the trace is open
+extern int trcOn;
+
+/************************************************************************//**
+ * Creates the trace file and starts recording events. The calling thread
+ * is named "main".
+ *
+ * \param[in] file Trace file path.
+ *
+ * \return 0 if OK, -1 if the file could not be created.
+ ****************************************************************************/
+int TrcOpen(const char *file);
+
+/************************************************************************//**
+ * Obtains the start time of an event.
+ *
+ * \return Monotonic time in microseconds, or 0 if not recording.
+ ****************************************************************************/
+static inline uint64_t TrcStart(void) {
+	return trcOn ? MonoUs() : 0;
+}
+
+/************************************************************************//**
+ * Names the track of the calling thread. Must be called before the thread
+ * records its first event.
+ *
+ * \param[in] name Thread name. Must be a string literal.
+ ****************************************************************************/
+void TrcThreadName(const char *name);
+
+/************************************************************************//**
+ * Records an operation that started at the time returned by TrcStart().
+ * Can be called from any thread.
+ *
+ * \param[in] cat    Event category (e.g. "mdma").
+ * \param[in] name   Operation name (e.g. "flash").
+ * \param[in] start  Operation start time, as returned by TrcStart().
+ * \param[in] addr   Address of the operation, TRC_NONE if not applicable.
+ * \param[in] len    Length of the operation, TRC_NONE if not applicable.
+ * \param[in] result Result of the operation (0 if OK).
+ ****************************************************************************/
+void TrcEvent(const char *cat, const char *name, uint64_t start,
+		uint32_t addr, uint32_t len, int result);
+
+/************************************************************************//**
+ * Records a USB bulk transfer that started at the time returned by
+ * TrcStart(). Can be called from any thread.
+ *
+ * \param[in] op     Opcode of the command the transfer belongs to.
+ * \param[in] phase  Command phase of the transfer.
+ * \param[in] start  Transfer start time, as returned by TrcStart().
+ * \param[in] addr   Word address of the command, TRC_NONE if none.
+ * \param[in] len    Length of the command, TRC_NONE if none.
+ * \param[in] bytes  Bytes transferred.
+ * \param[in] result libusb result of the transfer.
+ ****************************************************************************/
+void TrcXfer(uint8_t op, StatsPhase phase, uint64_t start, uint32_t addr,
+		uint32_t len, uint32_t bytes, int result);
+
+/************************************************************************//**
+ * Stops recording and completes the trace file.
+ ****************************************************************************/
+void TrcClose(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_TRACE_H_*/
+
+/** \} */
+
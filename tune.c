@@ -0,0 +1,343 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Transfer parameters tuner.
+ *
+ * Sweeps and stores the transfer parameters of each programmer, and
+ * adapts them to the live throughput.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "tune.h"
+#include "commands.h"
+#include "util.h"
+
+/// Number of elements of an array
+#define TN_ARRAY_LEN(a)	(sizeof(a) / sizeof((a)[0]))
+
+/// Read transfer lengths tested, in bytes
+static const uint32_t tnXfer[] = {64, 128, 256, 384, 512, 1024, 2048, 4096};
+/// Chunk lengths tested, in words
+static const uint32_t tnChunk[] = {2048, 4096, 8192, 16384, 32768};
+
+/// Adaptive tuner state for a transfer direction
+typedef struct {
+	const uint32_t *val;	///< Values to test.
+	int nVal;				///< Number of values to test.
+	int start;				///< Index of the starting value (-1 if unset).
+	int cur;				///< Index of the value being measured.
+	int best;				///< Index of the best value found.
+	int step;				///< Index increment of the next probe.
+	int flips;				///< Probe direction changes.
+	int settled;			///< Best value found, probing stopped.
+	double bestRate;		///< Throughput of the best value.
+	uint64_t lastUs;		///< Time of the previous chunk (0 if none).
+	uint64_t winUs;			///< Time measured in the current window.
+	uint32_t winWords;		///< Words transferred in the current window.
+	int winN;				///< Chunks in the current window.
+} TnAdapt;
+
+/// Adaptive tuner state for reads (transfer length) and writes (chunk)
+static TnAdapt tnAdapt[2] = {
+	{tnXfer,  TN_ARRAY_LEN(tnXfer),  -1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0},
+	{tnChunk, TN_ARRAY_LEN(tnChunk), -1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0}
+};
+
+void TnGet(TnCfg *cfg) {
+	cfg->xferLen = UsbXferLenGet();
+	cfg->rdChunk = MdmaChunkLenGet(MDMA_DIR_READ);
+	cfg->wrChunk = MdmaChunkLenGet(MDMA_DIR_WRITE);
+}
+
+void TnApply(const TnCfg *cfg) {
+	UsbXferLenSet(cfg->xferLen);
+	MdmaChunkLenSet(MDMA_DIR_READ, cfg->rdChunk);
+	MdmaChunkLenSet(MDMA_DIR_WRITE, cfg->wrChunk);
+}
+
+/// Obtains the configuration file path
+static int TnPath(char *path, size_t len) {
+	const char *env;
+
+	if ((env = getenv(TN_FILE_ENV))) {
+		snprintf(path, len, "%s", env);
+		return 0;
+	}
+#ifdef __OS_WIN
+	env = getenv("APPDATA");
+#else
+	env = getenv("HOME");
+#endif
+	if (!env) return -1;
+	snprintf(path, len, "%s/%s", env, TN_FILE);
+
+	return 0;
+}
+
+/// Obtains the key identifying the programmer: serial@firmware
+static int TnKey(char *key) {
+	char serial[TN_KEY_MAX - 6];
+	uint16_t bcdDevice;
+	int i;
+
+	if (UsbDevInfoGet(serial, sizeof(serial), &bcdDevice)) return -1;
+	for (i = 0; serial[i]; i++) {
+		if (!isgraph((unsigned char)serial[i]) || '@' == serial[i]) {
+			serial[i] = '_';
+		}
+	}
+	snprintf(key, TN_KEY_MAX, "%s@%04X", serial[0] ? serial : "noserial",
+			bcdDevice);
+
+	return 0;
+}
+
+int TnLoad(TnCfg *cfg) {
+	char path[MAX_FILELEN + 1];
+	char key[TN_KEY_MAX], fKey[TN_KEY_MAX];
+	char line[128];
+	unsigned int xfer, rdChunk, wrChunk;
+	FILE *f;
+	int err = 1;
+
+	if (TnPath(path, sizeof(path)) || TnKey(key)) return -1;
+	if (!(f = fopen(path, "r"))) return 1;
+	while (err && fgets(line, sizeof(line), f)) {
+		if ((sscanf(line, "%63s %u %u %u", fKey, &xfer, &rdChunk,
+						&wrChunk) != 4) || strcmp(key, fKey)) continue;
+		cfg->xferLen = xfer;
+		cfg->rdChunk = rdChunk;
+		cfg->wrChunk = wrChunk;
+		err = 0;
+	}
+	fclose(f);
+
+	return err;
+}
+
+int TnSave(const TnCfg *cfg) {
+	char path[MAX_FILELEN + 1], tmp[MAX_FILELEN + 5];
+	char key[TN_KEY_MAX], fKey[TN_KEY_MAX];
+	char line[128];
+	FILE *in, *out;
+
+	if (TnPath(path, sizeof(path)) || TnKey(key)) {
+		PrintErr("Error: could not obtain tuner configuration file\n");
+		return -1;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(out = fopen(tmp, "w"))) {
+		perror(tmp);
+		return -1;
+	}
+	// Keep the entries of other programmers
+	if ((in = fopen(path, "r"))) {
+		while (fgets(line, sizeof(line), in)) {
+			if ((sscanf(line, "%63s", fKey) == 1) && !strcmp(key, fKey)) {
+				continue;
+			}
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s %u %u %u\n", key, cfg->xferLen, cfg->rdChunk,
+			cfg->wrChunk);
+	if (fclose(out)) {
+		perror(tmp);
+		remove(tmp);
+		return -1;
+	}
+#ifdef __OS_WIN
+	remove(path);
+#endif
+	if (rename(tmp, path)) {
+		perror(path);
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/// Transfers a buffer in chunks. Returns elapsed microseconds, 0 on error
+static uint64_t TnTransfer(uint32_t addr, uint32_t len, u16 *buf,
+		uint32_t chunk, MdmaDir dir) {
+	uint64_t start = MonoUs();
+	uint32_t i;
+	u16 step;
+	u16 err;
+
+	for (i = 0; i < len; i += step) {
+		step = MIN(chunk, len - i);
+		err = (MDMA_DIR_WRITE == dir) ?
+			MDMA_write(step, addr + i, buf + i) :
+			MDMA_read(step, addr + i, buf + i);
+		if (err) return 0;
+	}
+
+	return MAX(MonoUs() - start, 1);
+}
+
+/// Throughput in KiB/s
+static inline double TnRate(uint32_t len, uint64_t us) {
+	return (len<<1) * 1000000.0 / 1024 / us;
+}
+
+int TnSweep(uint32_t addr, uint32_t len, TnCfg *best) {
+	u16 *wrBuf, *rdBuf;
+	uint64_t us, bestUs;
+	double rate, bestWr = 0, bestRd = 0;
+	uint32_t i, x, c, seed = 0x1D872B41;
+	int err = -1;
+
+	// Parameters restored on error
+	TnGet(best);
+	wrBuf = MDMA_BufAlloc(len);
+	rdBuf = MDMA_BufAlloc(len);
+	if (!wrBuf || !rdBuf) {
+		perror("Allocating tuner buffer RAM");
+		goto out;
+	}
+	// Pseudo-random data, so compression or fill tricks do not help
+	for (i = 0; i < len; i++) {
+		seed ^= seed<<13; seed ^= seed>>17; seed ^= seed<<5;
+		wrBuf[i] = seed;
+	}
+
+	printf("Tuning on range 0x%06X:%X...\n", addr, len);
+	for (c = 0; c < TN_ARRAY_LEN(tnChunk); c++) {
+		if (MdmaRangeErase(addr, len, 0)) {
+			PrintErr("Couldn't erase cart!\n");
+			goto out;
+		}
+		if (!(us = TnTransfer(addr, len, wrBuf, tnChunk[c],
+						MDMA_DIR_WRITE))) {
+			PrintErr("Couldn't write to cart!\n");
+			goto out;
+		}
+		rate = TnRate(len, us);
+		printf(" write chunk %5u words:             %8.1f KiB/s\n",
+				tnChunk[c], rate);
+		if (rate > bestWr) {
+			bestWr = rate;
+			best->wrChunk = tnChunk[c];
+		}
+	}
+	for (x = 0; x < TN_ARRAY_LEN(tnXfer); x++) {
+		UsbXferLenSet(tnXfer[x]);
+		for (c = 0; c < TN_ARRAY_LEN(tnChunk); c++) {
+			// Best of two reads, to filter out scheduling hiccups
+			for (i = 0, bestUs = UINT64_MAX; i < 2; i++) {
+				memset(rdBuf, 0, len<<1);
+				if (!(us = TnTransfer(addr, len, rdBuf, tnChunk[c],
+								MDMA_DIR_READ)) ||
+						memcmp(rdBuf, wrBuf, len<<1)) break;
+				bestUs = MIN(bestUs, us);
+			}
+			if (i < 2) {
+				printf(" read xfer %4u, chunk %5u words: FAILED\n",
+						tnXfer[x], tnChunk[c]);
+				continue;
+			}
+			rate = TnRate(len, bestUs);
+			printf(" read xfer %4u, chunk %5u words: %8.1f KiB/s\n",
+					tnXfer[x], tnChunk[c], rate);
+			if (rate > bestRd) {
+				bestRd = rate;
+				best->xferLen = tnXfer[x];
+				best->rdChunk = tnChunk[c];
+			}
+		}
+	}
+	if (!bestRd) {
+		PrintErr("Error: no working read configuration found!\n");
+		goto out;
+	}
+	printf("Best: read xfer %u, read chunk %u, write chunk %u words.\n",
+			best->xferLen, best->rdChunk, best->wrChunk);
+	err = 0;
+
+out:
+	TnApply(best);
+	MDMA_BufFree(wrBuf);
+	MDMA_BufFree(rdBuf);
+
+	return err;
+}
+
+/// Sets the value being measured by the adaptive tuner
+static void TnAdaptSet(MdmaDir dir, const TnAdapt *st) {
+	if (MDMA_DIR_READ == dir) UsbXferLenSet(st->val[st->cur]);
+	else MdmaChunkLenSet(MDMA_DIR_WRITE, st->val[st->cur]);
+}
+
+/// Evaluates a measurement window and chooses the next value to measure
+static void TnAdaptStep(MdmaDir dir, TnAdapt *st, double rate) {
+	int next;
+
+	if (rate > st->bestRate * (100 + TN_ADAPT_GAIN) / 100) {
+		st->best = st->cur;
+		st->bestRate = rate;
+	} else if (st->cur != st->best) {
+		// Worse than the best value, probe in the other direction
+		st->flips++;
+		st->step = -st->step;
+	}
+	next = st->best + st->step;
+	if (next < 0 || next >= st->nVal) {
+		st->flips++;
+		st->step = -st->step;
+		next = st->best + st->step;
+	}
+	if (st->flips >= 2 || next < 0 || next >= st->nVal) {
+		st->settled = TRUE;
+		next = st->best;
+	}
+	st->cur = next;
+	TnAdaptSet(dir, st);
+}
+
+void TnAdaptHook(void *ctx, MdmaDir dir, uint32_t addr, const u16 *data,
+		uint32_t wLen) {
+	TnAdapt *st = &tnAdapt[dir];
+	uint64_t now = MonoUs();
+	uint32_t cur;
+	int i;
+
+	if (st->start < 0) {
+		// Start from the nearest value to the current one
+		cur = (MDMA_DIR_READ == dir) ? UsbXferLenGet() :
+			MdmaChunkLenGet(MDMA_DIR_WRITE);
+		for (i = 0; i < st->nVal - 1 && st->val[i] < cur; i++);
+		st->start = st->cur = st->best = i;
+		TnAdaptSet(dir, st);
+	}
+	// Chunks of the other direction break the measure
+	tnAdapt[!dir].lastUs = 0;
+	if (st->settled) return;
+	if (st->lastUs) {
+		st->winUs += now - st->lastUs;
+		st->winWords += wLen;
+		st->winN++;
+	}
+	st->lastUs = now;
+	if (st->winN < TN_ADAPT_WIN) return;
+
+	TnAdaptStep(dir, st, (double)st->winWords / MAX(st->winUs, 1));
+	st->winUs = 0;
+	st->winWords = 0;
+	st->winN = 0;
+}
+
+int TnAdaptChanged(void) {
+	return (tnAdapt[0].settled && tnAdapt[0].best != tnAdapt[0].start) ||
+		(tnAdapt[1].settled && tnAdapt[1].best != tnAdapt[1].start);
+}
+
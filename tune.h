@@ -0,0 +1,131 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Transfer parameters tuner.
+ *
+ * \defgroup tune tune
+ * \{
+ * \brief Transfer parameters tuner.
+ *
+ * The best read transfer length and read/write chunk lengths depend on the
+ * host controller, hubs and programmer firmware. This module sweeps these
+ * parameters measuring the throughput, stores the best configuration for
+ * each programmer (identified by its serial number and firmware version)
+ * in a configuration file, and applies it automatically on later runs.
+ *
+ * An adaptive mode re-tunes the read transfer length and the write chunk
+ * length while data is transferred, using the chunk hook of the mdma
+ * module to measure the live throughput.
+ *
+ * The configuration file is $HOME/.mdma_tune (%APPDATA%\\.mdma_tune on
+ * Windows), or the file in the MDMA_TUNE_FILE environment variable. Each
+ * line has the format:
+ * \verbatim
+   serial@firmware xfer_len read_chunk_len write_chunk_len
+   \endverbatim
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _TUNE_H_
+#define _TUNE_H_
+
+#include <stdint.h>
+#include "mdma.h"
+
+/// Configuration file name, in the home directory
+#define TN_FILE			".mdma_tune"
+/// Environment variable overriding the configuration file path
+#define TN_FILE_ENV		"MDMA_TUNE_FILE"
+/// Maximum length of the device key
+#define TN_KEY_MAX		64
+/// Chunks measured on each adaptive tuner step
+#define TN_ADAPT_WIN	4
+/// Minimum throughput gain to keep an adaptive tuner step, in percent
+#define TN_ADAPT_GAIN	2
+
+/************************************************************************//**
+ * Transfer parameters.
+ ****************************************************************************/
+typedef struct {
+	uint16_t xferLen;	///< Read transfer length in bytes.
+	uint32_t rdChunk;	///< Read chunk length in words.
+	uint32_t wrChunk;	///< Write chunk length in words.
+} TnCfg;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Obtains the current transfer parameters.
+ *
+ * \param[out] cfg Current parameters.
+ ****************************************************************************/
+void TnGet(TnCfg *cfg);
+
+/************************************************************************//**
+ * Sets the transfer parameters.
+ *
+ * \param[in] cfg Parameters to set.
+ ****************************************************************************/
+void TnApply(const TnCfg *cfg);
+
+/************************************************************************//**
+ * Loads the stored parameters of the attached programmer.
+ *
+ * \param[out] cfg Parameters read.
+ *
+ * \return 0 if parameters were found, non-zero otherwise.
+ ****************************************************************************/
+int TnLoad(TnCfg *cfg);
+
+/************************************************************************//**
+ * Stores the parameters of the attached programmer, replacing the
+ * previous ones.
+ *
+ * \param[in] cfg Parameters to store.
+ *
+ * \return 0 on success, non-zero on error.
+ ****************************************************************************/
+int TnSave(const TnCfg *cfg);
+
+/************************************************************************//**
+ * Sweeps the transfer parameters, measuring the write and read throughput
+ * over a flash range, and applies the best ones.
+ *
+ * \param[in]  addr Start word address of the range.
+ * \param[in]  len  Length of the range in words.
+ * \param[out] best Best parameters found.
+ *
+ * \return 0 on success, non-zero on error.
+ *
+ * \warning Destroys the contents of the range.
+ ****************************************************************************/
+int TnSweep(uint32_t addr, uint32_t len, TnCfg *best);
+
+/************************************************************************//**
+ * Chunk hook adapting the read transfer length and write chunk length to
+ * the live throughput. Install it calling MdmaChunkHookSet(TnAdaptHook,
+ * NULL).
+ ****************************************************************************/
+void TnAdaptHook(void *ctx, MdmaDir dir, uint32_t addr, const u16 *data,
+		uint32_t wLen);
+
+/************************************************************************//**
+ * Checks if the adaptive tuner found better parameters.
+ *
+ * \return TRUE if any parameter settled on a value different from the
+ * starting one.
+ ****************************************************************************/
+int TnAdaptChanged(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_TUNE_H_*/
+
+/** \} */
+
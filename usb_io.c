@@ -0,0 +1,228 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief USB I/O thread.
+ *
+ * Jobs are queued in a FIFO protected by a mutex. The I/O thread runs them
+ * in order, calls their completion callback and broadcasts the condition
+ * variable waited on by UioWait().
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "usb_io.h"
+#include "commands.h"
+#include "trace.h"
+
+struct Uio {
+	pthread_t thread;		///< I/O thread.
+	pthread_mutex_t lock;	///< Queue lock.
+	pthread_cond_t cond;	///< Queue and job state changes.
+	UioJob *head;			///< First job in the queue.
+	UioJob *tail;			///< Last job in the queue.
+	int stop;				///< Stop when the queue is empty.
+};
+
+/// I/O thread running the jobs of other threads
+static Uio *uioCur = NULL;
+/// I/O thread of the calling thread (NULL if not an I/O thread)
+static __thread Uio *uioSelf = NULL;
+/// Remote job handler
+static UioRemote uioRemote = NULL;
+
+/// Runs a job calling the commands module
+static int UioExec(UioJob *job) {
+	switch (job->type) {
+		case UIO_OPEN:
+			return UsbOpen(job->addr);
+
+		case UIO_CLOSE:
+			UsbClose();
+			return 0;
+
+		case UIO_DEV_INFO:
+			return UsbDevInfoGet((char*)job->data, job->len,
+					(uint16_t*)job->aux);
+
+		case UIO_MAN_ID:
+			return (int16_t)MDMA_manId_get((uint16_t*)job->data);
+
+		case UIO_DEV_ID:
+			return (int16_t)MDMA_devId_get((uint16_t*)job->data);
+
+		case UIO_READ:
+			return (int16_t)MDMA_read(job->len, job->addr, (u16*)job->data);
+
+		case UIO_WRITE:
+			return (int16_t)MDMA_write(job->len, job->addr, (u16*)job->data);
+
+		case UIO_ERASE:
+			return job->len ? MDMA_range_erase_start(job->addr, job->len) :
+				MDMA_cart_erase_start();
+
+		case UIO_SECT_ERASE:
+			return (int16_t)MDMA_sect_erase(job->addr);
+
+		case UIO_ERASE_POLL:
+			return MDMA_erase_poll(job->len);
+
+		case UIO_ERASE_CANCEL:
+			MDMA_erase_cancel();
+			return 0;
+
+		case UIO_BOOTLOADER:
+			return (int16_t)MDMA_bootloader();
+
+		case UIO_BUTTON:
+			return (int16_t)MDMA_button_get((uint8_t*)job->data);
+
+		case UIO_WIFI_CMD:
+			return MDMA_WiFiCmd((uint8_t*)job->data, job->len,
+					(uint8_t*)job->aux);
+
+		case UIO_WIFI_CMD_LONG:
+			return MDMA_WiFiCmdLong((uint8_t*)job->data, job->len,
+					(uint8_t*)job->aux);
+
+		case UIO_WIFI_CTRL:
+			return MDMA_WiFiCtrl((MdmaWifiCtrlCode)job->addr);
+
+		case UIO_BUF_ALLOC:
+			*(u16**)job->data = MDMA_BufAlloc(job->len);
+			return *(u16**)job->data ? 0 : -1;
+	}
+
+	return -1;
+}
+
+/// Runs a job and signals its completion
+static void UioComplete(Uio *uio, UioJob *job) {
+	job->result = UioExec(job);
+	if (job->done) job->done(job);
+	if (uio) pthread_mutex_lock(&uio->lock);
+	job->finished = TRUE;
+	if (uio) {
+		pthread_cond_broadcast(&uio->cond);
+		pthread_mutex_unlock(&uio->lock);
+	}
+}
+
+static void *UioThread(void *arg) {
+	Uio *uio = (Uio*)arg;
+	UioJob *job;
+
+	uioSelf = uio;
+	TrcThreadName("usb_io");
+	while (1) {
+		pthread_mutex_lock(&uio->lock);
+		while (!uio->head && !uio->stop) {
+			pthread_cond_wait(&uio->cond, &uio->lock);
+		}
+		if (!(job = uio->head)) {
+			pthread_mutex_unlock(&uio->lock);
+			break;
+		}
+		if (!(uio->head = job->next)) uio->tail = NULL;
+		pthread_mutex_unlock(&uio->lock);
+
+		UioComplete(uio, job);
+	}
+
+	return NULL;
+}
+
+Uio *UioNew(void) {
+	Uio *uio;
+
+	if (!(uio = (Uio*)calloc(1, sizeof(Uio)))) {
+		perror("Allocating USB I/O thread RAM");
+		return NULL;
+	}
+	pthread_mutex_init(&uio->lock, NULL);
+	pthread_cond_init(&uio->cond, NULL);
+	if (pthread_create(&uio->thread, NULL, UioThread, uio)) {
+		PrintErr("Error: could not start USB I/O thread\n");
+		pthread_mutex_destroy(&uio->lock);
+		pthread_cond_destroy(&uio->cond);
+		free(uio);
+		return NULL;
+	}
+	if (!uioCur) uioCur = uio;
+
+	return uio;
+}
+
+void UioFree(Uio *uio) {
+	if (!uio) return;
+
+	pthread_mutex_lock(&uio->lock);
+	uio->stop = TRUE;
+	pthread_cond_broadcast(&uio->cond);
+	pthread_mutex_unlock(&uio->lock);
+	pthread_join(uio->thread, NULL);
+	if (uioCur == uio) uioCur = NULL;
+	pthread_mutex_destroy(&uio->lock);
+	pthread_cond_destroy(&uio->cond);
+	free(uio);
+}
+
+Uio *UioGet(void) {
+	return uioCur;
+}
+
+void UioSet(Uio *uio) {
+	uioCur = uio;
+}
+
+void UioSubmit(Uio *uio, UioJob *job) {
+	job->uio = uio;
+	job->finished = FALSE;
+	job->next = NULL;
+	if (!uio) {
+		UioComplete(NULL, job);
+		return;
+	}
+
+	pthread_mutex_lock(&uio->lock);
+	if (uio->tail) uio->tail->next = job;
+	else uio->head = job;
+	uio->tail = job;
+	pthread_cond_broadcast(&uio->cond);
+	pthread_mutex_unlock(&uio->lock);
+}
+
+int UioWait(UioJob *job) {
+	Uio *uio = job->uio;
+
+	if (uio) {
+		pthread_mutex_lock(&uio->lock);
+		while (!job->finished) pthread_cond_wait(&uio->cond, &uio->lock);
+		pthread_mutex_unlock(&uio->lock);
+	}
+
+	return job->result;
+}
+
+void UioRemoteSet(UioRemote remote) {
+	uioRemote = remote;
+}
+
+int UioForward(UioJob *job) {
+	Uio *uio = uioCur;
+
+	if (uioRemote) {
+		uioRemote(job);
+		return TRUE;
+	}
+	if (!uio || uioSelf) return FALSE;
+	UioSubmit(uio, job);
+	UioWait(job);
+
+	return TRUE;
+}
+
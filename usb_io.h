@@ -0,0 +1,172 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief USB I/O thread.
+ *
+ * \defgroup usb_io usb_io
+ * \{
+ * \brief USB I/O thread.
+ *
+ * A dedicated thread owns the programmer and runs a queue of device jobs
+ * (open, read, write, erase, WiFi commands...). Jobs can be submitted
+ * asynchronously, and waited for (as futures) or completed through a
+ * callback, so host computation overlaps device I/O.
+ *
+ * While the I/O thread is running, the device functions in the commands
+ * module called from any other thread are queued as jobs and waited for,
+ * so device access is serialized no matter the thread it comes from. If
+ * the I/O thread is not running, jobs run on the calling thread. A remote
+ * handler can be installed to run them on another process instead.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _USB_IO_H_
+#define _USB_IO_H_
+
+#include <stdint.h>
+#include "util.h"
+
+/// Job types. Each one runs the commands module function of the same name
+typedef enum {
+	UIO_OPEN = 0,		///< UsbOpen(addr).
+	UIO_CLOSE,			///< UsbClose().
+	UIO_DEV_INFO,		///< UsbDevInfoGet(data, len, aux).
+	UIO_MAN_ID,			///< MDMA_manId_get(data).
+	UIO_DEV_ID,			///< MDMA_devId_get(data).
+	UIO_READ,			///< MDMA_read(len, addr, data).
+	UIO_WRITE,			///< MDMA_write(len, addr, data).
+	UIO_ERASE,			///< MDMA_range_erase_start(addr, len), or
+						///< MDMA_cart_erase_start() if len is 0.
+	UIO_SECT_ERASE,		///< MDMA_sect_erase(addr).
+	UIO_ERASE_POLL,		///< MDMA_erase_poll(len).
+	UIO_ERASE_CANCEL,	///< MDMA_erase_cancel().
+	UIO_BOOTLOADER,		///< MDMA_bootloader().
+	UIO_BUTTON,			///< MDMA_button_get(data).
+	UIO_WIFI_CMD,		///< MDMA_WiFiCmd(data, len, aux).
+	UIO_WIFI_CMD_LONG,	///< MDMA_WiFiCmdLong(data, len, aux).
+	UIO_WIFI_CTRL,		///< MDMA_WiFiCtrl(addr).
+	UIO_BUF_ALLOC		///< *(u16**)data = MDMA_BufAlloc(len), so the buffer
+						///< can use the device memory of the thread
+						///< programmer. Local only, not run by the daemon.
+} UioJobType;
+
+/// USB I/O thread
+typedef struct Uio Uio;
+
+struct UioJob;
+
+/// Called on the I/O thread when a job completes
+typedef void (*UioDone)(struct UioJob *job);
+
+/************************************************************************//**
+ * Device job. The memory of the job and its buffers must stay valid until
+ * the job completes.
+ ****************************************************************************/
+typedef struct UioJob {
+	UioJobType type;		///< Job type.
+	uint32_t addr;			///< Word address, or job specific value.
+	uint32_t len;			///< Length, or job specific value.
+	void *data;				///< Job data buffer.
+	void *aux;				///< Job auxiliary buffer.
+	UioDone done;			///< Completion callback (NULL if none).
+	void *ctx;				///< Context for the completion callback.
+	int result;				///< Value returned by the job function.
+	// Private fields
+	Uio *uio;				///< Thread running the job.
+	int finished;			///< Job completed.
+	struct UioJob *next;	///< Next job in the queue.
+} UioJob;
+
+/// Runs a job on a remote programmer, setting job->result
+typedef void (*UioRemote)(UioJob *job);
+
+/// Initializes the public fields of a job
+#define UIO_JOB(type, addr, len, data, aux)	\
+	{(type), (addr), (len), (data), (aux), NULL, NULL, 0, NULL, 0, NULL}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Starts an I/O thread. Device functions called from other threads are run
+ * on the first one started from now on, unless UioSet() selects another.
+ * The device must then be opened with UsbInit(). Several I/O threads drive
+ * several programmers, each one opening its programmer with an UIO_OPEN job.
+ *
+ * \return The I/O thread, or NULL on error.
+ ****************************************************************************/
+Uio *UioNew(void);
+
+/************************************************************************//**
+ * Runs the pending jobs and stops the I/O thread. The device should be
+ * closed with UsbClose() before.
+ *
+ * \param[in] uio I/O thread. Can be NULL.
+ ****************************************************************************/
+void UioFree(Uio *uio);
+
+/************************************************************************//**
+ * Obtains the I/O thread running the device functions called from other
+ * threads.
+ *
+ * \return The I/O thread, or NULL if not running.
+ ****************************************************************************/
+Uio *UioGet(void);
+
+/************************************************************************//**
+ * Selects the I/O thread running the device functions called from other
+ * threads.
+ *
+ * \param[in] uio I/O thread, or NULL to run them on the calling thread.
+ ****************************************************************************/
+void UioSet(Uio *uio);
+
+/************************************************************************//**
+ * Queues a job. If uio is NULL, the job runs before returning.
+ *
+ * \param[in] uio I/O thread.
+ * \param[in] job Job to queue.
+ ****************************************************************************/
+void UioSubmit(Uio *uio, UioJob *job);
+
+/************************************************************************//**
+ * Waits for a job to complete.
+ *
+ * \param[in] job Job to wait for.
+ *
+ * \return The job result.
+ ****************************************************************************/
+int UioWait(UioJob *job);
+
+/************************************************************************//**
+ * Installs a handler that runs all the device jobs, from any thread, on a
+ * remote programmer.
+ *
+ * \param[in] remote Remote job handler, or NULL to access the device.
+ ****************************************************************************/
+void UioRemoteSet(UioRemote remote);
+
+/************************************************************************//**
+ * Runs a job on the remote handler if installed. Otherwise, queues it on
+ * the running I/O thread and waits for it, unless the caller is an I/O
+ * thread or none is running. Used by the commands module to serialize
+ * device access.
+ *
+ * \param[in] job Job to run.
+ *
+ * \return TRUE if the job was run (the result is in job->result), FALSE if
+ * the caller must run it.
+ ****************************************************************************/
+int UioForward(UioJob *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_USB_IO_H_*/
+
+/** \} */
+
@@ -1,11 +1,13 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <stdint.h>
 #if defined(_WIN32) || defined(WIN32) || defined(__CYGWIN__) || defined(__MINGW32__) || defined(__BORLANDC__)
 #define __OS_WIN
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <time.h>
 #endif
 
 //=============================================================================
@@ -45,5 +47,22 @@ typedef unsigned long  u32;
 #define DelayMs(ms) usleep((ms)*1000)
 #endif
 
+/// Monotonic time in microseconds, for measuring elapsed time
+static inline uint64_t MonoUs(void) {
+#ifdef __OS_WIN
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart * 1000000 +
+			count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 #endif //_UTIL_H_
 
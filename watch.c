@@ -0,0 +1,306 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief ROM file watch mode.
+ *
+ * File changes are debounced: the file is reflashed once it has not been
+ * written for WATCH_DEBOUNCE_MS, so partially written builds are skipped.
+ * If a reflash fails, the cart contents are unknown, and the next round
+ * erases and programs all the sectors of the image.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+#include "commands.h"
+#include "progress.h"
+#include "util.h"
+
+/// Watched file
+typedef struct {
+	const char *file;	///< File name, as given by the user.
+	const char *base;	///< File name without the directory.
+#ifdef __linux__
+	int fd;				///< inotify instance, watching the file directory.
+#else
+	time_t mtime;		///< Last modification time seen.
+	off_t size;			///< Last size seen.
+#endif
+} Watch;
+
+/// Stop requested by SIGINT
+static volatile sig_atomic_t watchStop = FALSE;
+
+static void WatchSigStop(int sig) {
+	watchStop = TRUE;
+}
+
+// The directory is watched instead of the file, because builds usually
+// replace the file (e.g. by renaming a temporary file).
+static int WatchOpen(Watch *w, const char *file) {
+	const char *sep = strrchr(file, '/');
+#ifdef __linux__
+	char *dir;
+#else
+	struct stat st;
+#endif
+
+	w->file = file;
+	w->base = sep ? sep + 1 : file;
+#ifdef __linux__
+	if (!(dir = (char*)malloc(sep ? sep - file + 2 : 2))) {
+		perror("Allocating watch RAM");
+		return -1;
+	}
+	if (sep) {
+		memcpy(dir, file, sep - file + 1);
+		dir[sep - file + 1] = '\0';
+	} else strcpy(dir, ".");
+	if ((w->fd = inotify_init()) < 0 || inotify_add_watch(w->fd, dir,
+				IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror(dir);
+		if (w->fd >= 0) close(w->fd);
+		free(dir);
+		return -1;
+	}
+	free(dir);
+#else
+	if (stat(file, &st)) {
+		perror(file);
+		return -1;
+	}
+	w->mtime = st.st_mtime;
+	w->size = st.st_size;
+#endif
+
+	return 0;
+}
+
+static void WatchClose(Watch *w) {
+#ifdef __linux__
+	close(w->fd);
+#endif
+}
+
+// Waits until the file is written and then left unchanged for the debounce
+// time. Returns 0 when the file is ready, 1 if stopped.
+static int WatchWait(Watch *w) {
+	struct stat st;
+	int pending = FALSE;
+#ifdef __linux__
+	char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *e;
+	struct pollfd pfd = {w->fd, POLLIN, 0};
+	ssize_t len;
+	char *p;
+	int r;
+
+	while (!watchStop) {
+		r = poll(&pfd, 1, pending ? WATCH_DEBOUNCE_MS : WATCH_POLL_MS);
+		if (!r && pending && !stat(w->file, &st) && st.st_size) return 0;
+		if (r <= 0 || (len = read(w->fd, ev, sizeof(ev))) <= 0) continue;
+		for (p = ev; p < ev + len; p += sizeof(struct inotify_event) + e->len) {
+			e = (const struct inotify_event*)p;
+			if (e->len && !strcmp(e->name, w->base)) pending = TRUE;
+		}
+	}
+#else
+	uint64_t changed = 0;
+
+	while (!watchStop) {
+		DelayMs(WATCH_POLL_MS);
+		if (stat(w->file, &st)) continue;
+		if (st.st_mtime != w->mtime || st.st_size != w->size) {
+			w->mtime = st.st_mtime;
+			w->size = st.st_size;
+			changed = MonoUs();
+			pending = TRUE;
+		} else if (pending && st.st_size &&
+				MonoUs() - changed >= WATCH_DEBOUNCE_MS * 1000) return 0;
+	}
+#endif
+
+	return 1;
+}
+
+/// Word of an image at a cart address, 0xFFFF past the image end
+static inline u16 WatchWord(const RomImg *img, uint32_t addr, uint32_t w) {
+	return w - addr < img->len ? img->buf[w - addr] : 0xFFFF;
+}
+
+// Compares a sector of the new image against the previous one, over the
+// range [addr, addr + span). Obtains the range to program, and if the
+// sector must be erased: when a bit changes from 0 to 1, or when the sector
+// was not covered by the previous image (its contents are unknown). Returns
+// TRUE if the sector must be reflashed.
+static int WatchSectDiff(const RomImg *prev, const RomImg *img, uint32_t addr,
+		uint32_t span, uint32_t sect, int full, uint32_t *first,
+		uint32_t *end, int *erase) {
+	uint32_t lo = MAX(sect * MDMA_SECT_LEN, addr);
+	uint32_t hi = MIN((sect + 1) * MDMA_SECT_LEN, addr + span);
+	uint32_t w;
+	u16 o, n;
+
+	*erase = full || lo >= addr + prev->len;
+	*first = *end = lo;
+	if (!*erase) {
+		for (w = lo, *first = hi; w < hi; w++) {
+			o = WatchWord(prev, addr, w);
+			n = WatchWord(img, addr, w);
+			if (o == n) continue;
+			if (*first == hi) *first = w;
+			*end = w + 1;
+			if ((o & n) != n) *erase = TRUE;
+		}
+		if (*first == hi) return FALSE;
+	}
+	if (*erase) {
+		// The whole sector must be programmed again
+		*first = lo;
+		for (*end = MIN(hi, addr + img->len);
+				*end > lo && 0xFFFF == WatchWord(img, addr, *end - 1);
+				(*end)--);
+	}
+
+	return TRUE;
+}
+
+// Reflashes the sectors that differ between the previous and the new
+// image. If full is set, all the sectors are erased and programmed.
+static int WatchReflash(const RomImg *prev, const RomImg *img,
+		uint32_t addr, int full, u16 *tmp, int columns) {
+	uint32_t span = MAX(prev->len, img->len);
+	uint32_t sect, lo, hi, mid, first, end, w;
+	uint32_t nSect = 0, nErase = 0, done = 0, total = 0;
+	uint64_t start = MonoUs();
+	int erase;
+	// Address string, e.g.: 0x123456
+	char addrStr[9];
+
+	if (!span) return 0;
+	for (sect = addr / MDMA_SECT_LEN;
+			sect <= (addr + span - 1) / MDMA_SECT_LEN; sect++) {
+		nSect++;
+		if (WatchSectDiff(prev, img, addr, span, sect, full, &first, &end,
+					&erase)) total++;
+	}
+	if (!total) {
+		printf("%s unchanged.\n", img->file);
+		return 0;
+	}
+
+	printf("Reflashing %u of %u sectors of %s...\n", total, nSect, img->file);
+	PrgBegin("reflash", 0, columns);
+	for (sect = addr / MDMA_SECT_LEN;
+			sect <= (addr + span - 1) / MDMA_SECT_LEN; sect++) {
+		if (!WatchSectDiff(prev, img, addr, span, sect, full, &first, &end,
+					&erase)) continue;
+		lo = MAX(sect * MDMA_SECT_LEN, addr);
+		hi = MIN((sect + 1) * MDMA_SECT_LEN, addr + span);
+		if (erase) {
+			nErase++;
+			if (MdmaRangeErase(sect * MDMA_SECT_LEN, MDMA_SECT_LEN, 0)) {
+				PrgEnd();
+				PrintErr("\nCouldn't erase sector 0x%06X!\n",
+						sect * MDMA_SECT_LEN);
+				return -1;
+			}
+		}
+		if (end > first && MDMA_write(end - first, first,
+					img->buf + (first - addr))) {
+			PrgEnd();
+			PrintErr("\nCouldn't write sector 0x%06X!\n",
+					sect * MDMA_SECT_LEN);
+			return -1;
+		}
+		if (tmp) {
+			if (MDMA_read(hi - lo, lo, tmp)) {
+				PrgEnd();
+				PrintErr("\nCouldn't read sector 0x%06X!\n",
+						sect * MDMA_SECT_LEN);
+				return -1;
+			}
+			// Past the image end, the words must be erased
+			mid = MIN(hi, MAX(addr + img->len, lo));
+			if (memcmp(tmp, img->buf + (lo - addr), (mid - lo)<<1)) {
+				PrgEnd();
+				putchar('\n');
+				MdmaVerifyFail(lo, img->buf + (lo - addr), tmp, mid - lo);
+				return -1;
+			}
+			for (w = mid; w < hi && 0xFFFF == tmp[w - lo]; w++);
+			if (w < hi) {
+				PrgEnd();
+				putchar('\n');
+				MdmaVerifyFail(mid, NULL, tmp + (mid - lo), hi - mid);
+				return -1;
+			}
+		}
+		sprintf(addrStr, "0x%06X", hi);
+		PrgPost(++done, total, addrStr);
+	}
+	PrgEnd();
+	putchar('\n');
+	printf("Reflashed %u sector(s), %u erased, in %.2f s%s.\n", total,
+			nErase, (MonoUs() - start) / 1e6, tmp ? ", verify OK" : "");
+
+	return 0;
+}
+
+int WatchRun(const MemImage *m, RomImg *img, int verify, int columns) {
+	void (*prevSig)(int);
+	MemImage next;
+	RomImg nImg;
+	Watch w;
+	u16 *tmp = NULL;
+	int full = FALSE;
+	int err = 0;
+
+	if (WatchOpen(&w, m->file)) return -1;
+	if (verify && !(tmp = MDMA_BufAlloc(MDMA_SECT_LEN))) {
+		perror("Allocating verify buffer RAM");
+		WatchClose(&w);
+		return -1;
+	}
+
+	watchStop = FALSE;
+	prevSig = signal(SIGINT, WatchSigStop);
+	printf("Watching %s, press Ctrl+C to stop.\n", m->file);
+	fflush(stdout);
+	while (!WatchWait(&w)) {
+		// The length given by the user applies to each new build
+		next = *m;
+		if (RomImgLoad(&nImg, &next)) {
+			RomImgFree(&nImg);
+			PrintErr("Could not load %s, waiting for the next build.\n",
+					m->file);
+			continue;
+		}
+		if (WatchReflash(img, &nImg, m->addr, full, tmp, columns)) {
+			// Cart contents are unknown, reflash everything next time
+			err = 1;
+			full = TRUE;
+		} else full = FALSE;
+		RomImgFree(img);
+		*img = nImg;
+		fflush(stdout);
+	}
+	putchar('\n');
+	signal(SIGINT, prevSig);
+	MDMA_BufFree(tmp);
+	WatchClose(&w);
+
+	return err;
+}
+
@@ -0,0 +1,58 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief ROM file watch mode.
+ *
+ * \defgroup watch watch
+ * \{
+ * \brief ROM file watch mode.
+ *
+ * Monitors the flashed ROM file (with inotify on Linux, polling the file
+ * status elsewhere) and reflashes it each time a build writes it. The
+ * programmer session stays open, and the new image is compared against
+ * the previous one kept in memory, so only the changed sectors are
+ * programmed. Sectors are erased only if any bit must change from 0 to 1.
+ *
+ * \author doragasu
+ * \date   2017
+ ****************************************************************************/
+
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include "mdma.h"
+#include "rom_img.h"
+
+/// The file must stay unchanged for this time before it is reflashed (ms)
+#define WATCH_DEBOUNCE_MS	300
+/// Interval between file status checks when inotify is not available (ms)
+#define WATCH_POLL_MS		250
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************************************************************//**
+ * Watches a ROM file and reflashes the changed sectors each time it is
+ * rewritten, until SIGINT is received.
+ *
+ * \param[in]    m       Flashed file, with the address and length given by
+ *                       the user (length 0 for the whole file).
+ * \param[inout] img     Image flashed before calling. Replaced by the last
+ *                       image flashed on return.
+ * \param[in]    verify  Read back and compare the reflashed sectors.
+ * \param[in]    columns Progress bar width.
+ *
+ * \return 0 if watching stopped without errors, 1 if any reflash failed,
+ * -1 if the file cannot be watched.
+ ****************************************************************************/
+int WatchRun(const MemImage *m, RomImg *img, int verify, int columns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_WATCH_H_*/
+
+/** \} */
+